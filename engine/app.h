@@ -24,6 +24,7 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
 
@@ -218,6 +219,14 @@ typedef enum {
 APP_PUBLIC int
 APP_Init(const char *title, int width,	int height);
 
+// Like Init but without window nor display, for benchmarks on machines without X. Everything
+// is rendered to an offscreen framebuffer of width x height that stays bound, the swaps
+// just wait for the gpu and there are no input events, so the application loop must end
+// by itself. Destroy_window cleans it as well. Only available on linux, returns -1 in other
+// platforms.
+APP_PUBLIC int
+APP_Init_headless(int width, int height);
+
 // Destroys the window
 APP_PUBLIC void
 APP_Destroy_window(void);
@@ -236,6 +245,42 @@ APP_Get_window_height(void);
 APP_PUBLIC bool
 APP_Window_resized(void);
 
+// Gets if the GL context supports vertex array objects (GLES3, WebGL with
+// OES_vertex_array_object or desktop GL 3.0), if not glGenVertexArrays and
+// glBindVertexArray must not be used
+APP_PUBLIC bool
+APP_Has_vertex_arrays(void);
+
+// Gets if the GL context supports instanced draws (GLES3, WebGL with
+// ANGLE_instanced_arrays or desktop GL 3.3), if not glDrawElementsInstanced and
+// glVertexAttribDivisor must not be used
+APP_PUBLIC bool
+APP_Has_instancing(void);
+
+// Gets if the GL context can draw with GL_UNSIGNED_INT indices (GLES3, GLES2 and WebGL with
+// OES_element_index_uint or desktop GL), if not the indices must be 16 bits
+APP_PUBLIC bool
+APP_Has_uint_indices(void);
+
+// Gets if the GL context supports GL_TIME_ELAPSED queries (GLES3 and WebGL with
+// EXT_disjoint_timer_query or desktop GL with ARB_timer_query), if not glGenQueries,
+// glBeginQuery, glEndQuery and glGetQueryObjectuiv must not be used
+APP_PUBLIC bool
+APP_Has_timer_query(void);
+
+// Gets if the GPU timer was disjoint since the last call (the GPU changed its frequency, was
+// suspended...), then the results of the queries that were in flight are meaningless. Always
+// false on desktop GL, where it can't happen.
+APP_PUBLIC bool
+APP_Timer_query_disjoint(void);
+
+// Gets if the GL context can read the framebuffer without stalling: GL_PIXEL_PACK_BUFFER,
+// glMapBufferRange and fences (GLES3 or desktop GL 3.2, never on WebGL), if not
+// glMapBufferRange, glUnmapBuffer, glFenceSync, glClientWaitSync and glDeleteSync must not
+// be used
+APP_PUBLIC bool
+APP_Has_async_readback(void);
+
 
 
 // Gets if the key is down
@@ -402,6 +447,16 @@ APP_Set_swap_interval(unsigned int interval);
 APP_PUBLIC int
 APP_Run_application_loop(int(*application_frame)(void));
 
+// Called from the frame handler when nothing is changing, so the next frame would be the same.
+// Then the loop doesn't run the next frame until there is an event (input, resize, expose...)
+// or timeout nanoseconds pass, < 0 waits only for the events. It only applies after frames
+// without events, the application sees the result of the input at least on the frame that
+// processes it. The wait is left out of the frame durations.
+// Headless runs have no events and just sleep the timeout. On wasm the browser schedules the
+// frames, so this does nothing.
+APP_PUBLIC void
+APP_Idle(int64_t timeout);
+
 
 
 // Returns the nanoseconds passed from the start of the app
@@ -412,6 +467,46 @@ APP_Time(void);
 APP_PUBLIC int64_t
 APP_Frame_duration(int samples);
 
+// Frame times kept in a histogram since the start or the last APP_Reset_frame_stats, in
+// nanoseconds. The percentiles have the resolution of the buckets (APP_FRAME_HISTOGRAM_STEP),
+// the frames longer than the histogram are counted on the last bucket but max is exact.
+#define APP_FRAME_HISTOGRAM_STEP    (100*1000)
+#define APP_FRAME_HISTOGRAM_BUCKETS 2000
+typedef struct {
+	uint64_t frames;
+	uint64_t frames_over_budget; // See APP_Set_frame_budget
+	int64_t  mean;
+	int64_t  p50;
+	int64_t  p95;
+	int64_t  p99;
+	int64_t  max;
+} APP_FrameStats;
+
+APP_PUBLIC APP_FrameStats
+APP_Get_frame_stats(void);
+
+// Sets the frame time in nanoseconds above which a frame counts as over budget, 1/60 seconds
+// by default
+APP_PUBLIC void
+APP_Set_frame_budget(int64_t budget);
+
+APP_PUBLIC int64_t
+APP_Get_frame_budget(void);
+
+APP_PUBLIC void
+APP_Reset_frame_stats(void);
+
+// Copies the durations of the last frames from the newest to the oldest, at most
+// APP_MAX_FRAME_DURATIONS. Returns the number of durations copied.
+#define APP_MAX_FRAME_DURATIONS 255
+APP_PUBLIC int
+APP_Get_frame_durations(int64_t *durations, int max_durations);
+
+// Writes the stats and the histogram to a file, as JSON when the path ends with ".json" and as
+// CSV otherwise (one row per non-empty bucket: start_ms,end_ms,frames). Returns 0 on success.
+APP_PUBLIC int
+APP_Dump_frame_stats(const char *path);
+
 
 
 typedef int (*APP_SoundPlayerCallback) (void *user_data, float* buffer, int n_frames, int n_channels);
@@ -452,7 +547,10 @@ APP_Terminate_sound_player(void);
 // If we are on BUNDLED_TREE mode the data returned will be a pointer
 // to the data embeded into de binary.
 //
-// If not, the data will be heap allocated.
+// If not, on linux the file is mapped (mmap) read only, the data is
+// loaded as it's read and the pages are shared with the page cache, so
+// it must not be written. On the other platforms the data will be heap
+// allocated.
 //
 // To free this data on a safe way we have to call to Free_file_contents()
 // this function will take into account the mode.
@@ -567,6 +665,7 @@ typedef int  GLint;
 #define GL_CONSTANT_ALPHA 0x8003
 #define GL_READ_FRAMEBUFFER 0x8CA8
 #define GL_TEXTURE0 0x84C0
+#define GL_TEXTURE1 0x84C1
 #define GL_TEXTURE_MIN_LOD 0x813A
 #define GL_CLAMP_TO_EDGE 0x812F
 #define GL_UNSIGNED_SHORT_5_6_5 0x8363
@@ -591,6 +690,8 @@ typedef int  GLint;
 #define GL_STENCIL_BUFFER_BIT 0x00000400
 #define GL_REPEAT 0x2901
 #define GL_RGBA 0x1908
+#define GL_LUMINANCE 0x1909
+#define GL_LUMINANCE_ALPHA 0x190A
 #define GL_TEXTURE_CUBE_MAP_POSITIVE_X 0x8515
 #define GL_DECR 0x1E03
 #define GL_FRAGMENT_SHADER 0x8B30
@@ -645,6 +746,7 @@ typedef int  GLint;
 #define GL_STENCIL_TEST 0x0B90
 #define GL_DITHER 0x0BD0
 #define GL_DEPTH_COMPONENT16 0x81A5
+#define GL_DEPTH_COMPONENT24 0x81A6
 #define GL_EQUAL 0x0202
 #define GL_FRAMEBUFFER 0x8D40
 #define GL_RGB5 0x8050
@@ -740,6 +842,17 @@ typedef int  GLint;
 #define GL_MAX_VERTEX_UNIFORM_VECTORS 0x8DFB
 #define GL_UNPACK_ALIGNMENT 0x0CF5
 #define GL_PACK_ALIGNMENT 0x0D05
+#define GL_TIME_ELAPSED 0x88BF
+#define GL_QUERY_RESULT 0x8866
+#define GL_QUERY_RESULT_AVAILABLE 0x8867
+#define GL_PIXEL_PACK_BUFFER 0x88EB
+#define GL_STREAM_READ 0x88E1
+#define GL_MAP_READ_BIT 0x0001
+#define GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#define GL_SYNC_FLUSH_COMMANDS_BIT 0x00000001
+#define GL_TIMEOUT_EXPIRED 0x911B
+#define GL_WAIT_FAILED 0x911D
+#define GL_GPU_DISJOINT 0x8FBB
 
 #define APP__GL_FUNCS \
     APP__GL_XMACRO(glBindVertexArray,                 void, (GLuint array)) \
@@ -747,6 +860,7 @@ typedef int  GLint;
     APP__GL_XMACRO(glGenFramebuffers,                 void, (GLsizei n, GLuint * framebuffers)) \
     APP__GL_XMACRO(glBindFramebuffer,                 void, (GLenum target, GLuint framebuffer)) \
     APP__GL_XMACRO(glBindRenderbuffer,                void, (GLenum target, GLuint renderbuffer)) \
+    APP__GL_XMACRO(glGetString,                       const GLubyte *, (GLenum name)) \
     APP__GL_XMACRO(glGetStringi,                      const GLubyte *, (GLenum name, GLuint index)) \
     APP__GL_XMACRO(glClearBufferfi,                   void, (GLenum buffer, GLint drawbuffer, GLfloat depth, GLint stencil)) \
     APP__GL_XMACRO(glClearBufferfv,                   void, (GLenum buffer, GLint drawbuffer, const GLfloat * value)) \
@@ -822,10 +936,22 @@ typedef int  GLint;
     APP__GL_XMACRO(glBlendFuncSeparate,               void, (GLenum sfactorRGB, GLenum dfactorRGB, GLenum sfactorAlpha, GLenum dfactorAlpha)) \
     APP__GL_XMACRO(glTexParameteri,                   void, (GLenum target, GLenum pname, GLint param)) \
     APP__GL_XMACRO(glGetIntegerv,                     void, (GLenum pname, GLint * data)) \
+    APP__GL_XMACRO(glGenQueries,                      void, (GLsizei n, GLuint * ids)) \
+    APP__GL_XMACRO(glDeleteQueries,                   void, (GLsizei n, const GLuint * ids)) \
+    APP__GL_XMACRO(glBeginQuery,                      void, (GLenum target, GLuint id)) \
+    APP__GL_XMACRO(glEndQuery,                        void, (GLenum target)) \
+    APP__GL_XMACRO(glGetQueryObjectuiv,               void, (GLuint id, GLenum pname, GLuint * params)) \
+    APP__GL_XMACRO(glReadPixels,                      void, (GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, GLenum type, void * pixels)) \
+    APP__GL_XMACRO(glMapBufferRange,                  void *, (GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access)) \
+    APP__GL_XMACRO(glUnmapBuffer,                     GLboolean, (GLenum target)) \
+    APP__GL_XMACRO(glFenceSync,                       GLsync, (GLenum condition, GLbitfield flags)) \
+    APP__GL_XMACRO(glClientWaitSync,                  GLenum, (GLsync sync, GLbitfield flags, GLuint64 timeout)) \
+    APP__GL_XMACRO(glDeleteSync,                      void, (GLsync sync)) \
     APP__GL_XMACRO(glEnable,                          void, (GLenum cap)) \
     APP__GL_XMACRO(glBlitFramebuffer,                 void, (GLint srcX0, GLint srcY0, GLint srcX1, GLint srcY1, GLint dstX0, GLint dstY0, GLint dstX1, GLint dstY1, GLbitfield mask, GLenum filter)) \
     APP__GL_XMACRO(glStencilMask,                     void, (GLuint mask)) \
     APP__GL_XMACRO(glAttachShader,                    void, (GLuint program, GLuint shader)) \
+    APP__GL_XMACRO(glBindAttribLocation,              void, (GLuint program, GLuint index, const GLchar * name)) \
     APP__GL_XMACRO(glDetachShader,                    void, (GLuint program, GLuint shader)) \
     APP__GL_XMACRO(glGetError,                        GLenum, (void)) \
     APP__GL_XMACRO(glClearColor,                      void, (GLfloat red, GLfloat green, GLfloat blue, GLfloat alpha)) \
@@ -865,8 +991,10 @@ typedef int  GLint;
 	#undef APP__GL_XMACRO
 #elif defined(APP_WASM)
 
-	// This doesn't exist on webgl
-	void glBindVertexArray(GLuint array) {}
+	// Only available with the OES_vertex_array_object extension, see APP_Has_vertex_arrays
+    APP__WA_JS(void, glBindVertexArray, (GLuint array), {
+		Module.GLvao_ext.bindVertexArrayOES(array ? Module.GLvaos[array] : null);
+	})
 
 //    APP__WA_JS(void, glFramebufferTextureLayer, (GLenum target, GLenum attachment, GLuint texture, GLint level, GLint layer), {
 //
@@ -1127,9 +1255,10 @@ typedef int  GLint;
 //
 //	});
 
-//    APP__WA_JS(void, glVertexAttribDivisor, (GLuint index, GLuint divisor), {
-//
-//	});
+	// Only available with the ANGLE_instanced_arrays extension, see APP_Has_instancing
+    APP__WA_JS(void, glVertexAttribDivisor, (GLuint index, GLuint divisor), {
+		Module.GLinstancing_ext.vertexAttribDivisorANGLE(index, divisor);
+	})
 
     APP__WA_JS(void, glBufferSubData, (GLenum target, GLintptr offset, GLsizeiptr size, const void * data), {
 		checkHeap();
@@ -1357,9 +1486,10 @@ typedef int  GLint;
 		Module.GLctx.drawArrays(mode, first, count);
 	})
 
-//    APP__WA_JS(void, glDrawElementsInstanced, (GLenum mode, GLsizei count, GLenum type, const void * indices, GLsizei instancecount), {
-//
-//	});
+	// Only available with the ANGLE_instanced_arrays extension, see APP_Has_instancing
+    APP__WA_JS(void, glDrawElementsInstanced, (GLenum mode, GLsizei count, GLenum type, const void * indices, GLsizei instancecount), {
+		Module.GLinstancing_ext.drawElementsInstancedANGLE(mode, count, type, indices, instancecount);
+	})
 
     APP__WA_JS(void, glVertexAttribPointer, (GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const void * pointer), {
 		Module.GLctx.vertexAttribPointer(index, size, type, !!normalized, stride, pointer);
@@ -1381,9 +1511,17 @@ typedef int  GLint;
 		Module.GLctx.bindBuffer(target, buffer ? Module.GLbuffers[buffer] : null); 
 	})
 
-//    APP__WA_JS(void, glDeleteVertexArrays, (GLsizei n, const GLuint *arrays), {
-//
-//	});
+    APP__WA_JS(void, glDeleteVertexArrays, (GLsizei n, const GLuint *arrays), {
+		checkHeap();
+		for (var i = 0; i < n; i++) {
+			var id = HEAP32[(((arrays)+(i*4))>>2)];
+			var vao = Module.GLvaos[id];
+			if (!vao) continue;
+			Module.GLvao_ext.deleteVertexArrayOES(vao);
+			vao.name = 0;
+			Module.GLvaos[id] = null;
+		}
+	})
 
     APP__WA_JS(void, glDepthMask, (GLboolean flag), {
 		Module.GLctx.depthMask(!!flag);
@@ -1423,6 +1561,48 @@ typedef int  GLint;
 		Module.webGLGet(pname, data, 'Integer');
 	})
 
+	// Only available with the EXT_disjoint_timer_query extension, see APP_Has_timer_query
+    APP__WA_JS(void, glGenQueries, (GLsizei n, GLuint *ids), {
+		checkHeap();
+		for (var i = 0; i < n; i++) {
+			var query = Module.GLtimer_ext.createQueryEXT();
+			var id = Module.GLgetNewId(Module.GLqueries);
+			query.name = id;
+			Module.GLqueries[id] = query;
+			HEAP32[(((ids)+(i*4))>>2)]=id;
+		}
+	})
+
+	// Only available with the EXT_disjoint_timer_query extension, see APP_Has_timer_query
+    APP__WA_JS(void, glDeleteQueries, (GLsizei n, const GLuint *ids), {
+		checkHeap();
+		for (var i = 0; i < n; i++) {
+			var id = HEAP32[(((ids)+(i*4))>>2)];
+			var query = Module.GLqueries[id];
+			if (!query) continue;
+			Module.GLtimer_ext.deleteQueryEXT(query);
+			query.name = 0;
+			Module.GLqueries[id] = null;
+		}
+	})
+
+	// Only available with the EXT_disjoint_timer_query extension, see APP_Has_timer_query
+    APP__WA_JS(void, glBeginQuery, (GLenum target, GLuint id), {
+		Module.GLtimer_ext.beginQueryEXT(target, Module.GLqueries[id]);
+	})
+
+	// Only available with the EXT_disjoint_timer_query extension, see APP_Has_timer_query
+    APP__WA_JS(void, glEndQuery, (GLenum target), {
+		Module.GLtimer_ext.endQueryEXT(target);
+	})
+
+	// Only available with the EXT_disjoint_timer_query extension, see APP_Has_timer_query
+    APP__WA_JS(void, glGetQueryObjectuiv, (GLuint id, GLenum pname, GLuint *params), {
+		checkHeap();
+		var result = Module.GLtimer_ext.getQueryObjectEXT(Module.GLqueries[id], pname);
+		HEAPU32[((params)>>2)] = (typeof result == 'boolean') ? (result ? 1 : 0) : result;
+	})
+
     APP__WA_JS(void, glEnable, (GLenum cap), {
 		Module.GLctx.enable(cap);
 	})
@@ -1443,6 +1623,10 @@ typedef int  GLint;
 		Module.GLctx.detachShader(Module.GLprograms[program], Module.GLshaders[shader]);
 	})
 
+    APP__WA_JS(void, glBindAttribLocation, (GLuint program, GLuint index, const GLchar * name), {
+		Module.GLctx.bindAttribLocation(Module.GLprograms[program], index, Pointer_stringify(name));
+	})
+
     APP__WA_JS(GLenum, glGetError, (void), {
 		if (Module.GLlastError) {
 			var e = Module.GLlastError;
@@ -1508,8 +1692,22 @@ typedef int  GLint;
 		Module.GLctx.clear(mask);
 	})
 
-	// This doesn't exist on webgl
-    void glGenVertexArrays(GLsizei n, GLuint * arrays) {}
+	// Only available with the OES_vertex_array_object extension, see APP_Has_vertex_arrays
+    APP__WA_JS(void, glGenVertexArrays, (GLsizei n, GLuint *arrays), {
+		checkHeap();
+		for (var i = 0; i < n; i++) {
+			var vao = Module.GLvao_ext.createVertexArrayOES();
+			if (!vao) {
+				Module.GLrecordError(0x0502); // GL_INVALID_OPERATION
+				while(i < n) HEAP32[(((arrays)+(i++*4))>>2)]=0;
+				return;
+			}
+			var id = Module.GLgetNewId(Module.GLvaos);
+			vao.name = id;
+			Module.GLvaos[id] = vao;
+			HEAP32[(((arrays)+(i*4))>>2)]=id;
+		}
+	})
 
 //    APP__WA_JS(void, glFrontFace, (GLenum mode), {
 //
@@ -1560,7 +1758,7 @@ typedef enum {
 	#define APP__MAX_TOUCH_POINTS 10
 #endif
 
-#define APP__MAX_FRAME_DURATION_SAMPLES 255
+#define APP__MAX_FRAME_DURATION_SAMPLES APP_MAX_FRAME_DURATIONS
 
 //
 // Global struct that will contain all the crossplatform application data
@@ -1586,6 +1784,13 @@ APP_INTERNAL struct {
 
 	bool focus;
 
+	bool gl_has_vertex_arrays;
+	bool gl_has_instancing;
+	bool gl_has_uint_indices;
+	bool gl_has_timer_query;
+	bool gl_has_async_readback;
+	bool gl_timer_query_disjoint; // The context can report disjoint timers, see APP_Timer_query_disjoint
+
 	// NOTE(Tano): We may split this into SOA (structures of arrays) to get more performance but
 	// anyway...
 	struct {
@@ -1610,11 +1815,24 @@ APP_INTERNAL struct {
 	const char *text_input_filter;
 	unsigned int text_input_filter_len;
 
+	// See APP_Idle
+	bool idle;
+	int64_t idle_timeout;
+	bool frame_had_events;
+
 	// Manage frame duration and statistics
 	int64_t prev_time;
 	int64_t frame_duration_samples[APP__MAX_FRAME_DURATION_SAMPLES];
 	int frame_duration_samples_count;
 	int frame_duration_samples_head;
+	struct {
+		uint32_t buckets[APP_FRAME_HISTOGRAM_BUCKETS];
+		uint64_t frames;
+		uint64_t frames_over_budget;
+		int64_t  total;
+		int64_t  max;
+		int64_t  budget;
+	} frame_histogram;
 
 	// Sound player information
 	struct SoundPlayerInfo {
@@ -1667,6 +1885,76 @@ void
 Mutex_unlock(Mutex *mutex);
 
 
+#if defined(APP_LINUX)
+
+#include <semaphore.h>
+typedef sem_t Semaphore;
+
+#elif defined(APP_WINDOWS)
+
+typedef HANDLE Semaphore;
+
+#elif defined(APP_WASM)
+
+typedef int Semaphore;
+
+#endif
+
+// Counting semaphore starting at count, wait blocks until the count is over 0 and decrements it.
+// On wasm nobody could post while waiting, so waiting on 0 aborts.
+void
+Semaphore_init(Semaphore *semaphore, int count);
+
+
+void
+Semaphore_deinit(Semaphore *semaphore);
+
+
+void
+Semaphore_wait(Semaphore *semaphore);
+
+
+void
+Semaphore_post(Semaphore *semaphore);
+
+
+typedef void (*ThreadFunc)(void *arg);
+
+#if defined(APP_LINUX)
+
+typedef struct { pthread_t handle; ThreadFunc func; void *arg; } Thread;
+
+#elif defined(APP_WINDOWS)
+
+typedef struct { HANDLE handle; ThreadFunc func; void *arg; } Thread;
+
+#elif defined(APP_WASM)
+
+typedef struct { ThreadFunc func; void *arg; } Thread;
+
+#endif
+
+// Launchs a thread which calls func(arg). On wasm there are no threads, so the
+// function is called before returning.
+void
+Thread_start(Thread *thread, ThreadFunc func, void *arg);
+
+
+// Waits until the thread function returns
+void
+Thread_join(Thread *thread);
+
+
+// Number of logical processors, at least 1 (always 1 on wasm)
+int
+Thread_count_cpus(void);
+
+
+// Gives the rest of the time slice of the thread to others ready to run, it does nothing on wasm
+void
+Thread_yield(void);
+
+
 
 
 /////////////////////////////////////////////////////////////////////////////////
@@ -1698,8 +1986,10 @@ APP__Handle_frame(void);
 #if defined (APP_LINUX)
 
 	APP_INTERNAL int     APP__linux_Init(const char *title, int width, int height);
+	APP_INTERNAL int     APP__linux_Init_headless(int width, int height);
 	APP_INTERNAL void    APP__linux_Shutdown(void);
 	APP_INTERNAL void    APP__linux_Process_events(void);
+	APP_INTERNAL void    APP__linux_Wait_events(int64_t timeout);
 	APP_INTERNAL void    APP__linux_Swap_buffers(void);
 	APP_INTERNAL void    APP__linux_Set_fullscreen(bool enable);
 	APP_INTERNAL void    APP__linux_Set_swap_interval(unsigned int interval);
@@ -1712,6 +2002,7 @@ APP__Handle_frame(void);
 	APP_INTERNAL int     APP__win32_Init(const char *title, int width, int height);
 	APP_INTERNAL void    APP__win32_Shutdown(void);
 	APP_INTERNAL void    APP__win32_Process_events(void);
+	APP_INTERNAL void    APP__win32_Wait_events(int64_t timeout);
 	APP_INTERNAL void    APP__win32_Swap_buffers(void);
 	APP_INTERNAL void    APP__win32_Set_fullscreen(bool enable);
 	APP_INTERNAL void    APP__win32_Set_swap_interval(unsigned int interval);
@@ -1734,8 +2025,8 @@ APP__Handle_frame(void);
 	APP_INTERNAL int64_t APP__wasm_Time(void);
 #endif
 
-APP_PUBLIC int
-APP_Init(const char *title, int width, int height) {
+APP_INTERNAL void
+APP__Init_data(void) {
 
 	APP__data.focus = true;
 
@@ -1744,6 +2035,14 @@ APP_Init(const char *title, int width, int height) {
 		APP__data.touch_points[i].id = -1;
 	}
 
+	APP__data.frame_histogram.budget = 1000000000/60;
+}
+
+APP_PUBLIC int
+APP_Init(const char *title, int width, int height) {
+
+	APP__Init_data();
+
 	#if defined (APP_LINUX)
 		return APP__linux_Init(title, width, height);
 	#elif defined (APP_WINDOWS)
@@ -1755,6 +2054,19 @@ APP_Init(const char *title, int width, int height) {
 	APP__data.prev_time = APP_Time();
 }
 
+APP_PUBLIC int
+APP_Init_headless(int width, int height) {
+
+	APP__Init_data();
+
+	#if defined (APP_LINUX)
+		return APP__linux_Init_headless(width, height);
+	#else
+		(void)width; (void)height;
+		return -1;
+	#endif
+}
+
 // Destroys the window
 APP_PUBLIC void
 APP_Destroy_window(void) {
@@ -1784,6 +2096,47 @@ APP_Window_resized(void) {
 	return APP__data.window_resized;
 }
 
+APP_PUBLIC bool
+APP_Has_vertex_arrays(void) {
+	return APP__data.gl_has_vertex_arrays;
+}
+
+APP_PUBLIC bool
+APP_Has_instancing(void) {
+	return APP__data.gl_has_instancing;
+}
+
+APP_PUBLIC bool
+APP_Has_uint_indices(void) {
+	return APP__data.gl_has_uint_indices;
+}
+
+APP_PUBLIC bool
+APP_Has_timer_query(void) {
+	return APP__data.gl_has_timer_query;
+}
+
+APP_PUBLIC bool
+APP_Has_async_readback(void) {
+	return APP__data.gl_has_async_readback;
+}
+
+#if !defined(APP_WASM)
+APP_PUBLIC bool
+APP_Timer_query_disjoint(void) {
+	if (!APP__data.gl_timer_query_disjoint) return false;
+	GLint disjoint = 0;
+	glGetIntegerv(GL_GPU_DISJOINT, &disjoint);
+	return disjoint != 0;
+}
+#endif
+
+APP_PUBLIC void
+APP_Idle(int64_t timeout) {
+	APP__data.idle = true;
+	APP__data.idle_timeout = timeout;
+}
+
 APP_PUBLIC bool
 APP_Quit_requested(void) {
 	return APP__data.quit_requested;
@@ -2007,6 +2360,107 @@ APP_Frame_duration(int samples) {
 	return acum;
 }
 
+APP_INTERNAL int64_t
+APP__Frame_percentile(double percentile) {
+	uint64_t frames = APP__data.frame_histogram.frames;
+	if (frames == 0) return 0;
+	// The first frame that reaches the percentile, it's in the bucket that ends at the result
+	uint64_t target = (uint64_t)(percentile*(double)frames);
+	if (target == 0) target = 1;
+	uint64_t acum = 0;
+	for (int i = 0; i < APP_FRAME_HISTOGRAM_BUCKETS; i+=1) {
+		acum += APP__data.frame_histogram.buckets[i];
+		if (acum >= target) {
+			int64_t end = (int64_t)(i+1)*APP_FRAME_HISTOGRAM_STEP;
+			return (end < APP__data.frame_histogram.max) ? end : APP__data.frame_histogram.max;
+		}
+	}
+	return APP__data.frame_histogram.max;
+}
+
+APP_PUBLIC APP_FrameStats
+APP_Get_frame_stats(void) {
+	APP_FrameStats result = {0};
+	result.frames             = APP__data.frame_histogram.frames;
+	result.frames_over_budget = APP__data.frame_histogram.frames_over_budget;
+	if (result.frames > 0) result.mean = APP__data.frame_histogram.total / (int64_t)result.frames;
+	result.p50 = APP__Frame_percentile(0.50);
+	result.p95 = APP__Frame_percentile(0.95);
+	result.p99 = APP__Frame_percentile(0.99);
+	result.max = APP__data.frame_histogram.max;
+	return result;
+}
+
+APP_PUBLIC void
+APP_Set_frame_budget(int64_t budget) {
+	APP__data.frame_histogram.budget = budget;
+}
+
+APP_PUBLIC int64_t
+APP_Get_frame_budget(void) {
+	return APP__data.frame_histogram.budget;
+}
+
+APP_PUBLIC void
+APP_Reset_frame_stats(void) {
+	int64_t budget = APP__data.frame_histogram.budget;
+	memset(&APP__data.frame_histogram, 0, sizeof(APP__data.frame_histogram));
+	APP__data.frame_histogram.budget = budget;
+}
+
+APP_PUBLIC int
+APP_Get_frame_durations(int64_t *durations, int max_durations) {
+	int count = APP__data.frame_duration_samples_count;
+	if (count > max_durations) count = max_durations;
+	int head = APP__data.frame_duration_samples_head;
+	for (int i = 0; i < count; i+=1) {
+		durations[i] = APP__data.frame_duration_samples[(head+i)%APP__MAX_FRAME_DURATION_SAMPLES];
+	}
+	return count;
+}
+
+APP_PUBLIC int
+APP_Dump_frame_stats(const char *path) {
+	FILE *file = fopen(path, "wb");
+	if (file == NULL) return -1;
+
+	APP_FrameStats stats = APP_Get_frame_stats();
+	size_t path_len = strlen(path);
+	bool json = (path_len >= 5 && strcmp(&path[path_len-5], ".json") == 0);
+	const double MS = 1e-6;
+
+	if (json) {
+		fprintf(file, "{\n\t\"frames\": %llu,\n\t\"frames_over_budget\": %llu,\n\t\"budget_ms\": %.3f,\n",
+				(unsigned long long)stats.frames, (unsigned long long)stats.frames_over_budget,
+				(double)APP__data.frame_histogram.budget*MS);
+		fprintf(file, "\t\"mean_ms\": %.3f,\n\t\"p50_ms\": %.3f,\n\t\"p95_ms\": %.3f,\n\t\"p99_ms\": %.3f,\n\t\"max_ms\": %.3f,\n",
+				(double)stats.mean*MS, (double)stats.p50*MS, (double)stats.p95*MS, (double)stats.p99*MS, (double)stats.max*MS);
+		fprintf(file, "\t\"bucket_ms\": %.3f,\n\t\"histogram\": [", (double)APP_FRAME_HISTOGRAM_STEP*MS);
+		// Only the buckets up to the last non-empty one
+		int last = APP_FRAME_HISTOGRAM_BUCKETS-1;
+		while (last > 0 && APP__data.frame_histogram.buckets[last] == 0) last -= 1;
+		for (int i = 0; i <= last; i+=1) {
+			fprintf(file, "%s%u", (i == 0) ? "" : ",", APP__data.frame_histogram.buckets[i]);
+		}
+		fprintf(file, "]\n}\n");
+	}
+	else {
+		fprintf(file, "start_ms,end_ms,frames\n");
+		for (int i = 0; i < APP_FRAME_HISTOGRAM_BUCKETS; i+=1) {
+			if (APP__data.frame_histogram.buckets[i] == 0) continue;
+			// The last bucket has the longer frames too
+			int64_t end = (int64_t)(i+1)*APP_FRAME_HISTOGRAM_STEP;
+			if (i == APP_FRAME_HISTOGRAM_BUCKETS-1) end = stats.max;
+			fprintf(file, "%.3f,%.3f,%u\n", (double)i*APP_FRAME_HISTOGRAM_STEP*MS, (double)end*MS,
+					APP__data.frame_histogram.buckets[i]);
+		}
+	}
+
+	int result = ferror(file) ? -1 : 0;
+	fclose(file);
+	return result;
+}
+
 
 APP_INTERNAL bool
 APP__Is_char_filtered(char c) {
@@ -2199,6 +2653,19 @@ APP__Handle_frame(void) {
 		APP__data.frame_duration_samples_count += 1;
 	}
 
+	// The first frame also counts the initialization, it's left out of the histogram
+	if (APP__data.frame_duration_samples_count > 1) {
+		int bucket = (int)(frame_duration / APP_FRAME_HISTOGRAM_STEP);
+		if (bucket >= APP_FRAME_HISTOGRAM_BUCKETS) bucket = APP_FRAME_HISTOGRAM_BUCKETS-1;
+		if (bucket < 0) bucket = 0;
+		APP__data.frame_histogram.buckets[bucket] += 1;
+		APP__data.frame_histogram.frames += 1;
+		APP__data.frame_histogram.total  += frame_duration;
+		if (frame_duration > APP__data.frame_histogram.max) APP__data.frame_histogram.max = frame_duration;
+		if (frame_duration > APP__data.frame_histogram.budget) APP__data.frame_histogram.frames_over_budget += 1;
+	}
+
+	APP__data.frame_had_events = false;
 	#if defined (APP_LINUX)
 		APP__linux_Process_events();
 	#elif defined (APP_WINDOWS)
@@ -2227,6 +2694,19 @@ APP__Handle_frame(void) {
 		APP__win32_Swap_buffers();
 	#endif
 
+	if (result == 0 && APP__data.idle && !APP__data.frame_had_events) {
+		int64_t wait_start = APP_Time();
+		#if defined (APP_LINUX)
+			APP__linux_Wait_events(APP__data.idle_timeout);
+		#elif defined (APP_WINDOWS)
+			APP__win32_Wait_events(APP__data.idle_timeout);
+		#endif
+		// The next frame duration starts after the wait, to not count it on the stats and not
+		// make a jump on the animations
+		APP__data.prev_time += APP_Time() - wait_start;
+	}
+	APP__data.idle = false;
+
 	return result;
 }
 
@@ -2775,6 +3255,16 @@ APP__win32_Init(const char *title, int width, int height) {
 		#define APP__GL_XMACRO(name, ret, args) name = (PFN_ ## name) APP__Load_gl_function(#name);
 			APP__GL_FUNCS
     	#undef APP__GL_XMACRO
+
+		APP__data.gl_has_vertex_arrays = (glGenVertexArrays && glBindVertexArray && glDeleteVertexArrays);
+		APP__data.gl_has_instancing    = (glDrawElementsInstanced && glVertexAttribDivisor);
+		APP__data.gl_has_uint_indices  = true;
+
+		const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+		APP__data.gl_has_timer_query = glGenQueries && glBeginQuery && glGetQueryObjectuiv &&
+			extensions && strstr(extensions, "GL_ARB_timer_query");
+		APP__data.gl_has_async_readback = glMapBufferRange && glUnmapBuffer && glFenceSync &&
+			glClientWaitSync && glDeleteSync;
 	}
 
 	{ // INIT APP TIME
@@ -2868,6 +3358,7 @@ APP_INTERNAL void
 APP__win32_Process_events() {
 	MSG msg;
 	while (PeekMessageW(&msg, NULL, 0, 0, PM_REMOVE)) {
+		APP__data.frame_had_events = true;
 		if (WM_QUIT == msg.message) {
 			APP__data.quit_requested = true;
 			continue;
@@ -2879,6 +3370,13 @@ APP__win32_Process_events() {
 	}
 }
 
+APP_INTERNAL void
+APP__win32_Wait_events(int64_t timeout) {
+	DWORD milliseconds = (timeout < 0) ? INFINITE : (DWORD)(timeout/1000000);
+	// MWMO_INPUTAVAILABLE also wakes with the messages that were already in the queue
+	MsgWaitForMultipleObjectsEx(0, NULL, milliseconds, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+}
+
 APP_INTERNAL void
 APP__win32_Swap_buffers(void) {
 	/* get rendered buffer to the screen */
@@ -3238,6 +3736,68 @@ Mutex_unlock(Mutex *mutex) {
 	}
 }
 
+void
+Semaphore_init(Semaphore *semaphore, int count) {
+	*semaphore = CreateSemaphore(NULL, count, 0x7fffffff, NULL);
+	if (*semaphore == NULL) {
+		abort();
+	}
+}
+
+void
+Semaphore_deinit(Semaphore *semaphore) {
+	CloseHandle(*semaphore);
+}
+
+void
+Semaphore_wait(Semaphore *semaphore) {
+	if (WAIT_OBJECT_0 != WaitForSingleObject(*semaphore, INFINITE)) {
+		abort();
+	}
+}
+
+void
+Semaphore_post(Semaphore *semaphore) {
+	if (!ReleaseSemaphore(*semaphore, 1, NULL)) {
+		abort();
+	}
+}
+
+static DWORD WINAPI
+APP__Thread_main(LPVOID param) {
+	Thread *thread = (Thread *)param;
+	thread->func(thread->arg);
+	return 0;
+}
+
+void
+Thread_start(Thread *thread, ThreadFunc func, void *arg) {
+	thread->func = func;
+	thread->arg  = arg;
+	thread->handle = CreateThread(NULL, 0, APP__Thread_main, thread, 0, 0);
+	if (thread->handle == NULL) {
+		abort();
+	}
+}
+
+void
+Thread_join(Thread *thread) {
+	WaitForSingleObject(thread->handle, INFINITE);
+	CloseHandle(thread->handle);
+}
+
+int
+Thread_count_cpus(void) {
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+}
+
+void
+Thread_yield(void) {
+	SwitchToThread();
+}
+
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -3291,8 +3851,10 @@ Get_file_modify_time(const char *filename) {
 #elif defined(APP_LINUX)
 
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include <EGL/eglplatform.h>
 #include <time.h>
+#include <sys/select.h>
 #include <X11/keysym.h>
 #include <X11/Xcursor/Xcursor.h>
 
@@ -3318,6 +3880,11 @@ static struct {
 	EGLContext egl_context;
 	EGLSurface egl_surface;
 
+	// Headless runs have no X display, everything is rendered to this framebuffer
+	bool   headless;
+	GLuint headless_framebuffer;
+	GLuint headless_renderbuffers[2]; // Color and depth
+
 	// APP TIME
 	struct timespec initial_time;
 
@@ -3325,6 +3892,72 @@ static struct {
 
 
 
+// Creates the context with the egl display, config and surface already set and makes it
+// current, the surface can be EGL_NO_SURFACE if the display supports surfaceless contexts.
+// Returns -1 on failure, the caller cleans everything.
+APP_INTERNAL int
+APP__linux_Make_context(void) {
+	// We ask for GLES3 to get the vertex array objects, the shaders are GLES2 so we can
+	// fallback to a GLES2 context
+	EGLint ctxattr[] = {
+	   EGL_CONTEXT_CLIENT_VERSION, 3,
+	   EGL_NONE
+	};
+
+	APP__x11_data.egl_context = eglCreateContext(
+			APP__x11_data.egl_display,
+			APP__x11_data.egl_conf,
+			EGL_NO_CONTEXT,
+			ctxattr
+	);
+	APP__data.gl_has_vertex_arrays = true;
+	APP__data.gl_has_instancing    = true;
+	APP__data.gl_has_uint_indices  = true;
+	if (APP__x11_data.egl_context == EGL_NO_CONTEXT) {
+		ctxattr[1] = 2;
+		APP__x11_data.egl_context = eglCreateContext(
+				APP__x11_data.egl_display,
+				APP__x11_data.egl_conf,
+				EGL_NO_CONTEXT,
+				ctxattr
+		);
+		APP__data.gl_has_vertex_arrays = false;
+		APP__data.gl_has_instancing    = false;
+		APP__data.gl_has_uint_indices  = false; // Checked when the context is current
+	}
+	if (APP__x11_data.egl_context == EGL_NO_CONTEXT) {
+	    fprintf(stderr, "CreateContext, EGL eglError: %d\n", eglGetError() );
+	    return -1;
+	}
+	
+	//
+	// WARNING LEAK!!!!
+	// This generates a leak, no idea why....
+	//
+	if (eglMakeCurrent(
+			APP__x11_data.egl_display,
+			APP__x11_data.egl_surface,
+			APP__x11_data.egl_surface,
+			APP__x11_data.egl_context
+	) != EGL_TRUE) {
+	    fprintf(stderr, "MakeCurrent, EGL eglError: %d\n", eglGetError() );
+	    return -1;
+	}
+
+	const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+	if (!APP__data.gl_has_uint_indices) {
+		APP__data.gl_has_uint_indices = extensions && strstr(extensions, "GL_OES_element_index_uint");
+	}
+	// The queries are core on GLES3, GLES2 would need the EXT functions
+	APP__data.gl_has_timer_query = APP__data.gl_has_instancing &&
+		extensions && strstr(extensions, "GL_EXT_disjoint_timer_query");
+	APP__data.gl_timer_query_disjoint = APP__data.gl_has_timer_query;
+	// Core on GLES3
+	APP__data.gl_has_async_readback = APP__data.gl_has_vertex_arrays;
+	return 0;
+}
+
+
 APP_INTERNAL int
 APP__linux_Init(const char *title, int width, int height) {
 
@@ -3408,11 +4041,6 @@ APP__linux_Init(const char *title, int width, int height) {
     	EGLint num_config;
     	EGLint major, minor;
 
-    	EGLint ctxattr[] = {
-    	   EGL_CONTEXT_CLIENT_VERSION, 2,
-    	   EGL_NONE
-    	};
-
     	APP__x11_data.egl_display = eglGetDisplay((EGLNativeDisplayType)APP__x11_data.xdisplay);
     	if (APP__x11_data.egl_display == EGL_NO_DISPLAY) {
     	    fprintf(stderr, "Error getting EGL display\n");
@@ -3450,35 +4078,108 @@ APP__linux_Init(const char *title, int width, int height) {
     	    return -1;
     	}
 
-    	APP__x11_data.egl_context = eglCreateContext(
-				APP__x11_data.egl_display,
-				APP__x11_data.egl_conf,
-				EGL_NO_CONTEXT,
-				ctxattr
-		);
-    	if (APP__x11_data.egl_context == EGL_NO_CONTEXT) {
-    	    fprintf(stderr, "CreateContext, EGL eglError: %d\n", eglGetError() );
+    	if (0 != APP__linux_Make_context()) {
 			APP_Destroy_window();
     	    return -1;
     	}
-		
-		//
-		// WARNING LEAK!!!!
-		// This generates a leak, no idea why....
-		//
-		if (eglMakeCurrent(
+	}
+
+	APP_Set_swap_interval(1);
+
+	return 0;
+}
+
+// Without X display: the mesa surfaceless platform is used when it's available (llvmpipe on
+// the CI), otherwise the default display. The context is surfaceless if the display allows it
+// or gets a 1x1 pbuffer, the real target is a framebuffer of width x height that stays bound.
+APP_INTERNAL int
+APP__linux_Init_headless(int width, int height) {
+
+	APP__data.default_width  = width;
+	APP__data.default_height = height;
+	APP__data.w_width  = width;
+	APP__data.w_height = height;
+	APP__x11_data.headless = true;
+
+	const char *client_extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+		(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	APP__x11_data.egl_display = EGL_NO_DISPLAY;
+	if (get_platform_display && client_extensions && strstr(client_extensions, "EGL_MESA_platform_surfaceless")) {
+		APP__x11_data.egl_display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	}
+	if (APP__x11_data.egl_display == EGL_NO_DISPLAY) {
+		APP__x11_data.egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	}
+	if (APP__x11_data.egl_display == EGL_NO_DISPLAY) {
+	    fprintf(stderr, "Error getting EGL display\n");
+	    return -1;
+	}
+
+	EGLint major, minor;
+	if (eglInitialize(APP__x11_data.egl_display, &major, &minor) != EGL_TRUE) {
+	    fprintf(stderr, "Error initializing EGL\n");
+		APP_Destroy_window();
+	    return -1;
+	}
+
+	EGLint attr[] = {
+	    EGL_SURFACE_TYPE,    EGL_PBUFFER_BIT,
+	    EGL_RED_SIZE,        8,
+	    EGL_GREEN_SIZE,      8,
+	    EGL_BLUE_SIZE,       8,
+	    EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+	    EGL_NONE
+	};
+	EGLint num_config;
+	if (!eglChooseConfig(APP__x11_data.egl_display, attr, &APP__x11_data.egl_conf, 1, &num_config) ||
+		num_config != 1) {
+	    fprintf(stderr, "Failed to choose config (eglError: %x)\n", eglGetError());
+		APP_Destroy_window();
+	    return -1;
+	}
+
+	const char *extensions = eglQueryString(APP__x11_data.egl_display, EGL_EXTENSIONS);
+	APP__x11_data.egl_surface = EGL_NO_SURFACE;
+	if (!extensions || !strstr(extensions, "EGL_KHR_surfaceless_context")) {
+		EGLint pbuffer_attr[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+		APP__x11_data.egl_surface = eglCreatePbufferSurface(
 				APP__x11_data.egl_display,
-				APP__x11_data.egl_surface,
-				APP__x11_data.egl_surface,
-				APP__x11_data.egl_context
-		) != EGL_TRUE) {
-    	    fprintf(stderr, "MakeCurrent, EGL eglError: %d\n", eglGetError() );
+				APP__x11_data.egl_conf,
+				pbuffer_attr
+		);
+		if (APP__x11_data.egl_surface == EGL_NO_SURFACE) {
+		    fprintf(stderr, "CreatePbufferSurface, EGL eglError: %d\n", eglGetError());
 			APP_Destroy_window();
-    	    return -1;
+		    return -1;
 		}
 	}
 
-	APP_Set_swap_interval(1);
+	if (0 != APP__linux_Make_context()) {
+		APP_Destroy_window();
+		return -1;
+	}
+
+	GLuint *renderbuffers = APP__x11_data.headless_renderbuffers;
+	glGenRenderbuffers(2, renderbuffers);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+	// Same depth than the window config, GLES2 only has 16 bits without extensions
+	GLenum depth_format = APP__data.gl_has_vertex_arrays ? GL_DEPTH_COMPONENT24 : GL_DEPTH_COMPONENT16;
+	glRenderbufferStorage(GL_RENDERBUFFER, depth_format, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	glGenFramebuffers(1, &APP__x11_data.headless_framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, APP__x11_data.headless_framebuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+	    fprintf(stderr, "Headless framebuffer incomplete\n");
+		APP_Destroy_window();
+	    return -1;
+	}
+	glViewport(0, 0, width, height);
 
 	return 0;
 }
@@ -3505,6 +4206,7 @@ APP__X11_send_event(Atom type, int a, int b, int c, int d, int e) {
 
 APP_INTERNAL void
 APP__linux_Set_fullscreen(bool enable) {
+	if (APP__x11_data.headless) return;
 	/* NOTE: this function must be called after XMapWindow (which happens in _sAPP_x11_show_window()) */
     if (APP__x11_data.NET_WM_STATE && APP__x11_data.NET_WM_STATE_FULLSCREEN) {
         if (enable) {
@@ -3528,6 +4230,7 @@ APP__linux_Set_fullscreen(bool enable) {
 
 APP_INTERNAL void
 APP__linux_Show_mouse(bool show) {
+	if (APP__x11_data.headless) return;
     if (show) {
         XUndefineCursor(APP__x11_data.xdisplay, APP__x11_data.win);
     }
@@ -3538,6 +4241,7 @@ APP__linux_Show_mouse(bool show) {
 
 APP_INTERNAL void
 APP__linux_Set_window_title(const char *title) {
+	if (APP__x11_data.headless) return;
 	XStoreName(APP__x11_data.xdisplay, APP__x11_data.win, title);
 	XFlush(APP__x11_data.xdisplay);
 }
@@ -3550,6 +4254,11 @@ APP__linux_Shutdown(void) {
 		// everything.
 		glFinish();
 
+		if (APP__x11_data.headless_framebuffer) {
+			glDeleteFramebuffers(1, &APP__x11_data.headless_framebuffer);
+			glDeleteRenderbuffers(2, APP__x11_data.headless_renderbuffers);
+		}
+
 		// This unbinds the context, must be done before destroy the context.
 		if (EGL_TRUE != eglMakeCurrent(
 					APP__x11_data.egl_display,
@@ -3561,7 +4270,8 @@ APP__linux_Shutdown(void) {
 		}
 		
 		// Destroys the surface and the context
-   		if (eglDestroySurface(APP__x11_data.egl_display, APP__x11_data.egl_surface) != EGL_TRUE) {
+   		if (APP__x11_data.egl_surface != EGL_NO_SURFACE &&
+			eglDestroySurface(APP__x11_data.egl_display, APP__x11_data.egl_surface) != EGL_TRUE) {
    		 	fprintf(stderr, "Error, cannot destroy egl surface.\n");
    		}
 		if (eglDestroyContext(APP__x11_data.egl_display, APP__x11_data.egl_context) != EGL_TRUE) {
@@ -3574,6 +4284,8 @@ APP__linux_Shutdown(void) {
    		}
 	}
 
+	if (APP__x11_data.headless) return;
+
 	XDestroyIC(APP__x11_data.xic);
 	XCloseIM(APP__x11_data.xim);
 	XUnmapWindow(APP__x11_data.xdisplay, APP__x11_data.win);
@@ -3586,11 +4298,18 @@ APP__linux_Shutdown(void) {
 
 APP_INTERNAL void
 APP__linux_Set_swap_interval(unsigned int interval) {
+	if (APP__x11_data.headless) return;
 	eglSwapInterval(APP__x11_data.egl_display, interval);
 }
 
 APP_INTERNAL void
 APP__linux_Swap_buffers() {
+	if (APP__x11_data.headless) {
+		// Nothing throttles the frames like the swap does, waiting keeps the frame times
+		// meaningful for the benchmarks
+		glFinish();
+		return;
+	}
 	/* get rendered buffer to the screen */
 	eglSwapBuffers (APP__x11_data.egl_display, APP__x11_data.egl_surface);
 }
@@ -3750,9 +4469,12 @@ APP__Translate_mouse_button(unsigned int button) {
 
 APP_INTERNAL void
 APP__linux_Process_events() {
+	if (APP__x11_data.headless) return;
 
 	XEvent event;
-	for (int remaining_events = XPending(APP__x11_data.xdisplay);
+	int pending_events = XPending(APP__x11_data.xdisplay);
+	if (pending_events > 0) APP__data.frame_had_events = true;
+	for (int remaining_events = pending_events;
 		remaining_events > 0;
 		--remaining_events) {
 
@@ -3867,6 +4589,31 @@ APP__linux_Process_events() {
 
 
 
+APP_INTERNAL void
+APP__linux_Wait_events(int64_t timeout) {
+	const int64_t SECOND = 1000*1000*1000;
+	if (APP__x11_data.headless) {
+		if (timeout > 0) {
+			struct timespec duration = {timeout/SECOND, timeout%SECOND};
+			nanosleep(&duration, NULL);
+		}
+		return;
+	}
+
+	// Xlib could have read the events from the connection already, XPending also flushes the
+	// requests to the server
+	if (XPending(APP__x11_data.xdisplay) > 0) return;
+
+	int fd = ConnectionNumber(APP__x11_data.xdisplay);
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET(fd, &fds);
+	struct timeval duration;
+	duration.tv_sec  = timeout/SECOND;
+	duration.tv_usec = (timeout%SECOND)/1000;
+	select(fd+1, &fds, NULL, NULL, (timeout < 0) ? NULL : &duration);
+}
+
 APP_INTERNAL int64_t
 APP__linux_Time(void) {
 	struct timespec current;
@@ -4070,6 +4817,8 @@ APP_Terminate_sound_player(void) {
 ////////////////////////////////////////////////////////////////////////////////
 
 #include <pthread.h> 
+#include <unistd.h> // sysconf
+#include <errno.h>
 
 void
 Mutex_init(Mutex *mutex) {
@@ -4096,6 +4845,66 @@ Mutex_unlock(Mutex *mutex) {
 	}
 }
 
+void
+Semaphore_init(Semaphore *semaphore, int count) {
+	if (sem_init(semaphore, 0, (unsigned int)count) != 0) {
+		abort();
+	}
+}
+
+void
+Semaphore_deinit(Semaphore *semaphore) {
+	sem_destroy(semaphore);
+}
+
+void
+Semaphore_wait(Semaphore *semaphore) {
+	// Signals can interrupt the wait
+	while (sem_wait(semaphore) != 0) {
+		if (errno != EINTR) abort();
+	}
+}
+
+void
+Semaphore_post(Semaphore *semaphore) {
+	if (sem_post(semaphore) != 0) {
+		abort();
+	}
+}
+
+static void *
+APP__Thread_main(void *param) {
+	Thread *thread = (Thread *)param;
+	thread->func(thread->arg);
+	return NULL;
+}
+
+void
+Thread_start(Thread *thread, ThreadFunc func, void *arg) {
+	thread->func = func;
+	thread->arg  = arg;
+	if (pthread_create(&thread->handle, NULL, APP__Thread_main, thread) != 0) {
+		abort();
+	}
+}
+
+void
+Thread_join(Thread *thread) {
+	pthread_join(thread->handle, NULL);
+}
+
+int
+Thread_count_cpus(void) {
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (int)count : 1;
+}
+
+#include <sched.h>
+void
+Thread_yield(void) {
+	sched_yield();
+}
+
 
 
 
@@ -4128,6 +4937,61 @@ Get_file_modify_time(const char *filename) {
 #endif
 
 
+#if !defined(BUNDLED_TREE)
+#include <sys/mman.h>
+#include <fcntl.h>
+
+// The file is mapped after a page that keeps the size of the whole mapping. The mapping has a
+// page more than the file needs, the bytes past the end of the file are 0 so the data is always
+// NULL terminated.
+static uint8_t *
+APP__linux_Map_file(const char *filename, uint32_t *size) {
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode) || (uint64_t)file_stat.st_size >= UINT32_MAX) {
+		close(fd);
+		return NULL;
+	}
+	size_t file_size = (size_t)file_stat.st_size;
+	size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	size_t mapping_size = page_size + (file_size/page_size + 1)*page_size;
+
+	uint8_t *mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapping == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	memcpy(mapping, &mapping_size, sizeof(mapping_size));
+	mprotect(mapping, mapping_size, PROT_READ);
+
+	uint8_t *data = mapping + page_size;
+	if (file_size > 0) {
+		if (mmap(data, file_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+			munmap(mapping, mapping_size);
+			close(fd);
+			return NULL;
+		}
+		madvise(data, file_size, MADV_WILLNEED);
+	}
+	close(fd); // The mapping keeps the file
+
+	if (size) {*size = (uint32_t)file_size;}
+	return data;
+}
+
+static void
+APP__linux_Unmap_file(uint8_t *data) {
+	uint8_t *mapping = data - sysconf(_SC_PAGESIZE);
+	size_t mapping_size;
+	memcpy(&mapping_size, mapping, sizeof(mapping_size));
+	munmap(mapping, mapping_size);
+}
+#endif
+
+
 
 
 
@@ -4266,6 +5130,8 @@ APP__WA_JS(void, APP__JS_Init, (void), {
 	Module.GLlastError;
 	Module.GLcounter = 1;
 	Module.GLbuffers = [];
+	Module.GLvaos = [];
+	Module.GLqueries = [];
 	Module.GLprograms = [];
 	Module.GLframebuffers = [];
 	Module.GLtextures = [];
@@ -4299,8 +5165,10 @@ APP__WA_JS(void, APP__JS_Init, (void), {
 	}
 
 	// Enable the needed extensions
-	// TODO(Tano) store if the extension was found or something to query later...
-	Module.GLctx.getExtension("OES_element_index_uint"); // unsigned int support en DrawElements
+	Module.GLuint_ext = Module.GLctx.getExtension("OES_element_index_uint"); // null if not supported
+	Module.GLvao_ext = Module.GLctx.getExtension("OES_vertex_array_object"); // null if not supported
+	Module.GLinstancing_ext = Module.GLctx.getExtension("ANGLE_instanced_arrays"); // null if not supported
+	Module.GLtimer_ext = Module.GLctx.getExtension("EXT_disjoint_timer_query"); // null if not supported
 	
 	Module.GLgetNewId = function(table) {
 		var ret = Module.GLcounter++;
@@ -4546,6 +5414,32 @@ APP__WA_JS(bool, APP__JS_Window_has_focus, (void), {
 	return document.hasFocus();
 });
 
+APP__WA_JS(bool, APP__JS_Has_vertex_arrays, (void), {
+	return Module.GLvao_ext ? true : false;
+});
+
+APP__WA_JS(bool, APP__JS_Has_instancing, (void), {
+	return Module.GLinstancing_ext ? true : false;
+});
+
+APP__WA_JS(bool, APP__JS_Has_uint_indices, (void), {
+	return Module.GLuint_ext ? true : false;
+});
+
+APP__WA_JS(bool, APP__JS_Has_timer_query, (void), {
+	return Module.GLtimer_ext ? true : false;
+});
+
+APP__WA_JS(bool, APP__JS_Timer_query_disjoint, (void), {
+	return Module.GLctx.getParameter(Module.GLtimer_ext.GPU_DISJOINT_EXT) ? true : false;
+});
+
+APP_PUBLIC bool
+APP_Timer_query_disjoint(void) {
+	if (!APP__data.gl_has_timer_query) return false;
+	return APP__JS_Timer_query_disjoint();
+}
+
 
 
 APP_INTERNAL int
@@ -4557,6 +5451,10 @@ APP__wasm_Init(const char *title, int width, int height) {
 	APP__data.w_height = height;
 
 	APP__JS_Init();
+	APP__data.gl_has_vertex_arrays = APP__JS_Has_vertex_arrays();
+	APP__data.gl_has_instancing    = APP__JS_Has_instancing();
+	APP__data.gl_has_uint_indices  = APP__JS_Has_uint_indices();
+	APP__data.gl_has_timer_query   = APP__JS_Has_timer_query();
 
 	APP__wasm_Set_window_title(title);
 
@@ -4918,6 +5816,46 @@ void
 Mutex_unlock(Mutex *mutex) {
 }
 
+void
+Semaphore_init(Semaphore *semaphore, int count) {
+	*semaphore = count;
+}
+
+void
+Semaphore_deinit(Semaphore *semaphore) {
+}
+
+void
+Semaphore_wait(Semaphore *semaphore) {
+	if (*semaphore <= 0) abort();
+	*semaphore -= 1;
+}
+
+void
+Semaphore_post(Semaphore *semaphore) {
+	*semaphore += 1;
+}
+
+void
+Thread_start(Thread *thread, ThreadFunc func, void *arg) {
+	thread->func = func;
+	thread->arg  = arg;
+	func(arg);
+}
+
+void
+Thread_join(Thread *thread) {
+}
+
+int
+Thread_count_cpus(void) {
+	return 1;
+}
+
+void
+Thread_yield(void) {
+}
+
 #endif // defined (APP_WASM)
 
 
@@ -4925,8 +5863,12 @@ Mutex_unlock(Mutex *mutex) {
 #if defined(BUNDLED_TREE)
 	extern const unsigned int BUNDLE_FILES_COUNT;
 	extern const char * const bundle_filenames[];
-	extern char * const bundle_files_index[];
+	extern const unsigned char * const bundle_files_index[];
 	extern const unsigned int bundle_file_sizes[];
+	extern const unsigned long long bundle_filename_hashes[];
+	extern const unsigned int BUNDLE_HASH_TABLE_SIZE;
+	extern const unsigned int bundle_hash_table[];
+	#include "madmath.h" // wyhash, the same hash is used by bundle_tree.h
 #endif
 
 
@@ -4973,28 +5915,42 @@ APP_Run_application_loop(int(*application_frame)(void)) {
 uint8_t *
 APP_Get_file_contentsz(const char *filename, uint32_t *size) {
 #if defined(BUNDLED_TREE)
-	// This is a linear search, we may use a hashmap :/
-	for (uint32_t i = 0; i < BUNDLE_FILES_COUNT; ++i) {
-		if (strcmp(filename, bundle_filenames[i]) == 0) {
+	// The hash table is made by bundle_tree.h, the slots have the index of the file + 1 and
+	// there is always an empty one
+	uint64_t hash = wyhash(filename, strlen(filename), 0, _wyp);
+	uint32_t mask = BUNDLE_HASH_TABLE_SIZE-1;
+	for (uint32_t slot = (uint32_t)hash & mask; bundle_hash_table[slot] != 0; slot = (slot+1) & mask) {
+		uint32_t i = bundle_hash_table[slot]-1;
+		if (bundle_filename_hashes[i] == hash && strcmp(filename, bundle_filenames[i]) == 0) {
 			if (size) { *size = bundle_file_sizes[i]; }
 			return (uint8_t *)bundle_files_index[i];
 		}
 	}
 	return NULL;
+#elif defined(APP_LINUX)
+	return APP__linux_Map_file(filename, size);
 #else
 	FILE *f = fopen(filename, "rb");
 	if (f == NULL) {
 		return NULL;
 	}
 	fseek(f, 0L, SEEK_END);	
-	uint32_t file_size = ftell(f);
+	long file_size = ftell(f);
 	fseek(f, 0L, SEEK_SET);	
-	uint8_t *data = malloc(file_size + 1); // TODO(Tano) Check this??
-	fread(data, 1, file_size, f);
+	if (file_size < 0 || (uint64_t)file_size >= UINT32_MAX) {
+		fclose(f);
+		return NULL;
+	}
+	uint8_t *data = malloc(file_size + 1);
+	if (data == NULL || fread(data, 1, file_size, f) != (size_t)file_size) {
+		free(data);
+		fclose(f);
+		return NULL;
+	}
 	fclose(f);
 
 	data[file_size] = '\0';
-	if (size) {*size = file_size;}
+	if (size) {*size = (uint32_t)file_size;}
 	return data;
 #endif
 }
@@ -5005,7 +5961,10 @@ APP_Get_file_contentsz(const char *filename, uint32_t *size) {
 void
 APP_Free_file_contents(uint8_t *data) {
 	if (data == NULL) {return;}
-#if !defined(BUNDLED_TREE)
+#if defined(BUNDLED_TREE)
+#elif defined(APP_LINUX)
+	APP__linux_Unmap_file(data);
+#else
 	free(data);
 #endif
 }
@@ -170,5 +170,150 @@ _Relloc(void *old_pointer, size_t size) {
 
 
 
+
+/*
+* PROFILE_ZONE
+* =====================================================================
+*
+* DESCRIPTIION
+* ----------------------------------------------------------------------
+* Records the time spent from the line of the macro until the end of the
+* enclosing scope in a ring buffer of the calling thread, the rings keep
+* the last PROFILE_RING_EVENTS zones of every thread. Profile_dump_trace
+* writes them in the Chrome trace_event JSON format, it can be opened on
+* https://ui.perfetto.dev or chrome://tracing.
+*
+* The zones are only recorded when the program is compiled with
+* PROFILE_ENABLED defined, if not the macro disapears. The time is taken
+* with APP_Time so app.h must be linked.
+*
+* VARIABLES
+* ---------------------------------------------------------------------
+*   name: String literal with the name of the zone, it's not copied.
+*
+*/
+#define PROFILE_RING_EVENTS (64*1024)
+#define PROFILE_MAX_THREADS 16
+
+#if defined(PROFILE_ENABLED)
+
+	int64_t
+	APP_Time(void);
+
+	typedef struct {
+		const char *name;
+		i64 start; // Nanoseconds, see APP_Time
+		i64 end;
+	} ProfileEvent;
+
+	typedef struct {
+		ProfileEvent events[PROFILE_RING_EVENTS];
+		u32 count; // Events recorded, the last one is at (count-1) % PROFILE_RING_EVENTS
+	} ProfileRing;
+
+	typedef struct {
+		const char *name;
+		i64 start;
+	} ProfileZone;
+
+	// The rings are allocated the first time that every thread records a zone
+	static ProfileRing *profile__rings[PROFILE_MAX_THREADS];
+	static u32 profile__rings_count;
+	static _Thread_local ProfileRing *profile__thread_ring;
+
+	static inline ProfileZone
+	Profile__Begin_zone(const char *name) {
+		ProfileZone zone = {name, APP_Time()};
+		return zone;
+	}
+
+	static inline void
+	Profile__End_zone(ProfileZone *zone) {
+		ProfileRing *ring = profile__thread_ring;
+		if (ring == NULL) {
+			u32 thread = __atomic_fetch_add(&profile__rings_count, 1, __ATOMIC_RELAXED);
+			if (thread >= PROFILE_MAX_THREADS) return;
+			ring = calloc(1, sizeof(ProfileRing));
+			if (ring == NULL) return;
+			profile__thread_ring = ring;
+			__atomic_store_n(&profile__rings[thread], ring, __ATOMIC_RELEASE);
+		}
+		ProfileEvent *event = &ring->events[ring->count % PROFILE_RING_EVENTS];
+		event->name  = zone->name;
+		event->start = zone->start;
+		event->end   = APP_Time();
+		__atomic_store_n(&ring->count, ring->count+1, __ATOMIC_RELEASE);
+	}
+
+	#define PROFILE__CONCAT2(a, b) a ## b
+	#define PROFILE__CONCAT(a, b) PROFILE__CONCAT2(a, b)
+	#define PROFILE_ZONE(name) \
+		ProfileZone PROFILE__CONCAT(profile__zone_, __LINE__) \
+		__attribute__((cleanup(Profile__End_zone))) = Profile__Begin_zone(name)
+
+#else
+
+	#define PROFILE_ZONE(name)
+
+#endif
+
+
+/*
+* Profile_dump_trace
+* =====================================================================
+*
+* DESCRIPTIION
+* ----------------------------------------------------------------------
+* Writes the zones recorded by PROFILE_ZONE in a Chrome trace_event JSON
+* file, every thread is a track. The zones that the other threads are
+* recording while it's writting may be missed.
+*
+* VARIABLES
+* ---------------------------------------------------------------------
+*   path: Path of the file to write.
+*
+* RETURN
+* ---------------------------------------------------------------------
+*  0 on success, -1 if the file cannot be written or the program is not
+*  compiled with PROFILE_ENABLED.
+*
+*/
+int
+Profile_dump_trace(const char *path) {
+	#if defined(PROFILE_ENABLED)
+		FILE *file = fopen(path, "wb");
+		if (file == NULL) return -1;
+
+		fprintf(file, "{\"traceEvents\":[");
+		bool first = true;
+		u32 threads = __atomic_load_n(&profile__rings_count, __ATOMIC_RELAXED);
+		if (threads > PROFILE_MAX_THREADS) threads = PROFILE_MAX_THREADS;
+		for (u32 thread = 0; thread < threads; ++thread) {
+			ProfileRing *ring = __atomic_load_n(&profile__rings[thread], __ATOMIC_ACQUIRE);
+			if (ring == NULL) continue;
+			u32 count = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+			u32 first_event = (count > PROFILE_RING_EVENTS) ? count - PROFILE_RING_EVENTS : 0;
+			for (u32 i = first_event; i < count; ++i) {
+				ProfileEvent *event = &ring->events[i % PROFILE_RING_EVENTS];
+				// The times are in microseconds
+				fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+						first ? "" : ",", event->name, thread, (f64)event->start*1e-3, (f64)(event->end - event->start)*1e-3);
+				first = false;
+			}
+		}
+		fprintf(file, "\n]}\n");
+
+		int result = ferror(file) ? -1 : 0;
+		fclose(file);
+		return result;
+	#else
+		(void)path;
+		return -1;
+	#endif
+}
+
+
+
+
 #endif // _BASE_H_
 
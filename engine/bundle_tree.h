@@ -7,14 +7,48 @@
 
 
 
+// How the contents of the files are written
+typedef enum {
+	// With C23 #embed or an .incbin assembly stub, the compiler reads the files itself.
+	// It needs gcc/clang, on wasm clang >= 19 (#embed).
+	BTREE_EMBED_MODE_BINARY,
+	// The bytes written as string literals with escapes, without needing anything of the
+	// compiler but strings longer than ISO C asks (-pedantic warns with -Woverlength-strings).
+	// It builds slower than the binary mode but much faster than a list of numbers.
+	BTREE_EMBED_MODE_HEX,
+} BTreeEmbedMode;
+
+
+// Like btree_Bundle_tree_to_open_file_ex with BTREE_EMBED_MODE_BINARY
 void
 btree_Bundle_tree_to_open_file(FILE *out_file, const char *dirname);
 
+// Writes the C code of all the files under dirname. The embedded files are referenced
+// with the paths as walked, relative to the directory where it runs: write the header
+// on that directory so #embed finds them from it, and .incbin from BTREE_INCBIN_DIR.
+void
+btree_Bundle_tree_to_open_file_ex(FILE *out_file, const char *dirname, BTreeEmbedMode mode);
+
 
 bool
 btree_Bundle_tree(const char *out_filename, const char *dirname);
 
 
+// Like btree_Embed_file_to_open_file_ex with BTREE_EMBED_MODE_BINARY
+void
+btree_Embed_file_to_open_file(FILE *out_file, const char *filename);
+
+// Writes a header with a single file embedded, it defines const unsigned char <var>[]
+// NULL terminated and const unsigned int <var>_len, the var is the filename with the
+// invalid chars changed by _ (texture.jpg -> texture_jpg).
+//
+// The path is written as given. #embed looks for it from the directory of the header,
+// .incbin from BTREE_INCBIN_DIR, that is the directory where the compiler runs unless
+// the build defines it (-DBTREE_INCBIN_DIR=\"assets/\", with the ending '/').
+void
+btree_Embed_file_to_open_file_ex(FILE *out_file, const char *filename, BTreeEmbedMode mode);
+
+
 
 
 
@@ -28,6 +62,8 @@ btree_Bundle_tree(const char *out_filename, const char *dirname);
 #include <string.h>
 #include <assert.h>
 #include <dirent.h>	
+#include <sys/stat.h>
+#include "madmath.h" // wyhash, the same hash is used by APP_Get_file_contentsz
 
 #ifndef BTREE_MAX_FILES
 #define BTREE_MAX_FILES 2000
@@ -36,6 +72,7 @@ btree_Bundle_tree(const char *out_filename, const char *dirname);
 static const char *btree__filenames[BTREE_MAX_FILES];
 static char       *btree__varnames[BTREE_MAX_FILES];
 static size_t      btree__file_sizes[BTREE_MAX_FILES];
+static uint64_t    btree__filename_hashes[BTREE_MAX_FILES];
 static int         btree__filenames_count = 0;
 
 // 
@@ -124,6 +161,19 @@ btree__Walk_tree(const char *dirname) {
 	closedir(dir);
 }
 
+//
+// Gets the size of a file, exits if it can't
+//
+static size_t
+btree__Get_file_size(const char *filename) {
+	struct stat file_stat;
+	if (stat(filename, &file_stat) != 0) {
+		fprintf(stderr, "Cannot load file %s\n", filename);
+		exit(-1);
+	}
+	return (size_t)file_stat.st_size;
+}
+
 //
 // Allocates all file contents on the heap putting a 0 on the end
 // Return a pointer to the data and sets the parameter size to the
@@ -177,9 +227,126 @@ btree__Print_filenames(FILE *out_file) {
 	fprintf(out_file,"};\n\n");
 }
 
+//
+// Prints the macros used by the files embedded with BTREE_EMBED_MODE_BINARY. They can
+// be included with other generated files, so they're defined once.
+//
+// BTREE_INCBIN defines a global symbol with the contents of the file and a 0, on the
+// read only data section of the object format. The assembler looks for the path from
+// the directory where the compiler runs, BTREE_INCBIN_DIR is put before it.
+//
+static void
+btree__Print_embed_macros(FILE *out_file) {
+	fprintf(out_file,
+		"#ifndef BTREE_EMBED_MACROS\n"
+		"#define BTREE_EMBED_MACROS\n"
+		"\n"
+		"#if defined(__has_embed)\n"
+		"	#define BTREE_HAS_EMBED 1\n"
+		"#elif (defined(__GNUC__) || defined(__clang__)) && !defined(__wasm__)\n"
+		"	#define BTREE_HAS_EMBED 0\n"
+		"#else\n"
+		"	#error \"The files need #embed or .incbin, bundle them with BTREE_EMBED_MODE_HEX\"\n"
+		"#endif\n"
+		"\n"
+		"#if defined(_WIN32)\n"
+		"	#define BTREE__SECTION \".pushsection .rdata, \\\"dr\\\"\"\n"
+		"#elif defined(__APPLE__)\n"
+		"	#define BTREE__SECTION \".pushsection __TEXT,__const\"\n"
+		"#else\n"
+		"	#define BTREE__SECTION \".pushsection .rodata, \\\"a\\\"\"\n"
+		"#endif\n"
+		"#ifndef BTREE_INCBIN_DIR\n"
+		"	#define BTREE_INCBIN_DIR \"\"\n"
+		"#endif\n"
+		"#define BTREE__STRING_(x) #x\n"
+		"#define BTREE__STRING(x) BTREE__STRING_(x)\n"
+		"#define BTREE_INCBIN(name, path) \\\n"
+		"	__asm__(BTREE__SECTION \"\\n\" \\\n"
+		"	        \".globl \" BTREE__STRING(__USER_LABEL_PREFIX__) #name \"\\n\" \\\n"
+		"	        \".balign 16\\n\" \\\n"
+		"	        BTREE__STRING(__USER_LABEL_PREFIX__) #name \":\\n\" \\\n"
+		"	        \".incbin \\\"\" BTREE_INCBIN_DIR path \"\\\"\\n\" \\\n"
+		"	        \".byte 0\\n\" \\\n"
+		"	        \".popsection\\n\"); \\\n"
+		"	extern const unsigned char name[]\n"
+		"\n"
+		"#endif // BTREE_EMBED_MACROS\n\n"
+	);
+}
+
+//
+// Prints the definition of a file embedded with BTREE_EMBED_MODE_BINARY, the path is
+// checked because it can't be escaped in #embed
+//
+static void
+btree__Print_embedded_file(FILE *out_file, const char *storage, const char *varname, const char *path) {
+	if (strpbrk(path, "\"\\\n") != NULL) {
+		fprintf(stderr, "Cannot embed %s, the path can't have quotes or backslashes\n", path);
+		exit(-1);
+	}
+	fprintf(out_file, "#if BTREE_HAS_EMBED\n");
+	fprintf(out_file, "%sconst unsigned char %s[] = {\n", storage, varname);
+	fprintf(out_file, "#embed \"%s\" suffix(,)\n", path);
+	fprintf(out_file, "0\n");
+	fprintf(out_file, "};\n");
+	fprintf(out_file, "#else\n");
+	fprintf(out_file, "BTREE_INCBIN(%s, \"%s\");\n", varname, path);
+	fprintf(out_file, "#endif\n");
+}
+
+//
+// Prints the bytes of the data as string literals of 64 bytes per line, the printable chars as
+// they are and the rest as 3 digit octal escapes, that end without looking at the next char.
+// The compiler takes a line as a token instead of a token per byte. The whole file is
+// formatted on memory and written at once.
+//
+static void
+btree__Print_string_bytes(FILE *out_file, const unsigned char *data, size_t size) {
+	const size_t MAX_BYTES_PER_LINE = 64;
+	size_t lines = size/MAX_BYTES_PER_LINE + 1;
+	char *text = malloc(size*4 + lines*8 + 1);
+	if (text == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(-1);
+	}
+	size_t text_len = 0;
+	for (size_t i = 0; i < size || i == 0; i += MAX_BYTES_PER_LINE) {
+		memcpy(&text[text_len], "    \"", 5);
+		text_len += 5;
+		for (size_t j = i; j < size && j < i+MAX_BYTES_PER_LINE; ++j) {
+			unsigned char c = data[j];
+			// ? is escaped so there are no trigraphs
+			if (c >= ' ' && c <= '~' && c != '"' && c != '\\' && c != '?') {
+				text[text_len++] = (char)c;
+			}
+			else {
+				text[text_len++] = '\\';
+				text[text_len++] = (char)('0' + (c >> 6));
+				text[text_len++] = (char)('0' + ((c >> 3) & 7));
+				text[text_len++] = (char)('0' + (c & 7));
+			}
+		}
+		memcpy(&text[text_len], "\"\n", 2);
+		text_len += 2;
+	}
+	fwrite(text, 1, text_len, out_file);
+	free(text);
+}
+
 static void
-btree__Print_file_buffers(FILE *out_file) {
+btree__Print_file_buffers(FILE *out_file, BTreeEmbedMode mode) {
+	if (mode == BTREE_EMBED_MODE_BINARY) {
+		btree__Print_embed_macros(out_file);
+	}
 	for (int i = 0; i < btree__filenames_count; ++i) {
+		fprintf(out_file, "// %s\n", btree__filenames[i]);
+		if (mode == BTREE_EMBED_MODE_BINARY) {
+			btree__file_sizes[i] = btree__Get_file_size(btree__filenames[i]);
+			btree__Print_embedded_file(out_file, "static ", btree__varnames[i], btree__filenames[i]);
+			continue;
+		}
+
 		size_t file_size;
 		unsigned char *file_data = btree__Get_file_contentsz(btree__filenames[i], &file_size);
 		if (file_data == NULL) {
@@ -187,24 +354,10 @@ btree__Print_file_buffers(FILE *out_file) {
 			exit(-1);
 		}
 		btree__file_sizes[i] = file_size; // Stores the filesize to print the array of filesizes later
-		fprintf(out_file, "// %s\n", btree__filenames[i]);
-		fprintf(out_file, "static char %s[%lu] = {\n", btree__varnames[i], file_size + 1);
-
-		//i <= file_size because is warrantied that is null terminated
-		for (int i = 0; i <= file_size;) {
-			const int MAX_BYTES_PER_LINE = 20;
-			fprintf(out_file, "    ");
-			// We print a limited number of bytes per line to improve readability
-			for (int j = 0; j < MAX_BYTES_PER_LINE && i <= file_size; ++i, ++j) {
-				fprintf(out_file, "0x%02x", file_data[i]);
-				if (i < file_size) {
-					fprintf(out_file, ", ");
-				}
-			}
-			fprintf(out_file, "\n");
-		}
-
-		fprintf(out_file, "};\n");
+		// file_size + 1 because is warrantied that is null terminated, the 0 of the literal
+		fprintf(out_file, "static const unsigned char %s[%lu] =\n", btree__varnames[i], file_size + 1);
+		btree__Print_string_bytes(out_file, file_data, file_size);
+		fprintf(out_file, ";\n");
 		
 		free(file_data);
 	}
@@ -212,7 +365,7 @@ btree__Print_file_buffers(FILE *out_file) {
 
 static void
 btree__Print_files_index(FILE *out_file) {
-	fprintf(out_file, "char * const bundle_files_index[] = {\n");
+	fprintf(out_file, "const unsigned char * const bundle_files_index[] = {\n");
 	for (int i = 0; i < btree__filenames_count; ++i) {
 		fprintf(out_file, "    %s", btree__varnames[i]);
 		if (i < btree__filenames_count-1) {
@@ -237,8 +390,64 @@ btree__Print_file_sizes(FILE *out_file) {
 	fprintf(out_file,"};\n\n");
 }
 
+//
+// Prints the hashes of the filenames and a hash table to find them. The table is open addressed
+// with linear probing, it's a power of 2 at most half full so the probes end soon on an
+// empty slot. The slots have the index of the file + 1, 0 if empty.
+//
+static void
+btree__Print_hash_table(FILE *out_file) {
+	unsigned int table_size = 1;
+	while (table_size < 2*(unsigned int)btree__filenames_count) table_size *= 2;
+	unsigned int *table = calloc(table_size, sizeof(unsigned int));
+	if (table == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(-1);
+	}
+
+	fprintf(out_file, "const unsigned long long bundle_filename_hashes[] = {\n");
+	for (int i = 0; i < btree__filenames_count; ++i) {
+		const char *filename = btree__filenames[i];
+		btree__filename_hashes[i] = wyhash(filename, strlen(filename), 0, _wyp);
+		fprintf(out_file, "    0x%016llxull", (unsigned long long)btree__filename_hashes[i]);
+		if (i < btree__filenames_count-1) {
+			fprintf(out_file,",");
+		}
+		fprintf(out_file,"\n");
+
+		unsigned int slot = (unsigned int)btree__filename_hashes[i] & (table_size-1);
+		while (table[slot] != 0) slot = (slot+1) & (table_size-1);
+		table[slot] = i+1;
+	}
+	fprintf(out_file,"};\n\n");
+
+	fprintf(out_file, "const unsigned int BUNDLE_HASH_TABLE_SIZE = %u;\n\n", table_size);
+	fprintf(out_file, "const unsigned int bundle_hash_table[] = {\n");
+	for (unsigned int i = 0; i < table_size;) {
+		const unsigned int MAX_SLOTS_PER_LINE = 20;
+		fprintf(out_file, "    ");
+		for (unsigned int j = 0; j < MAX_SLOTS_PER_LINE && i < table_size; ++i, ++j) {
+			fprintf(out_file, "%u", table[i]);
+			if (i < table_size-1) {
+				fprintf(out_file, ", ");
+			}
+		}
+		fprintf(out_file, "\n");
+	}
+	fprintf(out_file,"};\n\n");
+
+	free(table);
+}
+
+// Documented above
 void
 btree_Bundle_tree_to_open_file(FILE *out_file, const char *dirname) {
+	btree_Bundle_tree_to_open_file_ex(out_file, dirname, BTREE_EMBED_MODE_BINARY);
+}
+
+// Documented above
+void
+btree_Bundle_tree_to_open_file_ex(FILE *out_file, const char *dirname, BTreeEmbedMode mode) {
 	btree__Walk_tree(dirname);
 	btree__Set_varnames();
 	
@@ -249,9 +458,10 @@ btree_Bundle_tree_to_open_file(FILE *out_file, const char *dirname) {
 	fprintf(out_file, "//////////////////////////////////////////////////////////////\n\n\n\n");
 	fprintf(out_file, "const unsigned int BUNDLE_FILES_COUNT = %d;\n\n", btree__filenames_count);
 	btree__Print_filenames(out_file);
-	btree__Print_file_buffers(out_file);
+	btree__Print_file_buffers(out_file, mode);
 	btree__Print_files_index(out_file);
 	btree__Print_file_sizes(out_file);
+	btree__Print_hash_table(out_file);
 }
 
 
@@ -264,17 +474,65 @@ btree_Bundle_tree(const char *out_filename, const char *dirname) {
 	return true;
 }
 
+// Documented above
+void
+btree_Embed_file_to_open_file(FILE *out_file, const char *filename) {
+	btree_Embed_file_to_open_file_ex(out_file, filename, BTREE_EMBED_MODE_BINARY);
+}
+
+// Documented above
+void
+btree_Embed_file_to_open_file_ex(FILE *out_file, const char *filename, BTreeEmbedMode mode) {
+	char *varname = btree__Filename_to_var(filename);
+	size_t file_size = btree__Get_file_size(filename);
+
+	fprintf(out_file, "//////////////////////////////////////////////////////////////\n");
+	fprintf(out_file, "//\n");
+	fprintf(out_file, "// FILE GENERATED BY: %s %s--file %s\n", __FILE__,
+	        mode == BTREE_EMBED_MODE_HEX ? "--hex " : "", filename);
+	fprintf(out_file, "//\n");
+	fprintf(out_file, "//////////////////////////////////////////////////////////////\n\n\n\n");
+	if (mode == BTREE_EMBED_MODE_BINARY) {
+		btree__Print_embed_macros(out_file);
+		btree__Print_embedded_file(out_file, "", varname, filename);
+	}
+	else {
+		unsigned char *file_data = btree__Get_file_contentsz(filename, &file_size);
+		if (file_data == NULL) {
+			fprintf(stderr, "Cannot load file %s\n", filename);
+			exit(-1);
+		}
+		fprintf(out_file, "const unsigned char %s[%lu] =\n", varname, file_size + 1);
+		btree__Print_string_bytes(out_file, file_data, file_size);
+		fprintf(out_file, ";\n");
+		free(file_data);
+	}
+	fprintf(out_file, "const unsigned int %s_len = %lu;\n", varname, file_size);
+	free(varname);
+}
+
 #ifdef BTREE_BUNDLE_TREE_AS_PROGRAM
 
 int
 main(int argc, char **argv) {
 
-	if (argc != 2) {
-		fprintf(stderr, "USAGE: %s 'directory'\n", argv[0]);
+	if (argc == 3 && strcmp(argv[1], "--file") == 0) {
+		btree_Embed_file_to_open_file(stdout, argv[2]);
+	}
+	else if (argc == 4 && strcmp(argv[1], "--hex") == 0 && strcmp(argv[2], "--file") == 0) {
+		btree_Embed_file_to_open_file_ex(stdout, argv[3], BTREE_EMBED_MODE_HEX);
+	}
+	else if (argc == 3 && strcmp(argv[1], "--hex") == 0) {
+		btree_Bundle_tree_to_open_file_ex(stdout, argv[2], BTREE_EMBED_MODE_HEX);
+	}
+	else if (argc == 2) {
+		btree_Bundle_tree_to_open_file(stdout, argv[1]);
+	}
+	else {
+		fprintf(stderr, "USAGE: %s [--hex] 'directory'\n", argv[0]);
+		fprintf(stderr, "       %s [--hex] --file 'file'\n", argv[0]);
 		return -1;
 	}
-	
-	btree_Bundle_tree_to_open_file(stdout, argv[1]);
 
 	return 0;
 }
@@ -0,0 +1,426 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+//
+// ---------- capture.h ----------
+// Saves the rendered frames as a sequence of images without stalling the render thread.
+// The framebuffer is read to a ring of pixel pack buffers and mapped some frames later,
+// when the GPU is done with it, then a writer thread encodes the image file.
+//
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "base.h"
+#include "app.h"
+
+
+typedef enum {
+	CAPTURE_FORMAT_PPM, // Binary PPM (P6)
+	CAPTURE_FORMAT_PNG, // RGB PNG, not compressed (stored deflate blocks)
+} CaptureFormat;
+
+
+/*
+* Capture_start
+* =============================================================
+*
+* DESCRIPTIION
+* --------------------------------------------------------------
+* Starts to capture the frames, every call to Capture_frame saves one image.
+* The images are numbered from 0, path_format is a printf format with a
+* single %u for the number, like "frames/terrain_%05u.png". The directory
+* must exist.
+*
+* It needs APP_Has_async_readback and must be called after APP_Init, with the
+* context current. To finish the capture Capture_stop must be called.
+*
+* VARIABLES
+* -------------------------------------------------------------------
+* path_format: Format of the file paths, it's copied
+* format:      Format of the image files
+* width:       Width of the captured rect, from the bottom left of the framebuffer
+* height:      Height of the captured rect
+*
+* RETURNS
+* -------------------------------------------------------------------
+* int: 0 on success, < 0 on failure
+*
+*/
+int
+Capture_start(const char *path_format, CaptureFormat format, u32 width, u32 height);
+
+
+/*
+* Capture_frame
+* =============================================================
+*
+* DESCRIPTIION
+* --------------------------------------------------------------
+* Captures the current frame, must be called when the frame is fully
+* rendered and before the buffers are swapped. Does nothing if there is
+* no capture started.
+*
+* The pixels are read asynchronously, this only waits when the GPU is
+* CAPTURE_PBOS frames behind or the writer thread CAPTURE_QUEUE frames
+* behind, so no frame is lost.
+*
+*/
+void
+Capture_frame(void);
+
+
+/*
+* Capture_stop
+* =============================================================
+*
+* DESCRIPTIION
+* --------------------------------------------------------------
+* Waits until the frames in flight are written and frees the capture
+* resources.
+*
+* RETURNS
+* -------------------------------------------------------------------
+* u32: Number of images written, the failed ones are reported on stderr
+*
+*/
+u32
+Capture_stop(void);
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//
+//                         IMPLEMENTATION
+//
+//
+////////////////////////////////////////////////////////////////////////////////
+
+
+#if defined(APP_WASM)
+
+// WebGL can't map buffers and there are no threads nor files to write
+
+int
+Capture_start(const char *path_format, CaptureFormat format, u32 width, u32 height) {
+	return -1;
+}
+
+void
+Capture_frame(void) {
+}
+
+u32
+Capture_stop(void) {
+	return 0;
+}
+
+#else
+
+// Frames read that can be in flight on the GPU, the read of a frame is mapped at most
+// CAPTURE_PBOS-1 frames later
+#define CAPTURE_PBOS 3
+// Frames waiting for the writer thread
+#define CAPTURE_QUEUE 4
+#define CAPTURE_MAX_PATH 256
+
+typedef struct {
+	u8 *pixels; // RGBA, bottom-up like GL
+	bool end;   // Capture_stop was called, there are no more frames
+} CAPTURE__Frame;
+
+static struct {
+	bool active;
+	CaptureFormat format;
+	char path_format[CAPTURE_MAX_PATH];
+	u32 width;
+	u32 height;
+
+	// Render thread
+	GLuint pbos[CAPTURE_PBOS];
+	GLsync fences[CAPTURE_PBOS];
+	u32 frames_read;
+	u32 frames_mapped;
+
+	// Single producer single consumer queue, the semaphores order the accesses to the frames
+	CAPTURE__Frame queue[CAPTURE_QUEUE];
+	Semaphore free_frames;
+	Semaphore queued_frames;
+
+	// Writer thread
+	Thread writer;
+	u8 *encoded; // Rows converted to RGB top-down, and the zlib stream for PNG
+	u32 frames_written;
+
+	u32 crc_table[256];
+} CAPTURE__data = {0};
+
+
+// The sizes of the encoded buffer, see CAPTURE__Write_png
+#define CAPTURE__PNG_ROWS_SIZE(w, h) (((w)*3+1)*(h))
+#define CAPTURE__ZLIB_BLOCK 65535
+#define CAPTURE__ZLIB_SIZE(raw)  (2 + ((raw)/CAPTURE__ZLIB_BLOCK + 1)*5 + (raw) + 4)
+
+
+static u32
+CAPTURE__Crc(u32 crc, const u8 *data, u32 size) {
+	crc = ~crc;
+	for (u32 i = 0; i < size; i += 1) crc = CAPTURE__data.crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void
+CAPTURE__Put_u32_be(u8 *dst, u32 value) {
+	dst[0] = (u8)(value >> 24);
+	dst[1] = (u8)(value >> 16);
+	dst[2] = (u8)(value >> 8);
+	dst[3] = (u8)value;
+}
+
+static bool
+CAPTURE__Write_png_chunk(FILE *file, const char *type, const u8 *data, u32 size) {
+	u8 header[8];
+	CAPTURE__Put_u32_be(header, size);
+	memcpy(header+4, type, 4);
+	u8 crc[4];
+	CAPTURE__Put_u32_be(crc, CAPTURE__Crc(CAPTURE__Crc(0, header+4, 4), data, size));
+	return fwrite(header, 8, 1, file) == 1 &&
+		(size == 0 || fwrite(data, size, 1, file) == 1) &&
+		fwrite(crc, 4, 1, file) == 1;
+}
+
+// The rows are filtered with "None" and the deflate blocks are stored, the encode is as cheap
+// as a copy so the writer keeps up with the render, at the cost of bigger files.
+static bool
+CAPTURE__Write_png(FILE *file, const u8 *rows) {
+	u32 width  = CAPTURE__data.width;
+	u32 height = CAPTURE__data.height;
+	u32 raw_size = CAPTURE__PNG_ROWS_SIZE(width, height);
+	u8 *zlib = CAPTURE__data.encoded + raw_size;
+
+	u8 *dst = zlib;
+	*dst++ = 0x78; // Deflate with a 32K window
+	*dst++ = 0x01; // No dictionary, fastest, the check bits make it multiple of 31
+	u32 a = 1, b = 0;
+	for (u32 offset = 0; offset < raw_size; offset += CAPTURE__ZLIB_BLOCK) {
+		u32 size = raw_size - offset < CAPTURE__ZLIB_BLOCK ? raw_size - offset : CAPTURE__ZLIB_BLOCK;
+		*dst++ = (offset + size == raw_size) ? 1 : 0; // BFINAL, stored
+		*dst++ = (u8)size;
+		*dst++ = (u8)(size >> 8);
+		*dst++ = (u8)~size;
+		*dst++ = (u8)(~size >> 8);
+		memcpy(dst, rows + offset, size);
+		dst += size;
+		// The sums don't overflow before the modulo with blocks of 5552 bytes at most
+		for (u32 i = 0; i < size; i += 1) {
+			a += rows[offset+i];
+			b += a;
+			if ((i % 5552) == 5551) { a %= 65521; b %= 65521; }
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	CAPTURE__Put_u32_be(dst, (b << 16) | a);
+	dst += 4;
+
+	static const u8 SIGNATURE[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+	u8 ihdr[13];
+	CAPTURE__Put_u32_be(ihdr,   width);
+	CAPTURE__Put_u32_be(ihdr+4, height);
+	ihdr[8]  = 8; // Bits per channel
+	ihdr[9]  = 2; // RGB
+	ihdr[10] = 0; // Deflate
+	ihdr[11] = 0; // Adaptive filters
+	ihdr[12] = 0; // Not interlaced
+	return fwrite(SIGNATURE, sizeof(SIGNATURE), 1, file) == 1 &&
+		CAPTURE__Write_png_chunk(file, "IHDR", ihdr, sizeof(ihdr)) &&
+		CAPTURE__Write_png_chunk(file, "IDAT", zlib, (u32)(dst - zlib)) &&
+		CAPTURE__Write_png_chunk(file, "IEND", NULL, 0);
+}
+
+// Converts the GL pixels to top-down RGB rows, with the PNG filter byte before every row
+static void
+CAPTURE__Convert_rows(const u8 *pixels, bool filter_byte) {
+	u32 width  = CAPTURE__data.width;
+	u32 height = CAPTURE__data.height;
+	u8 *dst = CAPTURE__data.encoded;
+	for (u32 y = 0; y < height; y += 1) {
+		const u8 *src = pixels + (size_t)(height-1-y)*width*4;
+		if (filter_byte) *dst++ = 0;
+		for (u32 x = 0; x < width; x += 1) {
+			dst[0] = src[0];
+			dst[1] = src[1];
+			dst[2] = src[2];
+			dst += 3;
+			src += 4;
+		}
+	}
+}
+
+static bool
+CAPTURE__Write_frame(const u8 *pixels, const char *path) {
+	FILE *file = fopen(path, "wb");
+	if (!file) return false;
+
+	bool written;
+	if (CAPTURE__data.format == CAPTURE_FORMAT_PNG) {
+		CAPTURE__Convert_rows(pixels, true);
+		written = CAPTURE__Write_png(file, CAPTURE__data.encoded);
+	}
+	else {
+		CAPTURE__Convert_rows(pixels, false);
+		u32 size = CAPTURE__data.width*CAPTURE__data.height*3;
+		written = fprintf(file, "P6\n%u %u\n255\n", CAPTURE__data.width, CAPTURE__data.height) > 0 &&
+			fwrite(CAPTURE__data.encoded, size, 1, file) == 1;
+	}
+	if (fclose(file) != 0) written = false;
+	return written;
+}
+
+static void
+CAPTURE__Writer_main(void *arg) {
+	(void)arg;
+	char path[CAPTURE_MAX_PATH+16];
+	for (u32 i = 0;; i += 1) {
+		Semaphore_wait(&CAPTURE__data.queued_frames);
+		CAPTURE__Frame *frame = &CAPTURE__data.queue[i % CAPTURE_QUEUE];
+		if (frame->end) break;
+
+		snprintf(path, sizeof(path), CAPTURE__data.path_format, i);
+		if (CAPTURE__Write_frame(frame->pixels, path)) CAPTURE__data.frames_written += 1;
+		else fprintf(stderr, "Couldn't write the capture %s\n", path);
+		Semaphore_post(&CAPTURE__data.free_frames);
+	}
+}
+
+
+// Documented above
+int
+Capture_start(const char *path_format, CaptureFormat format, u32 width, u32 height) {
+	Assert(!CAPTURE__data.active, "There is already a capture");
+	if (!APP_Has_async_readback()) return -1;
+	if (width == 0 || height == 0 || strlen(path_format) >= CAPTURE_MAX_PATH) return -1;
+
+	CAPTURE__data.format = format;
+	strcpy(CAPTURE__data.path_format, path_format);
+	CAPTURE__data.width  = width;
+	CAPTURE__data.height = height;
+	CAPTURE__data.frames_read    = 0;
+	CAPTURE__data.frames_mapped  = 0;
+	CAPTURE__data.frames_written = 0;
+
+	size_t frame_size = (size_t)width*height*4;
+	size_t raw_size = CAPTURE__PNG_ROWS_SIZE((size_t)width, height);
+	CAPTURE__data.encoded = (u8 *)malloc(raw_size + CAPTURE__ZLIB_SIZE(raw_size));
+	if (!CAPTURE__data.encoded) return -1;
+	for (u32 i = 0; i < CAPTURE_QUEUE; i += 1) {
+		CAPTURE__data.queue[i].pixels = (u8 *)malloc(frame_size);
+		CAPTURE__data.queue[i].end = false;
+		if (!CAPTURE__data.queue[i].pixels) {
+			for (u32 j = 0; j < i; j += 1) free(CAPTURE__data.queue[j].pixels);
+			free(CAPTURE__data.encoded);
+			return -1;
+		}
+	}
+
+	for (u32 i = 0; i < 256; i += 1) {
+		u32 c = i;
+		for (u32 k = 0; k < 8; k += 1) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : (c >> 1);
+		CAPTURE__data.crc_table[i] = c;
+	}
+
+	glGenBuffers(CAPTURE_PBOS, CAPTURE__data.pbos);
+	for (u32 i = 0; i < CAPTURE_PBOS; i += 1) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, CAPTURE__data.pbos[i]);
+		glBufferData(GL_PIXEL_PACK_BUFFER, frame_size, NULL, GL_STREAM_READ);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	Semaphore_init(&CAPTURE__data.free_frames, CAPTURE_QUEUE);
+	Semaphore_init(&CAPTURE__data.queued_frames, 0);
+	Thread_start(&CAPTURE__data.writer, CAPTURE__Writer_main, NULL);
+	CAPTURE__data.active = true;
+	return 0;
+}
+
+// Copies the oldest read frame to the writer queue, if wait is false and the GPU hasn't
+// finished the read returns false
+static bool
+CAPTURE__Map_frame(bool wait) {
+	u32 pbo = CAPTURE__data.frames_mapped % CAPTURE_PBOS;
+	GLsync fence = CAPTURE__data.fences[pbo];
+	GLuint64 timeout = wait ? 1000000000 : 0;
+	GLenum status;
+	do {
+		status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+	} while (wait && status == GL_TIMEOUT_EXPIRED);
+	if (status == GL_TIMEOUT_EXPIRED) return false;
+	// On GL_WAIT_FAILED the context is lost, the frame is written anyway to not stop the queue
+	glDeleteSync(fence);
+
+	Semaphore_wait(&CAPTURE__data.free_frames);
+	CAPTURE__Frame *frame = &CAPTURE__data.queue[CAPTURE__data.frames_mapped % CAPTURE_QUEUE];
+	size_t frame_size = (size_t)CAPTURE__data.width*CAPTURE__data.height*4;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, CAPTURE__data.pbos[pbo]);
+	void *pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frame_size, GL_MAP_READ_BIT);
+	if (pixels) {
+		memcpy(frame->pixels, pixels, frame_size);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	else {
+		memset(frame->pixels, 0, frame_size);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	frame->end = false;
+	Semaphore_post(&CAPTURE__data.queued_frames);
+
+	CAPTURE__data.frames_mapped += 1;
+	return true;
+}
+
+// Documented above
+void
+Capture_frame(void) {
+	if (!CAPTURE__data.active) return;
+
+	// The reads finish in order
+	while (CAPTURE__data.frames_mapped != CAPTURE__data.frames_read && CAPTURE__Map_frame(false));
+	if (CAPTURE__data.frames_read - CAPTURE__data.frames_mapped == CAPTURE_PBOS) CAPTURE__Map_frame(true);
+
+	u32 pbo = CAPTURE__data.frames_read % CAPTURE_PBOS;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, CAPTURE__data.pbos[pbo]);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(0, 0, CAPTURE__data.width, CAPTURE__data.height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	CAPTURE__data.fences[pbo] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	CAPTURE__data.frames_read += 1;
+}
+
+// Documented above
+u32
+Capture_stop(void) {
+	if (!CAPTURE__data.active) return 0;
+
+	while (CAPTURE__data.frames_mapped != CAPTURE__data.frames_read) CAPTURE__Map_frame(true);
+
+	Semaphore_wait(&CAPTURE__data.free_frames);
+	CAPTURE__data.queue[CAPTURE__data.frames_mapped % CAPTURE_QUEUE].end = true;
+	Semaphore_post(&CAPTURE__data.queued_frames);
+	Thread_join(&CAPTURE__data.writer);
+
+	Semaphore_deinit(&CAPTURE__data.free_frames);
+	Semaphore_deinit(&CAPTURE__data.queued_frames);
+	glDeleteBuffers(CAPTURE_PBOS, CAPTURE__data.pbos);
+	for (u32 i = 0; i < CAPTURE_QUEUE; i += 1) free(CAPTURE__data.queue[i].pixels);
+	free(CAPTURE__data.encoded);
+	CAPTURE__data.active = false;
+	return CAPTURE__data.frames_written;
+}
+
+#endif // defined(APP_WASM)
+
+
+#endif // _CAPTURE_H_
@@ -17,7 +17,9 @@
 // The struct of TextFont
 typedef struct {
 	stbtt_bakedchar glyphs_info[96]; // This stores the information of all ASCII glyphs
-	GLuint texture;
+	GLuint texture;                  // 0 when the glyphs are in the shared atlas
+	GFX_TextureRegion region;        // Where the baked bitmap is
+	u32 bitmap_height;               // Rows of the baked bitmap that are used
 	f32 base_height;
 } TextFont;
 
@@ -237,10 +239,21 @@ Make_font(TextFont *font, const char *filename, f32 height, FontUseLinearInterpo
 		return -1;
 	}
 
+	// The fonts with nearest filtering go to the shared atlas, only the used rows are copied
+	font->bitmap_height = (u32)result;
+	if (linear_interpolation == FONT_USE_LIENAR_INTERPOLATION_NO &&
+		GFX_Atlas_add(tmp_rgba_bitmap, TEX_SIZE, font->bitmap_height, &font->region)) {
+		free(tmp_bitmap);
+		font->base_height = height;
+		return 0;
+	}
+
 	// Make the texture
+	font->bitmap_height = TEX_SIZE;
 	glGenTextures(1, &font->texture);
     glBindTexture(GL_TEXTURE_2D, font->texture);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, TEX_SIZE, TEX_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, tmp_rgba_bitmap);
+	GFX_Count_upload(TEX_SIZE*TEX_SIZE*4);
 	if (linear_interpolation == FONT_USE_LIENAR_INTERPOLATION_YES) {
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
@@ -252,6 +265,7 @@ Make_font(TextFont *font, const char *filename, f32 height, FontUseLinearInterpo
 
 	free(tmp_bitmap);
 
+	font->region      = GFX_Texture_region(font->texture);
 	font->base_height = height;
 
 	return 0;
@@ -261,8 +275,8 @@ Make_font(TextFont *font, const char *filename, f32 height, FontUseLinearInterpo
 // Documented above
 void
 Free_font(TextFont *font) {
-	// Clean the texture
-	glDeleteTextures(1, &font->texture);
+	// Clean the texture, the space of the fonts in the shared atlas isn't reclaimed
+	if (font->texture) glDeleteTextures(1, &font->texture);
 	memset(font, 0, sizeof(TextFont));
 }
 
@@ -281,14 +295,17 @@ Free_font(TextFont *font) {
 * VARIABLES
 * -------------------------------------------------------------------
 * glyph_info: The data of the glyph
+* bitmap_height: Used rows of the baked bitmap
 * scale: Scale to apply
 * x,y : Coordinates
 *
 */
 static void
-Draw_glyph(stbtt_bakedchar *glyph_info, f32 scale, Vec2 pos, Color color) {
+Draw_glyph(stbtt_bakedchar *glyph_info, u32 bitmap_height, f32 scale, Vec2 pos, Color color) {
 
-	f32 inv_tex_size = (1.0f / (f32)TEX_SIZE);
+	// The UVs are relative to the region of the bitmap
+	f32 inv_tex_width  = (1.0f / (f32)TEX_SIZE);
+	f32 inv_tex_height = (1.0f / (f32)bitmap_height);
 	
 	f32 width  = (glyph_info->x1 - glyph_info->x0) * scale;
 	f32 height = (glyph_info->y1 - glyph_info->y0) * scale;
@@ -296,10 +313,10 @@ Draw_glyph(stbtt_bakedchar *glyph_info, f32 scale, Vec2 pos, Color color) {
 	f32 xoff = glyph_info->xoff * scale;
 	f32 yoff = glyph_info->yoff * scale;
 
-	f32 norm_x0 = glyph_info->x0 * inv_tex_size;
-	f32 norm_y0 = glyph_info->y0 * inv_tex_size;
-	f32 norm_x1 = glyph_info->x1 * inv_tex_size;
-	f32 norm_y1 = glyph_info->y1 * inv_tex_size;
+	f32 norm_x0 = glyph_info->x0 * inv_tex_width;
+	f32 norm_y0 = glyph_info->y0 * inv_tex_height;
+	f32 norm_x1 = glyph_info->x1 * inv_tex_width;
+	f32 norm_y1 = glyph_info->y1 * inv_tex_height;
 
 	Vec2 pos_offseted = V2(pos.x+xoff, pos.y-(height+yoff));
 	Vec2 v1 = V2_add(pos_offseted, V2(width, 0.0f));
@@ -318,7 +335,7 @@ Draw_glyph(stbtt_bakedchar *glyph_info, f32 scale, Vec2 pos, Color color) {
 // Documented above
 void 
 Draw_text(TextFont *font, const char *text, f32 scale, Vec2 pos, Color color) {
-	GFX_Set_texture(font->texture);
+	GFX_Set_texture_region(font->region);
 
 	u32 character_i = 0;
 	char character = text[character_i];
@@ -326,7 +343,7 @@ Draw_text(TextFont *font, const char *text, f32 scale, Vec2 pos, Color color) {
 	while (character != 0) {
 		if (character < 32 || character > 126) character = ' ';
 		stbtt_bakedchar glyph_info = font->glyphs_info[character-32];
-		Draw_glyph(&glyph_info, scale, V2(cursor_x, pos.y), color);
+		Draw_glyph(&glyph_info, font->bitmap_height, scale, V2(cursor_x, pos.y), color);
 		cursor_x += glyph_info.xadvance * scale;
 		++character_i;
 		character = text[character_i];
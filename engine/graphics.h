@@ -15,6 +15,28 @@ typedef struct {
 
 #define GFX_VERTEX_SIZE   (sizeof(GFX_Vertex))
 
+
+// Compact vertex used by the terrain meshes, 8 bytes instead of the 28 of GFX_Vertex.
+// The position is quantized to the heightmap grid, the height is a u16 that the shader
+// dequantizes with the values passed to GFX_Set_terrain_quantization and the UV is derived
+// from the grid position.
+typedef struct {
+	u16 grid_x;
+	u16 height;
+	u16 grid_z;
+	u8  normal[2]; // Octahedral encoded normal, see GFX_Oct_encode_normal
+} GFX_TerrainVertex;
+
+#define GFX_TERRAIN_VERTEX_SIZE   (sizeof(GFX_TerrainVertex))
+
+// Maximum vertices that a terrain chunk can have to be indexed with GFX_BUFFER_INDEX_TYPE_16
+#define GFX_TERRAIN_CHUNK_MAX_VERTICES (64*1024)
+
+typedef enum {
+	GFX_VERTEX_LAYOUT_DEFAULT, // GFX_Vertex
+	GFX_VERTEX_LAYOUT_TERRAIN, // GFX_TerrainVertex
+} GFX_VertexLayout;
+
 typedef enum {
 	GFX_BUFFER_INDEX_TYPE_16,
 	GFX_BUFFER_INDEX_TYPE_32,
@@ -23,11 +45,17 @@ typedef enum {
 typedef struct {
 
 	// Vertices
-	GFX_Vertex *vertices;
+	union {
+		GFX_Vertex        *vertices;         // GFX_VERTEX_LAYOUT_DEFAULT
+		GFX_TerrainVertex *terrain_vertices; // GFX_VERTEX_LAYOUT_TERRAIN
+	};
 	u32 vertices_count;
 	u32 vertices_cap;
 	GLuint VBO;
 
+	GFX_VertexLayout vertex_layout;
+	u32 vertex_size;
+
 	GFX_BufferIndexType index_type;
 	
 	// Indices
@@ -36,15 +64,27 @@ typedef struct {
 	u32 indices_cap;
 	GLuint EBO;
 
+	// Vertex array object with the attributes of the layout, 0 if they aren't supported and the
+	// attributes are specified on every draw
+	GLuint VAO;
+	GLuint VAO_EBO; // Indices currently bound to the VAO, see GFX_Draw_buffer_ex
+
 } GFX_Buffer;
 
 
+// Vertices of the batch used by the immediate mode functions when it's not specified
+#define GFX_DEFAULT_BATCH_VERTICES (256*1024)
+
 // Setups the basic renderer, it will allow you to draw various types of figures,
 // moreover, is possible that other kinds of renderer are dependant of this.
 // To clean the resources GFX_Deinit has to be called.
 int
 GFX_Init(void);
 
+// Same as GFX_Init but allows to choose the vertices of the batch, see GFX_Set_batch_size.
+int
+GFX_Init_ex(u32 batch_vertices);
+
 // Cleans all the resources used by the renderer.
 void
 GFX_Deinit(void);
@@ -58,6 +98,11 @@ GFX_End(void);
 int
 GFX_Create_buffer(GFX_Buffer *buffer_out, void *vertices_mem, u32 vertices_mem_size, void *indices_mem, u32 indices_mem_size, GFX_BufferIndexType);
 
+// Same as GFX_Create_buffer but allows to choose the vertex layout, GFX_Draw_buffer will use
+// the attributes and shader that match the layout of the buffer.
+int
+GFX_Create_buffer_ex(GFX_Buffer *buffer_out, void *vertices_mem, u32 vertices_mem_size, void *indices_mem, u32 indices_mem_size, GFX_BufferIndexType, GFX_VertexLayout);
+
 void
 GFX_Destroy_buffer(GFX_Buffer *buffer);
 
@@ -70,6 +115,10 @@ GFX_Upload_buffer_to_gpu(GFX_Buffer *buffer);
 GFX_Vertex *
 GFX_Alloc_vertices(GFX_Buffer *buffer, u32 count, u32 *base_index);
 
+// Same as GFX_Alloc_vertices for buffers with GFX_VERTEX_LAYOUT_TERRAIN
+GFX_TerrainVertex *
+GFX_Alloc_terrain_vertices(GFX_Buffer *buffer, u32 count, u32 *base_index);
+
 void *
 GFX_Alloc_indices(GFX_Buffer *buffer, u32 count);
 
@@ -79,11 +128,36 @@ GFX_Get_remaining_vertices(GFX_Buffer *buffer);
 u32
 GFX_Get_remaining_indices(GFX_Buffer *buffer);
 
+// Size of the post-transform vertex cache assumed when ordering the indices of the meshes
+#define GFX_VERTEX_CACHE_SIZE 24
+
+// Writes the indices of the 2 triangles of each quad of a grid of quads_x*quads_z quads, the
+// vertex (row, col) of the grid is row*step*row_pitch + col*step. The quads are emitted row by
+// row in bands of columns narrow enough for 2 rows of vertices to fit in a FIFO vertex cache of
+// cache_size entries, so every vertex is transformed about once instead of twice. A cache_size
+// of 0 emits plain rows. Returns the number of indices written (quads_x*quads_z*6).
+u32
+GFX_Make_grid_indices(void *indices, GFX_BufferIndexType, u32 quads_x, u32 quads_z, u32 step, u32 row_pitch, u32 cache_size);
+
+// Simulates a FIFO post-transform vertex cache of cache_size entries (up to 64) over the
+// triangles and returns the average cache miss ratio, the number of vertices transformed per
+// triangle. 3 is the worst case and a big regular grid can't go below 0.5.
+f32
+GFX_Compute_acmr(void *indices, GFX_BufferIndexType, u32 indices_count, u32 cache_size);
+
 void
 GFX_Draw_buffer(GFX_Buffer *buffer);
 
-// Sets the 4x4 matrix to apply over each vertex position on the shader NOTE that this call will
-// flush the buffer with the previus matrix values
+// Draws the vertices of buffer using the range [first_index, first_index+indices_count) of the
+// indices of index_buffer. This allows to share the same indices (for example the LOD levels of
+// the terrain chunks) between many vertex buffers with the same layout.
+// The buffers are drawn immediately, so the draws queued before are flushed first. The current
+// texture region is applied to the UVs of the vertices on the shader.
+void
+GFX_Draw_buffer_ex(GFX_Buffer *buffer, GFX_Buffer *index_buffer, u32 first_index, u32 indices_count);
+
+// Sets the 4x4 matrix to apply over each vertex position on the shader. The draws made after
+// this call are queued with the new matrix, the queue isn't flushed.
 void
 GFX_Set_matrix(Mat4 matrix);
 
@@ -94,11 +168,77 @@ GFX_Get_matrix(void);
 void
 GFX_Set_light_dir(Vec3 light_dir);
 
+// Sets how the terrain vertices are dequantized:
+//   position = (grid_x, height, grid_z) * scale + offset
+//   uv       = (grid_x, grid_z) * uv_scale
+void
+GFX_Set_terrain_quantization(Vec3 scale, Vec3 offset, Vec2 uv_scale);
+
+// Sets a normal map for the terrain draws, or 0 to use the normals of the vertices. The texel
+// (x, z) has the normal of the grid position (x, z), so a coarse mesh keeps the shading of the
+// full resolution grid. The texture is GL_LUMINANCE_ALPHA: the luminance is x*0.5+0.5 and the
+// alpha z*0.5+0.5 of the normalized normal, the y is rebuilt as positive.
+void
+GFX_Set_terrain_normal_map(GLuint texture, u32 width, u32 height);
+
+// Sets an ambient occlusion map for the terrain draws, or 0 to don't use it. The texel (x, z)
+// has the occlusion of the grid position (x, z) like on GFX_Set_terrain_normal_map. The texture
+// is GL_LUMINANCE, the light of the pixel is multiplied by it (255 is not occluded).
+void
+GFX_Set_terrain_ao_map(GLuint texture, u32 width, u32 height);
+
+// Encodes a normal (doesn't need to be normalized) in 2 bytes using the octahedral mapping
+static inline void
+GFX_Oct_encode_normal(Vec3 n, u8 *result);
+
+// Size of the shared atlas texture, it has to be a power of 2 for webgl
+#define GFX_ATLAS_SIZE 1024
+
+// Part of a texture. The UVs given to the draw functions are relative to the current region:
+//   uv = uv_offset + uv * uv_scale
+typedef struct {
+	GLuint texture;
+	Vec2   uv_offset;
+	Vec2   uv_scale;
+} GFX_TextureRegion;
+
+// The default texture is the shared atlas. When it's set with GFX_Set_texture the current region
+// is a white block of it, so the untextured draws can share the binding with the UI, the text
+// and the sprites packed in the atlas.
 GLuint
 GFX_Default_texture(void);
 
-// Sets the current texture to be used. NOTE that if the render was currently drawing something
-// with texture, it will be flushed.
+// Copies an RGBA image (width*height*4 bytes) into the shared atlas and returns its region.
+// The atlas uses nearest filtering. Returns false if the image doesn't fit, the caller should
+// make a texture of its own then.
+bool
+GFX_Atlas_add(const u8 *rgba, u32 width, u32 height, GFX_TextureRegion *region_result);
+
+// Region covering the whole texture
+GFX_TextureRegion
+GFX_Texture_region(GLuint texture);
+
+// Bytes of an RGBA image with all its mip levels down to 1x1
+u32
+GFX_Mip_chain_size(u32 width, u32 height);
+
+// Fills the mip levels of an RGBA image averaging blocks of 2x2 texels. The level 0 (the image)
+// is at the start of levels and every level goes after the previous one, levels has to be
+// GFX_Mip_chain_size bytes.
+void
+GFX_Build_mip_chain(u8 *levels, u32 width, u32 height);
+
+// Makes a texture from an RGBA mip chain (see GFX_Build_mip_chain) with trilinear filtering.
+// On webgl the size has to be a power of 2.
+GLuint
+GFX_Make_mipmapped_texture(const u8 *levels, u32 width, u32 height);
+
+// Sets the current texture and region to be used by the next draws. Changing the region of the
+// same texture doesn't break the batch.
+void
+GFX_Set_texture_region(GFX_TextureRegion region);
+
+// Sets the current texture to be used by the next draws, the region is the whole texture.
 void
 GFX_Set_texture(GLuint texture);
 
@@ -106,9 +246,105 @@ GFX_Set_texture(GLuint texture);
 GLuint
 GFX_Get_texture(void);
 
+// The draws of the immediate mode functions are recorded in a queue of commands with the state
+// (texture, matrix and light) that was current when they were made. The state setters don't
+// flush, the queue is uploaded once and submitted when it's full, on GFX_End or when GFX_Flush is
+// called, skipping the redundant state changes and merging the consecutive draws with the same
+// state. Call GFX_Flush before changing the GL state by hand (scissor, depth test...).
 void
 GFX_Flush(void);
 
+// When enabled, the draws queued until it's disabled can be reordered by state to reduce the
+// state changes and the draw calls. Use it only when the order doesn't matter, like opaque
+// geometry with depth test, the draws with blending must keep the order. Disabled by default.
+void
+GFX_Set_sorting(bool enabled);
+
+// Bytes of vertices and indices streamed by the flushes of the previous frame (between the two
+// last calls to GFX_Begin)
+u32
+GFX_Get_bytes_streamed(void);
+
+// Why the queued draws were flushed, see GFX_FrameStats
+typedef enum {
+	GFX_FLUSH_EXPLICIT,    // GFX_Flush, also called by GFX_Begin_pass and GFX_End_pass
+	GFX_FLUSH_BATCH_FULL,  // There was no room for the vertices or indices of a draw
+	GFX_FLUSH_QUEUE_FULL,  // Too many state changes in the batch
+	GFX_FLUSH_DRAW_BUFFER, // Before GFX_Draw_buffer or GFX_Draw_instances to keep the order
+	GFX_FLUSH_END,         // GFX_End
+	GFX_FLUSH_CAUSE_COUNT
+} GFX_FlushCause;
+
+typedef struct {
+	u32 draw_calls;
+	u32 flushes[GFX_FLUSH_CAUSE_COUNT]; // Only the ones that drew something
+	// Changes of the state that split the batch in another command, they don't flush
+	u32 matrix_changes;
+	u32 light_changes;
+	u32 texture_changes;
+	u32 texture_binds;
+	u64 vertices;       // Of the batch, the drawn buffers and the instances
+	u64 indices;        // Given to the draw calls, for every instance
+	u64 bytes_uploaded; // To buffers and textures
+	u64 bytes_streamed; // By the flushes and the instances, see GFX_Get_bytes_streamed
+	u64 bytes_flushed;  // By the flushes only
+} GFX_FrameStats;
+
+// Counters of the previous frame, they are reset on every GFX_Begin. Useful to find when a
+// change breaks the batching.
+GFX_FrameStats
+GFX_Get_frame_stats(void);
+
+// Counts a texture upload made with GL out of graphics.h as a bind and its bytes on the frame
+// stats, call it after the glTexImage2D. The binding of the texture unit changed behind the
+// queue, so the next draw binds its texture again.
+void
+GFX_Count_upload(u64 bytes);
+
+// Recreates the batch of the immediate mode functions with room for batch_vertices vertices
+// and 1.5 times as many indices (the quads need 6 indices every 4 vertices), the queued draws
+// are flushed first. Above 64K vertices the batch uses 32-bit indices, without them (see
+// APP_Has_uint_indices) it's limited to 64K. Returns 0 on success.
+int
+GFX_Set_batch_size(u32 batch_vertices);
+
+// Vertices of the batch, it may differ from the requested ones, see GFX_Set_batch_size
+u32
+GFX_Get_batch_size(void);
+
+// Flushes of the batch that drew something in the previous frame, the ones caused by a full
+// batch are reduced with a bigger batch
+u32
+GFX_Get_flush_count(void);
+
+// Average bytes uploaded by the flushes counted by GFX_Get_flush_count
+u32
+GFX_Get_bytes_per_flush(void);
+
+// Maximum passes timed per frame, see GFX_Begin_pass
+#define GFX_MAX_PASSES 8
+
+typedef struct {
+	const char *name;
+	f32 cpu_ms; // From GFX_Begin_pass to GFX_End_pass on the CPU
+	f32 gpu_ms; // Spent by the GPU on the commands of the pass, negative without timer queries
+} GFX_PassTiming;
+
+// Times the draws made until GFX_End_pass on the CPU and, with APP_Has_timer_query, on the GPU.
+// The draws queued before are flushed so they aren't counted on the pass, and the ones of the
+// pass are flushed by GFX_End_pass. The passes can't be nested and the name must live until the
+// results are read, use a string literal.
+void
+GFX_Begin_pass(const char *name);
+
+void
+GFX_End_pass(void);
+
+// Gets the timings of the passes of a previous frame, the GPU results are read without waiting
+// a few frames later. Returns the number of passes.
+u32
+GFX_Get_pass_timings(const GFX_PassTiming **timings_result);
+
 static inline void
 GFX_Draw_triangle_ex(Vec3 v0, Vec3 v1, Vec3 v2, Color n0, Color n1, Color n2, Vec2 uv0, Vec2 uv1,
 		Vec2 uv2, Color c0, Color c1, Color c2);
@@ -156,6 +392,39 @@ GFX_Draw_sphere(Vec3 pos, float radius, Color color);
 void
 GFX_Draw_torus(Vec3 pos, float radius0, float radius1, Color color);
 
+// Unit meshes built once by GFX_Init. The immediate functions above copy them into the batch and
+// GFX_Draw_instances draws many copies of them with one draw call.
+typedef enum {
+	GFX_MESH_CUBE,     // Side of 1, centered
+	GFX_MESH_SPHERE,   // Radius of 1
+	GFX_MESH_CYLINDER, // Radius of 1, from y=-0.5 to y=0.5
+	GFX_MESH_TORUS,    // Ring of radius 1 around the z axis, tube of radius GFX_UNIT_TORUS_TUBE_RADIUS
+	GFX_MESH_CIRCLE,   // Radius of 1 on the xy plane, facing +z
+
+	GFX_MESH_COUNT
+} GFX_Mesh;
+
+#define GFX_UNIT_TORUS_TUBE_RADIUS 0.25f
+
+// Per instance data of GFX_Draw_instances. The transform is made of the 3 first rows of an
+// affine matrix: position = rows * vec4(mesh_position, 1). The normals are transformed by the
+// inverse transpose of its 3x3 part, so non uniform scales are lit right.
+typedef struct {
+	Vec4  rows[3];
+	Color color;
+} GFX_Instance;
+
+// Instance that scales the unit mesh and moves it to pos
+static inline GFX_Instance
+GFX_Make_instance(Vec3 pos, Vec3 scale, Color color);
+
+// Draws count copies of a unit mesh with the current matrix, light and texture region. The
+// instances are uploaded once and drawn with one instanced draw call, the draws queued before are
+// flushed first. Without instancing support (see APP_Has_instancing) the instances are
+// transformed on the CPU and queued like the immediate draws.
+void
+GFX_Draw_instances(GFX_Mesh mesh, const GFX_Instance *instances, u32 count);
+
 
 
 
@@ -173,13 +442,69 @@ GFX_Draw_torus(Vec3 pos, float radius0, float radius1, Color color);
 
 
 
-// 64K vertices and indices
-#define VERTICES_BUFFER_MAX_SIZE_BYTES (GFX_VERTEX_SIZE*64*1024)
-#define INDICES_BUFFER_MAX_SIZE_BYTES (2*64*1024)
+// The batch must fit the biggest unit mesh, see GFX__Emit_mesh
+#define GFX__MIN_BATCH_VERTICES 4096
+// Maximum vertices that can be indexed with GFX_BUFFER_INDEX_TYPE_16
+#define GFX__MAX_BATCH_VERTICES_16 (64*1024)
+#define GFX__MAX_BATCH_VERTICES    (16*1024*1024)
 
 
-#define MAX_BUFFER_VERTICES  (VERTICES_BUFFER_MAX_SIZE_BYTES/GFX_VERTEX_SIZE)
+// Subdivisions of the unit meshes
+#define GFX__SPHERE_STACKS     20
+#define GFX__SPHERE_SLICES     40
+#define GFX__CYLINDER_SLICES   40
+#define GFX__TORUS_TUBE_SLICES 20
+#define GFX__TORUS_RING_SLICES 40
+#define GFX__CIRCLE_SLICES     30
 
+// First vertex of the side of the cylinder, the caps go before
+#define GFX__CYLINDER_SIDE_FIRST (2*(GFX__CYLINDER_SLICES+2))
+
+#define GFX__MESHES_MAX_VERTICES 2048
+#define GFX__MESHES_MAX_INDICES  (10*1024)
+
+// Frames that the GPU timings can be late, see GFX_Begin_pass
+#define GFX__TIMING_FRAMES 4
+
+#define GFX__MAX_COMMANDS        1024
+#define GFX__MAX_QUEUE_MATRICES  64
+#define GFX__MAX_QUEUE_LIGHTS    64
+
+typedef struct {
+	GLuint texture;
+	u16    matrix; // Index on GFX__data.queue.matrices
+	u16    light;  // Index on GFX__data.queue.lights
+	bool   sortable;
+	u32    first_index;
+	u32    indices_count;
+} GFX__Command;
+
+// Textures of the grid that the terrain shaders can sample, every one on the texture unit 1+map
+typedef enum {
+	GFX__TERRAIN_MAP_NORMAL, // See GFX_Set_terrain_normal_map
+	GFX__TERRAIN_MAP_AO,     // See GFX_Set_terrain_ao_map
+	GFX__TERRAIN_MAPS,
+} GFX__TerrainMap;
+
+// There is a variant of the terrain shader for every combination of maps (bit 1 << map)
+#define GFX__TERRAIN_VARIANTS (1 << GFX__TERRAIN_MAPS)
+
+// Shader used to draw the buffers with GFX_VERTEX_LAYOUT_TERRAIN
+typedef struct {
+	GLuint id;
+	GLint position;
+	GLint normal;
+	GLint vmat;
+	GLint texture;
+	GLint light_dir;
+	GLint quant_scale;
+	GLint quant_offset;
+	GLint uv_scale;
+	GLint uv_region;
+	GLint maps[GFX__TERRAIN_MAPS];       // Only on the variants that sample the map
+	GLint map_scales[GFX__TERRAIN_MAPS]; // Only on the variants that sample the map
+	bool  dirty; // The uniforms must be uploaded before the next draw
+} GFX__TerrainShader;
 
 // 
 // All the internal data used by the renderer
@@ -189,10 +514,12 @@ static struct {
     Mat4 matrix; // Current matrix that will be send to the shader
 	Vec3 light_dir;
 	GLuint texture;
+	Vec2 uv_offset; // Current region of the texture, see GFX_TextureRegion
+	Vec2 uv_scale;
 
-	u8 vertices_mem[VERTICES_BUFFER_MAX_SIZE_BYTES];
-	u8 indices_mem[INDICES_BUFFER_MAX_SIZE_BYTES];
-	
+	// Batch of the immediate mode functions, see GFX_Set_batch_size
+	u8 *vertices_mem;
+	u8 *indices_mem;
 	GFX_Buffer buffer;
 
 
@@ -206,18 +533,144 @@ static struct {
 		GLint vmat;
 		GLint texture;
 		GLint light_dir;
+		GLint uv_region;
 	} default_shader;
 
-	GLuint default_texture;
+	// Indexed by the maps that the variant samples, see GFX__TerrainMap
+	GFX__TerrainShader terrain_shaders[GFX__TERRAIN_VARIANTS];
+
+	struct {
+		Vec3 scale;
+		Vec3 offset;
+		Vec2 uv_scale;
+	} terrain_quantization;
+
+	struct {
+		GLuint texture;
+		Vec2   scale; // 1/size
+		GLuint bound; // Texture on the unit of the map, 0 if unknown
+	} terrain_maps[GFX__TERRAIN_MAPS];
+
+	// Shader used by GFX_Draw_instances, the default shader with the per instance attributes
+	struct {
+		GLuint id;
+		GLint position;
+		GLint normal;
+		GLint tex_coord;
+		GLint color;
+		GLint rows[3];
+		GLint instance_color;
+		GLint vmat;
+		GLint texture;
+		GLint light_dir;
+		GLint uv_region;
+	} instance_shader;
+
+	// Unit meshes, see GFX_Mesh
+	struct {
+		GFX_Buffer buffers[GFX_MESH_COUNT];
+		GFX_Vertex vertices_mem[GFX__MESHES_MAX_VERTICES];
+		u16        indices_mem[GFX__MESHES_MAX_INDICES];
+		GLuint     instanced_VAOs[GFX_MESH_COUNT]; // Mesh + instance attributes, 0 without VAOs
+		GLuint     instances_VBO;
+	} meshes;
+
+	// Shared atlas, also used as the default texture. The images are packed in shelves: they are
+	// placed from left to right and a new shelf is opened above the tallest one when the row is full.
+	struct {
+		GLuint texture;
+		u32 shelf_x;
+		u32 shelf_y;
+		u32 shelf_height;
+		GFX_TextureRegion white; // Region used by GFX_Set_texture(GFX_Default_texture())
+	} atlas;
+
+	bool use_vertex_arrays; // See APP_Has_vertex_arrays
+	bool use_instancing;    // See APP_Has_instancing
+	bool use_uint_indices;  // See APP_Has_uint_indices
+
+	GFX_FrameStats stats; // Of the current frame, see GFX_Get_frame_stats
+	GFX_FrameStats stats_last_frame;
+
+	// Timings of the passes, one set of queries per frame in flight. The set of the current frame
+	// is read when it's reused GFX__TIMING_FRAMES frames later, see GFX__Collect_pass_timings.
+	struct {
+		bool use_queries; // See APP_Has_timer_query
+		GLuint      queries[GFX__TIMING_FRAMES][GFX_MAX_PASSES];
+		const char *names[GFX__TIMING_FRAMES][GFX_MAX_PASSES];
+		f32         cpu_ms[GFX__TIMING_FRAMES][GFX_MAX_PASSES];
+		u32         counts[GFX__TIMING_FRAMES];
+		u32         frame;
+		bool        in_pass;
+		int64_t     pass_start;
+		GFX_PassTiming results[GFX_MAX_PASSES];
+		u32            results_count;
+	} timing;
+
+	// Queue of draws of the batch buffer, see GFX_Flush. The last command is the open one, its
+	// indices go from first_index to the end of the batch buffer.
+	struct {
+		GFX__Command commands[GFX__MAX_COMMANDS];
+		u32  commands_count;
+		Mat4 matrices[GFX__MAX_QUEUE_MATRICES];
+		u32  matrices_count;
+		Vec3 lights[GFX__MAX_QUEUE_LIGHTS];
+		u32  lights_count;
+		bool sorting;
+	} queue;
+
+	// State that the default shader and the texture unit have on the GPU
+	struct {
+		bool   valid;
+		Mat4   matrix;
+		Vec3   light_dir;
+		GLuint texture;
+		Vec4   uv_region;
+	} applied;
 
 } GFX__data = {0};
 
 
-// Makes a shader from a string (Documented above)
+static void
+GFX__Upload_buffer(GFX_Buffer *buffer, bool orphan);
+
+static void
+GFX__Draw_buffer_range(GFX_Buffer *buffer, GFX_Buffer *index_buffer, u32 first_index, u32 indices_count);
+
+static void
+GFX__Build_unit_meshes(void);
+
+static void
+GFX__Setup_instance_attributes(GFX_Buffer *mesh);
+
+static int
+GFX__Create_batch(u32 batch_vertices);
+
+static void
+GFX__Destroy_batch(void);
+
+static void
+GFX__Collect_pass_timings(u32 frame);
+
+static void
+GFX__Flush(GFX_FlushCause cause);
+
+
+// Makes a shader from a string, the defines (can be NULL) are inserted after the first line of
+// the source, the #version one
 int
-Make_shader_from_string(GLuint *shader_result, const char *shader_source, GLenum shader_type) {
+Make_shader_from_string_ex(GLuint *shader_result, const char *shader_source, GLenum shader_type, const char *defines) {
 	GLuint shader = glCreateShader(shader_type);
-	glShaderSource(shader, 1, &shader_source, NULL);
+	if (defines) {
+		const char *first_line_end = strchr(shader_source, '\n');
+		GLint first_line_length = first_line_end ? (GLint)(first_line_end - shader_source + 1) : (GLint)strlen(shader_source);
+		const GLchar *parts[3] = {shader_source, defines, shader_source + first_line_length};
+		GLint lengths[3] = {first_line_length, (GLint)strlen(defines), -1};
+		glShaderSource(shader, 3, parts, lengths);
+	}
+	else {
+		glShaderSource(shader, 1, &shader_source, NULL);
+	}
 	glCompileShader(shader);
 	GLint shader_compiled;
 	glGetShaderiv(shader, GL_COMPILE_STATUS, &shader_compiled);
@@ -233,16 +686,24 @@ Make_shader_from_string(GLuint *shader_result, const char *shader_source, GLenum
 	return 0;
 }
 
+// Makes a shader from a string
+int
+Make_shader_from_string(GLuint *shader_result, const char *shader_source, GLenum shader_type) {
+	return Make_shader_from_string_ex(shader_result, shader_source, shader_type, NULL);
+}
+
 
-// Makes a shader program from 2 shader strings (Documented above)
+// Makes a shader program from 2 shader strings with the same defines, see
+// Make_shader_from_string_ex. If attributes isn't NULL it's a NULL terminated list of attribute
+// names that get the locations 0, 1, 2...
 int
-Make_program_from_strings(GLuint *program, const char *vertex_shader_source, const char *fragment_shader_source) {
+Make_program_from_strings_ex(GLuint *program, const char *vertex_shader_source, const char *fragment_shader_source, const char *defines, const char **attributes) {
 	GLuint vertex_shader;
-	if (Make_shader_from_string(&vertex_shader, vertex_shader_source, GL_VERTEX_SHADER) != 0) {
+	if (Make_shader_from_string_ex(&vertex_shader, vertex_shader_source, GL_VERTEX_SHADER, defines) != 0) {
 		return -1;
 	}
 	GLuint fragment_shader;
-	if (Make_shader_from_string(&fragment_shader, fragment_shader_source, GL_FRAGMENT_SHADER) != 0) {
+	if (Make_shader_from_string_ex(&fragment_shader, fragment_shader_source, GL_FRAGMENT_SHADER, defines) != 0) {
 		return -1;
 	}
 
@@ -250,6 +711,10 @@ Make_program_from_strings(GLuint *program, const char *vertex_shader_source, con
 	glAttachShader(shader_program, vertex_shader);   // and attach both...
 	glAttachShader(shader_program, fragment_shader); // ... shaders to it
 
+	for (GLuint i = 0; attributes && attributes[i]; i+=1) {
+		glBindAttribLocation(shader_program, i, attributes[i]);
+	}
+
 	glLinkProgram(shader_program);   // link the program
 
 	// We can delete de shaders here
@@ -262,6 +727,12 @@ Make_program_from_strings(GLuint *program, const char *vertex_shader_source, con
 	return 0;
 }
 
+// Makes a shader program from 2 shader strings
+int
+Make_program_from_strings(GLuint *program, const char *vertex_shader_source, const char *fragment_shader_source) {
+	return Make_program_from_strings_ex(program, vertex_shader_source, fragment_shader_source, NULL, NULL);
+}
+
 
 
 typedef enum {
@@ -297,17 +768,156 @@ Program_get_location(GLint *result, GLuint program_id, LocationType location_typ
 }
 
 
+// Makes the variant of the terrain shader that samples the maps of the variant bits (see
+// GFX__TerrainMap). The buffers set up the attributes (and their VAOs) with the locations of
+// the first variant, so all of them are linked with the same ones.
+static int
+GFX__Make_terrain_shader(GFX__TerrainShader *shader, u32 variant) {
+	static const char *attributes[] = {"position", "normal", NULL};
+	static const char *map_defines[GFX__TERRAIN_MAPS]    = {"#define NORMAL_MAP\n", "#define AO_MAP\n"};
+	static const char *map_names[GFX__TERRAIN_MAPS]      = {"normal_map", "ao_map"};
+	static const char *map_scale_names[GFX__TERRAIN_MAPS] = {"normal_map_scale", "ao_map_scale"};
+
+	char defines[64] = "";
+	for (u32 map = 0; map < GFX__TERRAIN_MAPS; map+=1) {
+		if (variant & (1 << map)) strcat(defines, map_defines[map]);
+	}
+
+	if (0 != Make_program_from_strings_ex(
+			&shader->id,
+
+			// Vertex shader
+			"#version 100\n"
+
+			"uniform mat4 vmat;\n"
+			"uniform vec3 quant_scale;\n"
+			"uniform vec3 quant_offset;\n"
+			"uniform vec2 uv_scale;\n"
+			"uniform vec4 uv_region;\n"
+
+			"attribute vec3 position;\n"
+			"attribute vec2 normal;\n"
+
+			"varying mediump vec2 pixel_uv;\n"
+			"#ifdef NORMAL_MAP\n"
+			"uniform vec2 normal_map_scale;\n"
+			"varying mediump vec2 normal_map_uv;\n"
+			"#else\n"
+			"varying mediump vec3 pixel_normal;\n"
+			"#endif\n"
+			"#ifdef AO_MAP\n"
+			"uniform vec2 ao_map_scale;\n"
+			"varying mediump vec2 ao_map_uv;\n"
+			"#endif\n"
+
+			// Inverse of GFX_Oct_encode_normal
+			"vec3 oct_decode(vec2 e)\n"
+			"{\n"
+				"e = e*2.0-vec2(1.0, 1.0);\n"
+				"vec3 n = vec3(e, 1.0-abs(e.x)-abs(e.y));\n"
+				"if (n.z < 0.0) n.xy = (vec2(1.0, 1.0)-abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);\n"
+				"return normalize(n);\n"
+			"}\n"
+
+			"void main()\n"
+			"{\n"
+				"gl_Position = vec4(position*quant_scale + quant_offset, 1.0) * vmat;\n"
+				"pixel_uv    = uv_region.xy + position.xz*uv_scale*uv_region.zw;\n"
+				// The maps use the center of the texel of the grid position
+				"#ifdef NORMAL_MAP\n"
+				"normal_map_uv = (position.xz + vec2(0.5, 0.5))*normal_map_scale;\n"
+				"#else\n"
+				"pixel_normal= oct_decode(normal);\n"
+				"#endif\n"
+				"#ifdef AO_MAP\n"
+				"ao_map_uv = (position.xz + vec2(0.5, 0.5))*ao_map_scale;\n"
+				"#endif\n"
+			"}\n",
+
+			// Fragment shader
+			"#version 100\n"
+
+			"varying mediump vec2 pixel_uv;\n"
+			"uniform sampler2D texture;\n"
+			"uniform mediump vec3 light_dir;\n"
+			"#ifdef NORMAL_MAP\n"
+			"varying mediump vec2 normal_map_uv;\n"
+			"uniform sampler2D normal_map;\n"
+			"#else\n"
+			"varying mediump vec3 pixel_normal;\n"
+			"#endif\n"
+			"#ifdef AO_MAP\n"
+			"varying mediump vec2 ao_map_uv;\n"
+			"uniform sampler2D ao_map;\n"
+			"#endif\n"
+
+			"void main()\n"
+			"{\n"
+				"#ifdef NORMAL_MAP\n"
+				"mediump vec2 nxz = texture2D(normal_map, normal_map_uv).ra*2.0-vec2(1.0, 1.0);\n"
+				"mediump vec3 normal = vec3(nxz.x, sqrt(max(1.0-dot(nxz, nxz), 0.0)), nxz.y);\n"
+				"#else\n"
+				"mediump vec3 normal = pixel_normal;\n"
+				"#endif\n"
+				"mediump float intensity = max(-dot(light_dir, normalize(normal)), 0.3);\n"
+				"#ifdef AO_MAP\n"
+				"intensity *= texture2D(ao_map, ao_map_uv).r;\n"
+				"#endif\n"
+				"mediump vec4  tex_color = texture2D(texture, pixel_uv);\n"
+				"gl_FragColor = tex_color * vec4(vec3(intensity), 1.0);\n"
+			"}\n",
+
+			defines,
+			attributes
+
+			)) return -1;
+
+	GLuint prog_id = shader->id;
+	shader->position = 0;
+	shader->normal   = 1;
+	if (!Program_get_location(&shader->vmat, prog_id, LOC_TYPE_UNIFORM, "vmat"))
+		return -1;
+	if (!Program_get_location(&shader->light_dir, prog_id, LOC_TYPE_UNIFORM, "light_dir"))
+		return -1;
+	if (!Program_get_location(&shader->texture, prog_id, LOC_TYPE_UNIFORM, "texture"))
+		return -1;
+	if (!Program_get_location(&shader->quant_scale, prog_id, LOC_TYPE_UNIFORM, "quant_scale"))
+		return -1;
+	if (!Program_get_location(&shader->quant_offset, prog_id, LOC_TYPE_UNIFORM, "quant_offset"))
+		return -1;
+	if (!Program_get_location(&shader->uv_scale, prog_id, LOC_TYPE_UNIFORM, "uv_scale"))
+		return -1;
+	if (!Program_get_location(&shader->uv_region, prog_id, LOC_TYPE_UNIFORM, "uv_region"))
+		return -1;
+
+	// The terrain always samples the texture unit 0 and the maps the unit 1+map
+	glUseProgram(prog_id);
+	glUniform1i(shader->texture, 0);
+	for (u32 map = 0; map < GFX__TERRAIN_MAPS; map+=1) {
+		if (!(variant & (1 << map))) continue;
+		if (!Program_get_location(&shader->maps[map], prog_id, LOC_TYPE_UNIFORM, map_names[map]))
+			return -1;
+		if (!Program_get_location(&shader->map_scales[map], prog_id, LOC_TYPE_UNIFORM, map_scale_names[map]))
+			return -1;
+		glUniform1i(shader->maps[map], 1+map);
+	}
+	shader->dirty = true;
+	return 0;
+}
+
 // Documented above
 int
 GFX_Init(void) {
+	return GFX_Init_ex(GFX_DEFAULT_BATCH_VERTICES);
+}
 
-	GFX_Create_buffer(
-		&GFX__data.buffer,
-		GFX__data.vertices_mem,
-		VERTICES_BUFFER_MAX_SIZE_BYTES,
-		GFX__data.indices_mem,
-		INDICES_BUFFER_MAX_SIZE_BYTES,
-		GFX_BUFFER_INDEX_TYPE_16);
+// Documented above
+int
+GFX_Init_ex(u32 batch_vertices) {
+
+	GFX__data.use_vertex_arrays = APP_Has_vertex_arrays();
+	GFX__data.use_instancing    = APP_Has_instancing();
+	GFX__data.use_uint_indices  = APP_Has_uint_indices();
 
 	//
 	//
@@ -322,6 +932,7 @@ GFX_Init(void) {
 			"#version 100\n"
 			
 			"uniform mat4 vmat;\n"
+			"uniform vec4 uv_region;\n" // Texture region of the buffer draws, see GFX_Draw_buffer_ex
 			
 			"attribute vec3 position;\n"
 			"attribute vec4 normal;\n"
@@ -335,7 +946,7 @@ GFX_Init(void) {
 			"void main()\n"
 			"{\n"
 				"gl_Position = vec4(position, 1.0) * vmat;\n"
-				"pixel_uv    = tex_coord;\n"
+				"pixel_uv    = uv_region.xy + tex_coord*uv_region.zw;\n"
 				"pixel_normal= normalize(normal.xyz*2.0-vec3(1,1,1));\n"
 				"pixel_color = color;\n"
 			"}\n",
@@ -378,23 +989,164 @@ GFX_Init(void) {
 			goto render_setup_error;
 		if (!Program_get_location(&GFX__data.default_shader.texture, prog_id, LOC_TYPE_UNIFORM, "texture"))
 			goto render_setup_error;
+		if (!Program_get_location(&GFX__data.default_shader.uv_region, prog_id, LOC_TYPE_UNIFORM, "uv_region"))
+			goto render_setup_error;
 	}
 
-	static u8 default_texture[] = {
-		0xFF, 0xFF, 0xFF, 0xFF,   0xFF, 0xFF, 0xFF, 0xFF,
-		0xFF, 0xFF, 0xFF, 0xFF,   0xFF, 0xFF, 0xFF, 0xFF
-	};
+	//
+	// TERRAIN SHADER, see GFX_TerrainVertex
+	//
 
-	// Generates the default texture
-	glGenTextures(1, &GFX__data.default_texture);
-    glBindTexture(GL_TEXTURE_2D, GFX__data.default_texture);
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 2, 2, 0, GL_RGBA, GL_UNSIGNED_BYTE, default_texture);
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	for (u32 variant = 0; variant < GFX__TERRAIN_VARIANTS; variant+=1) {
+		if (0 != GFX__Make_terrain_shader(&GFX__data.terrain_shaders[variant], variant)) goto render_setup_error;
+	}
+	glUseProgram(GFX__data.default_shader.id);
+
+	// Generates the shared atlas, it starts transparent
+	{
+		u8 *atlas_pixels = (u8 *)calloc(GFX_ATLAS_SIZE * GFX_ATLAS_SIZE, 4);
+		if (atlas_pixels == NULL) goto render_setup_error;
+		glGenTextures(1, &GFX__data.atlas.texture);
+		glBindTexture(GL_TEXTURE_2D, GFX__data.atlas.texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, GFX_ATLAS_SIZE, GFX_ATLAS_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, atlas_pixels);
+		GFX_Count_upload(GFX_ATLAS_SIZE*GFX_ATLAS_SIZE*4);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		free(atlas_pixels);
+	}
+
+	// The white block of the default texture. The region is its inner 2x2 texels so the UVs on the
+	// borders of the region never sample outside of the block.
+	{
+		static u8 white_texels[4*4*4];
+		memset(white_texels, 0xFF, sizeof(white_texels));
+		GFX_TextureRegion block;
+		GFX_Atlas_add(white_texels, 4, 4, &block);
+		GFX__data.atlas.white.texture   = block.texture;
+		GFX__data.atlas.white.uv_offset = V2_Add(block.uv_offset, V2_Mulf(block.uv_scale, 0.25f));
+		GFX__data.atlas.white.uv_scale  = V2_Mulf(block.uv_scale, 0.5f);
+	}
+
+	GFX__data.texture   = GFX__data.atlas.texture;
+	GFX__data.uv_offset = GFX__data.atlas.white.uv_offset;
+	GFX__data.uv_scale  = GFX__data.atlas.white.uv_scale;
+
+	// The buffer is created after the shaders because the VAO needs the attribute locations
+	if (0 != GFX__Create_batch(batch_vertices)) {
+		fprintf(stderr, "Cannot allocate the batch of %u vertices\n", batch_vertices);
+		goto render_setup_error;
+	}
+
+	GFX__Build_unit_meshes();
+
+	GFX__data.timing.use_queries = APP_Has_timer_query();
+	if (GFX__data.timing.use_queries) glGenQueries(GFX__TIMING_FRAMES*GFX_MAX_PASSES, &GFX__data.timing.queries[0][0]);
+
+	//
+	// INSTANCE SHADER, only with instancing support
+	//
+
+	if (GFX__data.use_instancing) {
+		if (0 != Make_program_from_strings(
+				&GFX__data.instance_shader.id,
+
+				// Vertex shader
+				"#version 100\n"
+
+				"uniform mat4 vmat;\n"
+				"uniform vec4 uv_region;\n"
+
+				"attribute vec3 position;\n"
+				"attribute vec4 normal;\n"
+				"attribute vec2 tex_coord;\n"
+				"attribute mediump vec4 color;\n"
+				"attribute vec4 row0;\n"
+				"attribute vec4 row1;\n"
+				"attribute vec4 row2;\n"
+				"attribute mediump vec4 instance_color;\n"
+
+				"varying mediump vec2 pixel_uv;\n"
+				"varying mediump vec3 pixel_normal;\n"
+				"varying mediump vec4 pixel_color;\n"
+
+				"void main()\n"
+				"{\n"
+					"vec4 p = vec4(position, 1.0);\n"
+					"vec3 n = normal.xyz*2.0-vec3(1,1,1);\n"
+					"gl_Position = vec4(dot(row0, p), dot(row1, p), dot(row2, p), 1.0) * vmat;\n"
+					"pixel_uv    = uv_region.xy + tex_coord*uv_region.zw;\n"
+					// Inverse transpose of the 3x3 part, see GFX__Emit_mesh
+					"vec3 c0 = vec3(row0.x, row1.x, row2.x);\n"
+					"vec3 c1 = vec3(row0.y, row1.y, row2.y);\n"
+					"vec3 c2 = vec3(row0.z, row1.z, row2.z);\n"
+					"mat3 cofactors = mat3(cross(c1, c2), cross(c2, c0), cross(c0, c1));\n"
+					"pixel_normal= normalize(cofactors*n) * sign(dot(c0, cofactors[0]));\n"
+					"pixel_color = color * instance_color;\n"
+				"}\n",
+
+				// Fragment shader, same as the default one
+				"#version 100\n"
+
+				"varying mediump vec2 pixel_uv;\n"
+				"varying mediump vec3 pixel_normal;\n"
+				"varying mediump vec4 pixel_color;\n"
+				"uniform sampler2D texture;\n"
+				"uniform mediump vec3 light_dir;\n"
+
+				"void main()\n"
+				"{\n"
+					"mediump float intensity = max(-dot(light_dir, normalize(pixel_normal)), 0.3);\n"
+					"mediump vec4  tex_color = texture2D(texture, pixel_uv);\n"
+					"gl_FragColor = tex_color * pixel_color * vec4(vec3(intensity), 1.0);\n"
+				"}\n"
+
+				)) goto render_setup_error;
+
+		GLuint prog_id = GFX__data.instance_shader.id;
+
+		if (!Program_get_location(&GFX__data.instance_shader.position, prog_id, LOC_TYPE_ATTRIB, "position"))
+			goto render_setup_error;
+		if (!Program_get_location(&GFX__data.instance_shader.normal, prog_id, LOC_TYPE_ATTRIB, "normal"))
+			goto render_setup_error;
+		if (!Program_get_location(&GFX__data.instance_shader.tex_coord, prog_id, LOC_TYPE_ATTRIB, "tex_coord"))
+			goto render_setup_error;
+		if (!Program_get_location(&GFX__data.instance_shader.color, prog_id, LOC_TYPE_ATTRIB, "color"))
+			goto render_setup_error;
+		if (!Program_get_location(&GFX__data.instance_shader.rows[0], prog_id, LOC_TYPE_ATTRIB, "row0"))
+			goto render_setup_error;
+		if (!Program_get_location(&GFX__data.instance_shader.rows[1], prog_id, LOC_TYPE_ATTRIB, "row1"))
+			goto render_setup_error;
+		if (!Program_get_location(&GFX__data.instance_shader.rows[2], prog_id, LOC_TYPE_ATTRIB, "row2"))
+			goto render_setup_error;
+		if (!Program_get_location(&GFX__data.instance_shader.instance_color, prog_id, LOC_TYPE_ATTRIB, "instance_color"))
+			goto render_setup_error;
+		if (!Program_get_location(&GFX__data.instance_shader.vmat, prog_id, LOC_TYPE_UNIFORM, "vmat"))
+			goto render_setup_error;
+		if (!Program_get_location(&GFX__data.instance_shader.light_dir, prog_id, LOC_TYPE_UNIFORM, "light_dir"))
+			goto render_setup_error;
+		if (!Program_get_location(&GFX__data.instance_shader.texture, prog_id, LOC_TYPE_UNIFORM, "texture"))
+			goto render_setup_error;
+		if (!Program_get_location(&GFX__data.instance_shader.uv_region, prog_id, LOC_TYPE_UNIFORM, "uv_region"))
+			goto render_setup_error;
+
+		glUseProgram(prog_id);
+		glUniform1i(GFX__data.instance_shader.texture, 0);
+		glUseProgram(GFX__data.default_shader.id);
+
+		glGenBuffers(1, &GFX__data.meshes.instances_VBO);
 
-	GFX__data.texture = GFX__data.default_texture;
+		// The instance attributes of every mesh are captured once
+		if (GFX__data.use_vertex_arrays) {
+			glGenVertexArrays(GFX_MESH_COUNT, GFX__data.meshes.instanced_VAOs);
+			for (int i = 0; i < GFX_MESH_COUNT; i+=1) {
+				glBindVertexArray(GFX__data.meshes.instanced_VAOs[i]);
+				GFX__Setup_instance_attributes(&GFX__data.meshes.buffers[i]);
+			}
+			glBindVertexArray(0);
+		}
+	}
 
     GFX_Set_matrix(M4_Diagonal(1.0f));
 	GFX_Set_light_dir(V3(0, 0, -1));
@@ -409,60 +1161,428 @@ GFX_Init(void) {
 // Documented above
 void
 GFX_Deinit(void) {
-	// Clean the shader program
+	// Clean the shader programs
 	glDeleteProgram(GFX__data.default_shader.id);
+	for (u32 variant = 0; variant < GFX__TERRAIN_VARIANTS; variant+=1) {
+		glDeleteProgram(GFX__data.terrain_shaders[variant].id);
+	}
+	glDeleteProgram(GFX__data.instance_shader.id);
 	// Clean VBO
-	GFX_Destroy_buffer(&GFX__data.buffer);
-	glDeleteTextures(1, &GFX__data.default_texture);
+	GFX__Destroy_batch();
+	for (int i = 0; i < GFX_MESH_COUNT; i+=1) {
+		if (GFX__data.meshes.buffers[i].VBO) GFX_Destroy_buffer(&GFX__data.meshes.buffers[i]);
+	}
+	if (GFX__data.meshes.instanced_VAOs[0]) glDeleteVertexArrays(GFX_MESH_COUNT, GFX__data.meshes.instanced_VAOs);
+	glDeleteBuffers(1, &GFX__data.meshes.instances_VBO);
+	glDeleteTextures(1, &GFX__data.atlas.texture);
+	if (GFX__data.timing.use_queries) glDeleteQueries(GFX__TIMING_FRAMES*GFX_MAX_PASSES, &GFX__data.timing.queries[0][0]);
 	memset(&GFX__data, 0, sizeof(GFX__data));
 }
 
 
 
-// Documented above
-void
-GFX_Flush(void) {
-	GFX_Upload_buffer_to_gpu(&GFX__data.buffer);
-	GFX_Draw_buffer(&GFX__data.buffer);
-	GFX_Clear_buffer_data(&GFX__data.buffer);
+// Sets the uniforms of the default shader and binds the texture only if they changed. The
+// vertices of the batch already have the region applied, so their uv_region is (0, 0, 1, 1).
+static void
+GFX__Apply_state(Mat4 *matrix, Vec3 light_dir, GLuint texture, Vec4 uv_region) {
+	bool valid = GFX__data.applied.valid;
+	if (!valid || memcmp(&GFX__data.applied.matrix, matrix, sizeof(Mat4)) != 0) {
+		glUniformMatrix4fv(GFX__data.default_shader.vmat, 1, GL_FALSE, (GLfloat *)matrix);
+		GFX__data.applied.matrix = *matrix;
+	}
+	if (!valid || memcmp(&GFX__data.applied.light_dir, &light_dir, sizeof(Vec3)) != 0) {
+		glUniform3f(GFX__data.default_shader.light_dir, light_dir.x, light_dir.y, light_dir.z);
+		GFX__data.applied.light_dir = light_dir;
+	}
+	if (!valid || GFX__data.applied.texture != texture) {
+		glBindTexture(GL_TEXTURE_2D, texture);
+		GFX__data.applied.texture = texture;
+		GFX__data.stats.texture_binds += 1;
+	}
+	if (!valid || memcmp(&GFX__data.applied.uv_region, &uv_region, sizeof(Vec4)) != 0) {
+		glUniform4f(GFX__data.default_shader.uv_region, uv_region.x, uv_region.y, uv_region.z, uv_region.w);
+		GFX__data.applied.uv_region = uv_region;
+	}
+	GFX__data.applied.valid = true;
 }
 
+static bool
+GFX__Same_state(GFX__Command *a, GFX__Command *b) {
+	return a->texture == b->texture && a->matrix == b->matrix && a->light == b->light;
+}
 
+static int
+GFX__Compare_commands(const void *a_ptr, const void *b_ptr) {
+	const GFX__Command *a = a_ptr;
+	const GFX__Command *b = b_ptr;
+	if (a->texture != b->texture) return (a->texture < b->texture) ? -1 : 1;
+	if (a->matrix  != b->matrix)  return (a->matrix  < b->matrix)  ? -1 : 1;
+	if (a->light   != b->light)   return (a->light   < b->light)   ? -1 : 1;
+	return (a->first_index < b->first_index) ? -1 : 1;
+}
 
-void
-GFX_Begin(void) {
-	glUseProgram(GFX__data.default_shader.id);
-
-	glActiveTexture(GL_TEXTURE0);
-    glUniform1i(GFX__data.default_shader.texture, 0);
-	glBindTexture(GL_TEXTURE_2D, GFX__data.texture);
-
-	glUniform3f(GFX__data.default_shader.light_dir, 0.0f, 0.0f, -1.0f);
+// Sets the indices count of the open command
+static void
+GFX__Close_command(void) {
+	if (GFX__data.queue.commands_count == 0) return;
+	GFX__Command *last = &GFX__data.queue.commands[GFX__data.queue.commands_count-1];
+	last->indices_count = GFX__data.buffer.indices_count - last->first_index;
 }
 
+// Opens a command with the current state, the caller must ensure that there is room for it
+static void
+GFX__Open_command(void) {
+	GFX__Command cmd = {0};
+	cmd.texture     = GFX__data.texture;
+	cmd.sortable    = GFX__data.queue.sorting;
+	cmd.first_index = GFX__data.buffer.indices_count;
+
+	// The matrices and lights are usually repeated, search them before adding a new one
+	u32 matrix = 0;
+	while (matrix < GFX__data.queue.matrices_count &&
+	       memcmp(&GFX__data.queue.matrices[matrix], &GFX__data.matrix, sizeof(Mat4)) != 0) matrix += 1;
+	if (matrix == GFX__data.queue.matrices_count) GFX__data.queue.matrices[GFX__data.queue.matrices_count++] = GFX__data.matrix;
+	u32 light = 0;
+	while (light < GFX__data.queue.lights_count &&
+	       memcmp(&GFX__data.queue.lights[light], &GFX__data.light_dir, sizeof(Vec3)) != 0) light += 1;
+	if (light == GFX__data.queue.lights_count) GFX__data.queue.lights[GFX__data.queue.lights_count++] = GFX__data.light_dir;
+	cmd.matrix = (u16)matrix;
+	cmd.light  = (u16)light;
+
+	if (GFX__data.queue.commands_count > 0) {
+		// Reopen the previous command if it has the same state, the indices will be contiguous
+		GFX__Command *prev = &GFX__data.queue.commands[GFX__data.queue.commands_count-1];
+		if (GFX__Same_state(prev, &cmd) && prev->sortable == cmd.sortable) return;
+	}
+	GFX__data.queue.commands[GFX__data.queue.commands_count++] = cmd;
+}
 
+// Closes the open command and opens another one with the new current state
+static void
+GFX__State_changed(void) {
+	GFX__Close_command();
+	// Nothing was drawn with the previous state, it's replaced
+	if (GFX__data.queue.commands_count > 0 &&
+	    GFX__data.queue.commands[GFX__data.queue.commands_count-1].indices_count == 0) {
+		GFX__data.queue.commands_count -= 1;
+	}
+	if (GFX__data.queue.commands_count  == GFX__MAX_COMMANDS ||
+	    GFX__data.queue.matrices_count == GFX__MAX_QUEUE_MATRICES ||
+	    GFX__data.queue.lights_count   == GFX__MAX_QUEUE_LIGHTS) {
+		GFX__Flush(GFX_FLUSH_QUEUE_FULL); // Opens the command
+		return;
+	}
+	GFX__Open_command();
+}
 
+// Documented above
 void
-GFX_End(void) {
-	GFX_Flush();
+GFX_Flush(void) {
+	GFX__Flush(GFX_FLUSH_EXPLICIT);
 }
 
+static void
+GFX__Flush(GFX_FlushCause cause) {
+	PROFILE_ZONE("GFX_Flush");
+	GFX__Close_command();
+
+	if (GFX__data.buffer.indices_count > 0) {
+		// The previous storage is orphaned so the upload never waits for the draws that still use it
+		u64 bytes_streamed = GFX__data.stats.bytes_streamed;
+		GFX__Upload_buffer(&GFX__data.buffer, true);
+		GFX__data.stats.flushes[cause] += 1;
+		GFX__data.stats.bytes_flushed  += GFX__data.stats.bytes_streamed - bytes_streamed;
+		GFX__data.stats.vertices       += GFX__data.buffer.vertices_count;
+
+		GFX__Command *commands = GFX__data.queue.commands;
+		u32 count = GFX__data.queue.commands_count;
+
+		// Sort the runs of sortable commands, the first index keeps the sort stable
+		for (u32 i = 0; i < count;) {
+			u32 run_end = i;
+			while (run_end < count && commands[run_end].sortable) run_end += 1;
+			if (run_end - i > 1) qsort(&commands[i], run_end - i, sizeof(GFX__Command), GFX__Compare_commands);
+			i = Max(run_end, i+1);
+		}
+
+		for (u32 i = 0; i < count; i += 1) {
+			GFX__Command cmd = commands[i];
+			if (cmd.indices_count == 0) continue;
+			// Merge with the next ones while they have the same state and contiguous indices
+			while (i+1 < count && GFX__Same_state(&cmd, &commands[i+1]) &&
+			       cmd.first_index + cmd.indices_count == commands[i+1].first_index) {
+				cmd.indices_count += commands[i+1].indices_count;
+				i += 1;
+			}
+			GFX__Apply_state(&GFX__data.queue.matrices[cmd.matrix], GFX__data.queue.lights[cmd.light], cmd.texture, V4(0, 0, 1, 1));
+			GFX__Draw_buffer_range(&GFX__data.buffer, &GFX__data.buffer, cmd.first_index, cmd.indices_count);
+		}
+	}
+
+	GFX_Clear_buffer_data(&GFX__data.buffer);
+	GFX__data.queue.commands_count = 0;
+	GFX__data.queue.matrices_count = 0;
+	GFX__data.queue.lights_count   = 0;
+	GFX__Open_command();
+}
+
+// Documented above
+void
+GFX_Set_sorting(bool enabled) {
+	if (GFX__data.queue.sorting != enabled) {
+		GFX__data.queue.sorting = enabled;
+		GFX__State_changed();
+	}
+}
+
+// Documented above
+u32
+GFX_Get_bytes_streamed(void) {
+	return (u32)GFX__data.stats_last_frame.bytes_streamed;
+}
+
+// Documented above
+GFX_FrameStats
+GFX_Get_frame_stats(void) {
+	return GFX__data.stats_last_frame;
+}
+
+// Doc above
+void
+GFX_Count_upload(u64 bytes) {
+	GFX__data.stats.texture_binds  += 1;
+	GFX__data.stats.bytes_uploaded += bytes;
+	GFX__data.applied.valid = false;
+}
+
+static int
+GFX__Create_batch(u32 batch_vertices) {
+	u32 max_vertices = GFX__data.use_uint_indices ? GFX__MAX_BATCH_VERTICES : GFX__MAX_BATCH_VERTICES_16;
+	batch_vertices = Clamp(batch_vertices, GFX__MIN_BATCH_VERTICES, max_vertices);
+	u32 batch_indices = batch_vertices/2*3;
+
+	GFX_BufferIndexType index_type = GFX_BUFFER_INDEX_TYPE_16;
+	u32 index_size = 2;
+	if (batch_vertices > GFX__MAX_BATCH_VERTICES_16) {
+		index_type = GFX_BUFFER_INDEX_TYPE_32;
+		index_size = 4;
+	}
+
+	GFX__data.vertices_mem = malloc(batch_vertices*GFX_VERTEX_SIZE);
+	GFX__data.indices_mem  = malloc(batch_indices*index_size);
+	if (GFX__data.vertices_mem == NULL || GFX__data.indices_mem == NULL) {
+		GFX__Destroy_batch();
+		return -1;
+	}
+
+	return GFX_Create_buffer(
+		&GFX__data.buffer,
+		GFX__data.vertices_mem,
+		batch_vertices*GFX_VERTEX_SIZE,
+		GFX__data.indices_mem,
+		batch_indices*index_size,
+		index_type);
+}
+
+static void
+GFX__Destroy_batch(void) {
+	if (GFX__data.buffer.VBO) GFX_Destroy_buffer(&GFX__data.buffer);
+	free(GFX__data.vertices_mem);
+	free(GFX__data.indices_mem);
+	GFX__data.vertices_mem = NULL;
+	GFX__data.indices_mem  = NULL;
+}
+
+// Documented above
+int
+GFX_Set_batch_size(u32 batch_vertices) {
+	u32 prev_vertices = GFX_Get_batch_size();
+	GFX_Flush();
+	GFX__Destroy_batch();
+	if (0 != GFX__Create_batch(batch_vertices)) {
+		// Go back to the previous batch so the immediate functions keep working
+		GFX__Create_batch(prev_vertices);
+		return -1;
+	}
+	return 0;
+}
+
+// Documented above
+u32
+GFX_Get_batch_size(void) {
+	return GFX__data.buffer.vertices_cap;
+}
+
+// Documented above
+u32
+GFX_Get_flush_count(void) {
+	u32 result = 0;
+	for (int i = 0; i < GFX_FLUSH_CAUSE_COUNT; i+=1) result += GFX__data.stats_last_frame.flushes[i];
+	return result;
+}
+
+// Documented above
+u32
+GFX_Get_bytes_per_flush(void) {
+	u32 flushes = GFX_Get_flush_count();
+	if (flushes == 0) return 0;
+	return (u32)(GFX__data.stats_last_frame.bytes_flushed / flushes);
+}
+
+// Documented above
+void
+GFX_Begin_pass(const char *name) {
+	Assert(!GFX__data.timing.in_pass, "The passes can't be nested");
+	u32 frame = GFX__data.timing.frame;
+	u32 pass  = GFX__data.timing.counts[frame];
+	if (pass == GFX_MAX_PASSES) return;
+
+	GFX_Flush();
+	GFX__data.timing.in_pass    = true;
+	GFX__data.timing.pass_start = APP_Time();
+	GFX__data.timing.names[frame][pass] = name;
+	if (GFX__data.timing.use_queries) glBeginQuery(GL_TIME_ELAPSED, GFX__data.timing.queries[frame][pass]);
+}
+
+// Documented above
+void
+GFX_End_pass(void) {
+	if (!GFX__data.timing.in_pass) return; // Ignored by GFX_Begin_pass, there are too many passes
+	u32 frame = GFX__data.timing.frame;
+	u32 pass  = GFX__data.timing.counts[frame];
+
+	GFX_Flush();
+	if (GFX__data.timing.use_queries) glEndQuery(GL_TIME_ELAPSED);
+	GFX__data.timing.cpu_ms[frame][pass] = (f32)(APP_Time() - GFX__data.timing.pass_start)*1e-6f;
+	GFX__data.timing.counts[frame] += 1;
+	GFX__data.timing.in_pass = false;
+}
+
+// Reads the timings of the passes recorded on the set of the frame, if the GPU hasn't finished
+// them yet the previous results are kept. The set is emptied to be reused.
+static void
+GFX__Collect_pass_timings(u32 frame) {
+	u32 count = GFX__data.timing.counts[frame];
+	GFX__data.timing.counts[frame] = 0;
+	if (count == 0) return;
+
+	bool has_gpu = GFX__data.timing.use_queries;
+	if (has_gpu) {
+		// The queries finish in order, if the last one is available all of them are
+		GLuint available = 0;
+		glGetQueryObjectuiv(GFX__data.timing.queries[frame][count-1], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) return;
+		if (APP_Timer_query_disjoint()) has_gpu = false;
+	}
+
+	for (u32 i = 0; i < count; i += 1) {
+		GFX_PassTiming *result = &GFX__data.timing.results[i];
+		result->name   = GFX__data.timing.names[frame][i];
+		result->cpu_ms = GFX__data.timing.cpu_ms[frame][i];
+		result->gpu_ms = -1.0f;
+		if (has_gpu) {
+			// In nanoseconds, 32 bits are enough for 4 seconds
+			GLuint elapsed = 0;
+			glGetQueryObjectuiv(GFX__data.timing.queries[frame][i], GL_QUERY_RESULT, &elapsed);
+			result->gpu_ms = (f32)elapsed*1e-6f;
+		}
+	}
+	GFX__data.timing.results_count = count;
+}
+
+// Documented above
+u32
+GFX_Get_pass_timings(const GFX_PassTiming **timings_result) {
+	*timings_result = GFX__data.timing.results;
+	return GFX__data.timing.results_count;
+}
+
+
+
+void
+GFX_Begin(void) {
+	GFX__data.stats_last_frame = GFX__data.stats;
+	GFX__data.stats = (GFX_FrameStats){0};
+
+	GFX__data.timing.frame = (GFX__data.timing.frame+1) % GFX__TIMING_FRAMES;
+	GFX__Collect_pass_timings(GFX__data.timing.frame);
+
+	glUseProgram(GFX__data.default_shader.id);
+
+	glActiveTexture(GL_TEXTURE0);
+    glUniform1i(GFX__data.default_shader.texture, 0);
+
+	// Someone may have changed the GL state between frames
+	GFX__data.applied.valid = false;
+	for (u32 map = 0; map < GFX__TERRAIN_MAPS; map+=1) GFX__data.terrain_maps[map].bound = 0;
+	GFX_Set_light_dir(V3(0.0f, 0.0f, -1.0f));
+}
+
+
+
+void
+GFX_End(void) {
+	GFX__Flush(GFX_FLUSH_END);
+}
+
+
+// Binds the VBO and specifies the attributes of the buffer layout, this is stored on the VAO
+// when they are supported or done on every draw if not
+static void
+GFX__Setup_vertex_attributes(GFX_Buffer *buffer) {
+	glBindBuffer(GL_ARRAY_BUFFER, buffer->VBO);
+	if (buffer->vertex_layout == GFX_VERTEX_LAYOUT_TERRAIN) {
+		unsigned int stride = 3*2 + 2; // 3 shorts + 2 bytes
+		glEnableVertexAttribArray(GFX__data.terrain_shaders[0].position);
+		glVertexAttribPointer(GFX__data.terrain_shaders[0].position, 3, GL_UNSIGNED_SHORT, false, stride, (void*)0);
+		glEnableVertexAttribArray(GFX__data.terrain_shaders[0].normal);
+		glVertexAttribPointer(GFX__data.terrain_shaders[0].normal, 2, GL_UNSIGNED_BYTE, true, stride, (void*)(3*sizeof(u16)));
+	}
+	else {
+		unsigned int stride = 3*4 + 4 + 2*4 + 4; // 3 floats + 4 bytes + 2 floats + 4 bytes
+    	glEnableVertexAttribArray(GFX__data.default_shader.position);
+		glVertexAttribPointer(GFX__data.default_shader.position, 3, GL_FLOAT, false, stride, (void*)(0*sizeof(float)));
+    	glEnableVertexAttribArray(GFX__data.default_shader.normal);
+		glVertexAttribPointer(GFX__data.default_shader.normal, 3, GL_UNSIGNED_BYTE, true, stride, (void*)(3*sizeof(float)));
+    	glEnableVertexAttribArray(GFX__data.default_shader.tex_coord);
+		glVertexAttribPointer(GFX__data.default_shader.tex_coord, 2, GL_FLOAT, false, stride, (void*)(4*sizeof(float)));
+    	glEnableVertexAttribArray(GFX__data.default_shader.color);
+		glVertexAttribPointer(GFX__data.default_shader.color, 4, GL_UNSIGNED_BYTE, true, stride, (void*)(6*sizeof(float)));
+	}
+}
 
 int
 GFX_Create_buffer(GFX_Buffer *buffer_out, void *vertices_mem, u32 vertices_mem_size, void *indices_mem, u32 indices_mem_size, GFX_BufferIndexType index_type) {
+	return GFX_Create_buffer_ex(buffer_out, vertices_mem, vertices_mem_size, indices_mem, indices_mem_size, index_type, GFX_VERTEX_LAYOUT_DEFAULT);
+}
+
+// Documented above
+int
+GFX_Create_buffer_ex(GFX_Buffer *buffer_out, void *vertices_mem, u32 vertices_mem_size, void *indices_mem, u32 indices_mem_size, GFX_BufferIndexType index_type, GFX_VertexLayout vertex_layout) {
 	GFX_Buffer result = {0};
 	GLuint buffer_objects[2];
 	glGenBuffers(2, buffer_objects);
 	result.VBO = buffer_objects[0];
 	result.EBO = buffer_objects[1];
 
+	// Binding the EBO would change the VAO that is currently bound
+	if (GFX__data.use_vertex_arrays) glBindVertexArray(0);
+
 	glBindBuffer(GL_ARRAY_BUFFER, result.VBO);
 	glBufferData(GL_ARRAY_BUFFER, vertices_mem_size, NULL, GL_DYNAMIC_DRAW);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, result.EBO);
 	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices_mem_size, NULL, GL_DYNAMIC_DRAW);
 
+	result.vertex_layout = vertex_layout;
+	if (vertex_layout == GFX_VERTEX_LAYOUT_TERRAIN) {
+		result.vertex_size = GFX_TERRAIN_VERTEX_SIZE;
+	}
+	else {
+		result.vertex_size = GFX_VERTEX_SIZE;
+	}
+
 	result.vertices       = vertices_mem;
-	result.vertices_cap   = vertices_mem_size / GFX_VERTEX_SIZE;
+	result.vertices_cap   = vertices_mem_size / result.vertex_size;
 	result.vertices_count = 0;
 
 	result.indices       = indices_mem;
@@ -477,6 +1597,15 @@ GFX_Create_buffer(GFX_Buffer *buffer_out, void *vertices_mem, u32 vertices_mem_s
 
 	result.index_type = index_type;
 
+	if (GFX__data.use_vertex_arrays) {
+		glGenVertexArrays(1, &result.VAO);
+		glBindVertexArray(result.VAO);
+		GFX__Setup_vertex_attributes(&result);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, result.EBO);
+		result.VAO_EBO = result.EBO;
+		glBindVertexArray(0);
+	}
+
 	*buffer_out = result;
 
 	return 0;
@@ -484,8 +1613,9 @@ GFX_Create_buffer(GFX_Buffer *buffer_out, void *vertices_mem, u32 vertices_mem_s
 
 void
 GFX_Destroy_buffer(GFX_Buffer *buffer) {
+	if (buffer->VAO) glDeleteVertexArrays(1, &buffer->VAO);
 	GLuint buffer_objects[] = {buffer->VBO, buffer->EBO};
-	glDeleteBuffers(0, buffer_objects);
+	glDeleteBuffers(2, buffer_objects);
 	*buffer = (GFX_Buffer){0};
 }
 
@@ -496,27 +1626,40 @@ GFX_Clear_buffer_data(GFX_Buffer *buffer) {
 	buffer->indices_count = 0;
 }
 
-void
-GFX_Upload_buffer_to_gpu(GFX_Buffer *buffer) {
-
-	u32 bytes_of_vertices  = GFX_VERTEX_SIZE * buffer->vertices_count;
+// When orphan is true the storage of the buffer objects is reallocated with glBufferData(NULL)
+// before the upload, the driver gives us fresh memory while the draws queued with the previous
+// storage are still executing instead of blocking until they finish.
+static void
+GFX__Upload_buffer(GFX_Buffer *buffer, bool orphan) {
+
+	u32 index_size = (buffer->index_type == GFX_BUFFER_INDEX_TYPE_16) ? 2 : 4;
+	u32 bytes_of_vertices = buffer->vertex_size * buffer->vertices_count;
+	u32 bytes_of_indices  = index_size * buffer->indices_count;
+	if (buffer->VAO) {
+		// Uploads through the VAO of the buffer so no other VAO gets this EBO
+		glBindVertexArray(buffer->VAO);
+		buffer->VAO_EBO = buffer->EBO;
+	}
 	glBindBuffer(GL_ARRAY_BUFFER, buffer->VBO);
+	if (orphan) glBufferData(GL_ARRAY_BUFFER, buffer->vertex_size * buffer->vertices_cap, NULL, GL_STREAM_DRAW);
 	glBufferSubData(GL_ARRAY_BUFFER, 0, bytes_of_vertices, buffer->vertices);
-	u32 bytes_of_indices;
-	if (buffer->index_type == GFX_BUFFER_INDEX_TYPE_16) {
-		bytes_of_indices = 2 * buffer->indices_count;
-	}
-	else {
-		bytes_of_indices = 4 * buffer->indices_count;
-	}
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer->EBO);
+	if (orphan) glBufferData(GL_ELEMENT_ARRAY_BUFFER, index_size * buffer->indices_cap, NULL, GL_STREAM_DRAW);
 	glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, bytes_of_indices, buffer->indices);
 
+	GFX__data.stats.bytes_uploaded += bytes_of_vertices + bytes_of_indices;
+	if (orphan) GFX__data.stats.bytes_streamed += bytes_of_vertices + bytes_of_indices;
+}
+
+void
+GFX_Upload_buffer_to_gpu(GFX_Buffer *buffer) {
+	GFX__Upload_buffer(buffer, false);
 }
 
 
 GFX_Vertex *
 GFX_Alloc_vertices(GFX_Buffer *buffer, u32 count, u32 *base_index) {
+	Assert(buffer->vertex_layout == GFX_VERTEX_LAYOUT_DEFAULT, "The buffer doesn't use GFX_Vertex");
 	if ((buffer->vertices_cap - buffer->vertices_count) < count) return NULL;
 	GFX_Vertex *result = &buffer->vertices[buffer->vertices_count];
 	if (base_index) *base_index = buffer->vertices_count;
@@ -524,6 +1667,16 @@ GFX_Alloc_vertices(GFX_Buffer *buffer, u32 count, u32 *base_index) {
 	return result;
 }
 
+GFX_TerrainVertex *
+GFX_Alloc_terrain_vertices(GFX_Buffer *buffer, u32 count, u32 *base_index) {
+	Assert(buffer->vertex_layout == GFX_VERTEX_LAYOUT_TERRAIN, "The buffer doesn't use GFX_TerrainVertex");
+	if ((buffer->vertices_cap - buffer->vertices_count) < count) return NULL;
+	GFX_TerrainVertex *result = &buffer->terrain_vertices[buffer->vertices_count];
+	if (base_index) *base_index = buffer->vertices_count;
+	buffer->vertices_count += count;
+	return result;
+}
+
 void *
 GFX_Alloc_indices(GFX_Buffer *buffer, u32 count) {
 	if (buffer->indices_cap - buffer->indices_count < count) return NULL;
@@ -554,40 +1707,314 @@ GFX_Get_remaining_indices(GFX_Buffer *buffer) {
 	return buffer->indices_cap - buffer->indices_count;
 }
 
+static inline void
+GFX__Set_index(void *indices, GFX_BufferIndexType index_type, u32 position, u32 value) {
+	if (index_type == GFX_BUFFER_INDEX_TYPE_16) ((u16 *)indices)[position] = (u16)value;
+	else                                         ((u32 *)indices)[position] = value;
+}
+
+static inline u32
+GFX__Get_index(void *indices, GFX_BufferIndexType index_type, u32 position) {
+	if (index_type == GFX_BUFFER_INDEX_TYPE_16) return ((u16 *)indices)[position];
+	else                                         return ((u32 *)indices)[position];
+}
+
+// Documented above
+u32
+GFX_Make_grid_indices(void *indices, GFX_BufferIndexType index_type, u32 quads_x, u32 quads_z, u32 step, u32 row_pitch, u32 cache_size) {
+	// A band of n quads touches n+1 vertices per row and the previous row must still be in the
+	// cache when its last vertex is used, with a FIFO cache that leaves room for one more vertex
+	u32 band_quads = quads_x;
+	if (cache_size >= 6) band_quads = Min(cache_size/2 - 2, quads_x);
+
+	u32 written = 0;
+	for (u32 band_start = 0; band_start < quads_x; band_start += band_quads) {
+		u32 band_end = Min(band_start + band_quads, quads_x);
+		for (u32 row = 1; row <= quads_z; row += 1) {
+			for (u32 col = band_start+1; col <= band_end; col += 1) {
+				u32 index0 = (row-1) * step * row_pitch + (col-1) * step;
+				u32 index1 = (row)   * step * row_pitch + (col-1) * step;
+				u32 index2 = (row)   * step * row_pitch + (col)   * step;
+				u32 index3 = (row-1) * step * row_pitch + (col)   * step;
+				GFX__Set_index(indices, index_type, written+0, index0);
+				GFX__Set_index(indices, index_type, written+1, index1);
+				GFX__Set_index(indices, index_type, written+2, index2);
+				GFX__Set_index(indices, index_type, written+3, index0);
+				GFX__Set_index(indices, index_type, written+4, index2);
+				GFX__Set_index(indices, index_type, written+5, index3);
+				written += 6;
+			}
+		}
+	}
+	return written;
+}
+
+// Documented above
+f32
+GFX_Compute_acmr(void *indices, GFX_BufferIndexType index_type, u32 indices_count, u32 cache_size) {
+	Assert(cache_size > 0 && cache_size <= 64, "Unsupported vertex cache size");
+	if (indices_count < 3) return 0.0f;
+
+	u32 cache[64];
+	u32 cache_count = 0;
+	u32 cache_next  = 0; // Oldest entry once the cache is full
+	u32 misses      = 0;
+	for (u32 i = 0; i < indices_count; i += 1) {
+		u32 index = GFX__Get_index(indices, index_type, i);
+		bool hit = false;
+		for (u32 c = 0; c < cache_count; c += 1) {
+			if (cache[c] == index) {
+				hit = true;
+				break;
+			}
+		}
+		if (hit) continue;
+
+		misses += 1;
+		if (cache_count < cache_size) {
+			cache[cache_count++] = index;
+		}
+		else {
+			cache[cache_next] = index;
+			cache_next = (cache_next + 1) % cache_size;
+		}
+	}
+	return (f32)misses / (f32)(indices_count/3);
+}
+
+
+// The uniforms of all the terrain shaders have to be uploaded again
+static inline void
+GFX__Terrain_shaders_dirty(void) {
+	for (u32 variant = 0; variant < GFX__TERRAIN_VARIANTS; variant+=1) {
+		GFX__data.terrain_shaders[variant].dirty = true;
+	}
+}
+
+static void
+GFX__Use_terrain_shader(void) {
+	u32 variant = 0;
+	for (u32 map = 0; map < GFX__TERRAIN_MAPS; map+=1) {
+		if (GFX__data.terrain_maps[map].texture) variant |= 1 << map;
+	}
+	GFX__TerrainShader *shader = &GFX__data.terrain_shaders[variant];
+	glUseProgram(shader->id);
+	if (shader->dirty) {
+		Vec3 light_dir = GFX__data.light_dir;
+		Vec3 scale     = GFX__data.terrain_quantization.scale;
+		Vec3 offset    = GFX__data.terrain_quantization.offset;
+		Vec2 uv_scale  = GFX__data.terrain_quantization.uv_scale;
+		glUniformMatrix4fv(shader->vmat, 1, GL_FALSE, (GLfloat *)&GFX__data.matrix);
+		glUniform3f(shader->light_dir, light_dir.x, light_dir.y, light_dir.z);
+		glUniform3f(shader->quant_scale, scale.x, scale.y, scale.z);
+		glUniform3f(shader->quant_offset, offset.x, offset.y, offset.z);
+		glUniform2f(shader->uv_scale, uv_scale.x, uv_scale.y);
+		glUniform4f(shader->uv_region, GFX__data.uv_offset.x, GFX__data.uv_offset.y, GFX__data.uv_scale.x, GFX__data.uv_scale.y);
+		for (u32 map = 0; map < GFX__TERRAIN_MAPS; map+=1) {
+			if (!(variant & (1 << map))) continue;
+			Vec2 map_scale = GFX__data.terrain_maps[map].scale;
+			glUniform2f(shader->map_scales[map], map_scale.x, map_scale.y);
+		}
+		shader->dirty = false;
+	}
+	for (u32 map = 0; map < GFX__TERRAIN_MAPS; map+=1) {
+		GLuint texture = GFX__data.terrain_maps[map].texture;
+		if (texture && GFX__data.terrain_maps[map].bound != texture) {
+			glActiveTexture(GL_TEXTURE1+map);
+			glBindTexture(GL_TEXTURE_2D, texture);
+			glActiveTexture(GL_TEXTURE0);
+			GFX__data.terrain_maps[map].bound = texture;
+			GFX__data.stats.texture_binds += 1;
+		}
+	}
+}
 
 void
 GFX_Draw_buffer(GFX_Buffer *buffer) {
-	glBindBuffer(GL_ARRAY_BUFFER, buffer->VBO);
-	unsigned int stride = 3*4 + 4 + 2*4 + 4; // 3 floats + 4 bytes + 2 floats + 4 bytes
-    glEnableVertexAttribArray(GFX__data.default_shader.position);
-	glVertexAttribPointer(GFX__data.default_shader.position, 3, GL_FLOAT, false, stride, (void*)(0*sizeof(float)));
-    glEnableVertexAttribArray(GFX__data.default_shader.normal);
-	glVertexAttribPointer(GFX__data.default_shader.normal, 3, GL_UNSIGNED_BYTE, true, stride, (void*)(3*sizeof(float)));
-    glEnableVertexAttribArray(GFX__data.default_shader.tex_coord);
-	glVertexAttribPointer(GFX__data.default_shader.tex_coord, 2, GL_FLOAT, false, stride, (void*)(4*sizeof(float)));
-    glEnableVertexAttribArray(GFX__data.default_shader.color);
-	glVertexAttribPointer(GFX__data.default_shader.color, 4, GL_UNSIGNED_BYTE, true, stride, (void*)(6*sizeof(float)));
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer->EBO);
-	GLenum index_type = (buffer->index_type == GFX_BUFFER_INDEX_TYPE_16) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
-	glDrawElements(GL_TRIANGLES, buffer->indices_count, index_type, 0);
+	GFX_Draw_buffer_ex(buffer, buffer, 0, buffer->indices_count);
 }
 
+// Documented above
+void
+GFX_Draw_buffer_ex(GFX_Buffer *buffer, GFX_Buffer *index_buffer, u32 first_index, u32 indices_count) {
+	// Keep the order with the queued draws
+	GFX__Flush(GFX_FLUSH_DRAW_BUFFER);
+	GFX__data.stats.vertices += buffer->vertices_count;
+	// The vertices of the buffers don't know about the regions
+	Vec4 uv_region = V4(GFX__data.uv_offset.x, GFX__data.uv_offset.y, GFX__data.uv_scale.x, GFX__data.uv_scale.y);
+	GFX__Apply_state(&GFX__data.matrix, GFX__data.light_dir, GFX__data.texture, uv_region);
+	GFX__Draw_buffer_range(buffer, index_buffer, first_index, indices_count);
+}
 
+static void
+GFX__Draw_buffer_range(GFX_Buffer *buffer, GFX_Buffer *index_buffer, u32 first_index, u32 indices_count) {
+	if (buffer->vertex_layout == GFX_VERTEX_LAYOUT_TERRAIN) GFX__Use_terrain_shader();
+
+	if (buffer->VAO) {
+		glBindVertexArray(buffer->VAO);
+		if (buffer->VAO_EBO != index_buffer->EBO) {
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer->EBO);
+			buffer->VAO_EBO = index_buffer->EBO;
+		}
+	}
+	else {
+		GFX__Setup_vertex_attributes(buffer);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer->EBO);
+	}
+
+	GLenum index_type  = GL_UNSIGNED_INT;
+	uintptr_t offset   = first_index*4;
+	if (index_buffer->index_type == GFX_BUFFER_INDEX_TYPE_16) {
+		index_type = GL_UNSIGNED_SHORT;
+		offset     = first_index*2;
+	}
+	glDrawElements(GL_TRIANGLES, indices_count, index_type, (void *)offset);
+	GFX__data.stats.draw_calls += 1;
+	GFX__data.stats.indices    += indices_count;
+
+	if (buffer->vertex_layout == GFX_VERTEX_LAYOUT_TERRAIN) glUseProgram(GFX__data.default_shader.id);
+}
+
+
+// Doc above
 GLuint
 GFX_Default_texture(void) {
-	return GFX__data.default_texture;
+	return GFX__data.atlas.texture;
+}
+
+// Doc above
+bool
+GFX_Atlas_add(const u8 *rgba, u32 width, u32 height, GFX_TextureRegion *region_result) {
+	if (width > GFX_ATLAS_SIZE) return false;
+	if (GFX__data.atlas.shelf_x + width > GFX_ATLAS_SIZE) {
+		GFX__data.atlas.shelf_x      = 0;
+		GFX__data.atlas.shelf_y     += GFX__data.atlas.shelf_height;
+		GFX__data.atlas.shelf_height = 0;
+	}
+	if (GFX__data.atlas.shelf_y + height > GFX_ATLAS_SIZE) return false;
+
+	// 1 texel of gap between the images, it can be left out on the borders of the atlas
+	u32 x = GFX__data.atlas.shelf_x;
+	u32 y = GFX__data.atlas.shelf_y;
+	GFX__data.atlas.shelf_x     += width + 1;
+	GFX__data.atlas.shelf_height = Max(GFX__data.atlas.shelf_height, height + 1);
+
+	glBindTexture(GL_TEXTURE_2D, GFX__data.atlas.texture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, (GLint)x, (GLint)y, (GLsizei)width, (GLsizei)height, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	GFX__data.stats.texture_binds  += 1;
+	GFX__data.stats.bytes_uploaded += width*height*4;
+	// The binding of the texture unit changed behind the queue
+	GFX__data.applied.valid = false;
+
+	f32 inv_size = 1.0f / (f32)GFX_ATLAS_SIZE;
+	region_result->texture   = GFX__data.atlas.texture;
+	region_result->uv_offset = V2((f32)x * inv_size, (f32)y * inv_size);
+	region_result->uv_scale  = V2((f32)width * inv_size, (f32)height * inv_size);
+	return true;
+}
+
+// Doc above
+GFX_TextureRegion
+GFX_Texture_region(GLuint texture) {
+	GFX_TextureRegion region;
+	region.texture   = texture;
+	region.uv_offset = V2(0, 0);
+	region.uv_scale  = V2(1, 1);
+	return region;
+}
+
+// Doc above
+u32
+GFX_Mip_chain_size(u32 width, u32 height) {
+	u32 size = 0;
+	for (;;) {
+		size += width*height*4;
+		if (width == 1 && height == 1) break;
+		width  = Max(width/2, 1);
+		height = Max(height/2, 1);
+	}
+	return size;
 }
 
 // Doc above
 void
-GFX_Set_texture(GLuint texture) {
-	if (GFX__data.texture != texture) {
-		GFX_Flush();
-		GFX__data.texture = texture;
-		glBindTexture(GL_TEXTURE_2D, GFX__data.texture);
+GFX_Build_mip_chain(u8 *levels, u32 width, u32 height) {
+	u8 *src = levels;
+	while (width > 1 || height > 1) {
+		u32 next_width  = Max(width/2, 1);
+		u32 next_height = Max(height/2, 1);
+		u8 *dst = src + width*height*4;
+		for (u32 y = 0; y < next_height; y+=1) {
+			// With an odd size the last texel is averaged with itself
+			u32 y0 = Min(y*2, height-1);
+			u32 y1 = Min(y*2+1, height-1);
+			for (u32 x = 0; x < next_width; x+=1) {
+				u32 x0 = Min(x*2, width-1);
+				u32 x1 = Min(x*2+1, width-1);
+				for (u32 c = 0; c < 4; c+=1) {
+					u32 sum = src[(y0*width+x0)*4+c] + src[(y0*width+x1)*4+c] +
+					          src[(y1*width+x0)*4+c] + src[(y1*width+x1)*4+c];
+					dst[(y*next_width+x)*4+c] = (u8)((sum + 2) / 4);
+				}
+			}
+		}
+		src    = dst;
+		width  = next_width;
+		height = next_height;
 	}
 }
 
+// Doc above
+GLuint
+GFX_Make_mipmapped_texture(const u8 *levels, u32 width, u32 height) {
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	for (GLint level = 0;; level+=1) {
+		glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA, (GLsizei)width, (GLsizei)height, 0, GL_RGBA, GL_UNSIGNED_BYTE, levels);
+		GFX__data.stats.bytes_uploaded += width*height*4;
+		if (width == 1 && height == 1) break;
+		levels += width*height*4;
+		width   = Max(width/2, 1);
+		height  = Max(height/2, 1);
+	}
+	GFX__data.stats.texture_binds += 1;
+	// The binding of the texture unit changed behind the queue
+	GFX__data.applied.valid = false;
+	return texture;
+}
+
+// Doc above
+void
+GFX_Set_texture_region(GFX_TextureRegion region) {
+	// The region is applied to the UVs when the vertices are written, only the texture is state
+	// of the queue. The buffer draws apply it on the shader.
+	if (memcmp(&GFX__data.uv_offset, &region.uv_offset, sizeof(Vec2)) != 0 ||
+		memcmp(&GFX__data.uv_scale, &region.uv_scale, sizeof(Vec2)) != 0) {
+		GFX__Terrain_shaders_dirty();
+	}
+	GFX__data.uv_offset = region.uv_offset;
+	GFX__data.uv_scale  = region.uv_scale;
+	if (GFX__data.texture != region.texture) {
+		GFX__data.texture = region.texture;
+		GFX__data.stats.texture_changes += 1;
+		GFX__State_changed();
+	}
+}
+
+// Doc above
+void
+GFX_Set_texture(GLuint texture) {
+	if (texture == GFX__data.atlas.texture) GFX_Set_texture_region(GFX__data.atlas.white);
+	else                                    GFX_Set_texture_region(GFX_Texture_region(texture));
+}
+
 
 // Doc above
 GLuint
@@ -599,9 +2026,12 @@ GFX_Get_texture(void) {
 //Documented above
 void
 GFX_Set_matrix(Mat4 matrix) {
-	GFX_Flush();
-    GFX__data.matrix = matrix;
-    glUniformMatrix4fv(GFX__data.default_shader.vmat, 1, GL_FALSE, (GLfloat *)&GFX__data.matrix);
+	if (memcmp(&GFX__data.matrix, &matrix, sizeof(Mat4)) != 0) {
+    	GFX__data.matrix = matrix;
+		GFX__Terrain_shaders_dirty();
+		GFX__data.stats.matrix_changes += 1;
+		GFX__State_changed();
+	}
 }
 
 
@@ -614,78 +2044,141 @@ GFX_Get_matrix(void) {
 //Documented above
 void
 GFX_Set_light_dir(Vec3 light_dir) {
-	GFX_Flush();
-	glUniform3f(GFX__data.default_shader.light_dir, light_dir.x, light_dir.y, light_dir.z);
-    GFX__data.light_dir = light_dir;
+	if (memcmp(&GFX__data.light_dir, &light_dir, sizeof(Vec3)) != 0) {
+    	GFX__data.light_dir = light_dir;
+		GFX__Terrain_shaders_dirty();
+		GFX__data.stats.light_changes += 1;
+		GFX__State_changed();
+	}
+}
+
+//Documented above
+void
+GFX_Set_terrain_quantization(Vec3 scale, Vec3 offset, Vec2 uv_scale) {
+	GFX__data.terrain_quantization.scale    = scale;
+	GFX__data.terrain_quantization.offset   = offset;
+	GFX__data.terrain_quantization.uv_scale = uv_scale;
+	GFX__Terrain_shaders_dirty();
+}
+
+static void
+GFX__Set_terrain_map(GFX__TerrainMap map, GLuint texture, u32 width, u32 height) {
+	GFX__data.terrain_maps[map].texture = texture;
+	if (texture) {
+		Vec2 scale = V2(1.0f/(f32)width, 1.0f/(f32)height);
+		if (memcmp(&GFX__data.terrain_maps[map].scale, &scale, sizeof(Vec2)) != 0) {
+			GFX__data.terrain_maps[map].scale = scale;
+			GFX__Terrain_shaders_dirty();
+		}
+	}
+}
+
+//Documented above
+void
+GFX_Set_terrain_normal_map(GLuint texture, u32 width, u32 height) {
+	GFX__Set_terrain_map(GFX__TERRAIN_MAP_NORMAL, texture, width, height);
+}
+
+//Documented above
+void
+GFX_Set_terrain_ao_map(GLuint texture, u32 width, u32 height) {
+	GFX__Set_terrain_map(GFX__TERRAIN_MAP_AO, texture, width, height);
 }
 
+//Documented above
+static inline void
+GFX_Oct_encode_normal(Vec3 n, u8 *result) {
+	f32 l1_norm = Abs(n.x) + Abs(n.y) + Abs(n.z);
+	if (l1_norm == 0.0f) l1_norm = 1.0f;
+	f32 x = n.x / l1_norm;
+	f32 y = n.y / l1_norm;
+	if (n.z < 0.0f) {
+		// Fold the lower hemisphere over the diagonals
+		f32 folded_x = (1.0f - Abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		f32 folded_y = (1.0f - Abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = folded_x;
+		y = folded_y;
+	}
+	result[0] = (u8)Clamp((x * 0.5f + 0.5f) * 255.0f + 0.5f, 0.0f, 255.0f);
+	result[1] = (u8)Clamp((y * 0.5f + 0.5f) * 255.0f + 0.5f, 0.0f, 255.0f);
+}
+
+
+
+// Maps a UV relative to the current region to the texture
+static inline Vec2
+GFX__Region_uv(Vec2 uv) {
+	return V2(GFX__data.uv_offset.x + uv.x*GFX__data.uv_scale.x, GFX__data.uv_offset.y + uv.y*GFX__data.uv_scale.y);
+}
 
 
 static inline void
 GFX_Draw_triangle_ex(Vec3 v0, Vec3 v1, Vec3 v2, Color n0, Color n1, Color n2, Vec2 uv0, Vec2 uv1, Vec2 uv2, Color c0, Color c1, Color c2) {
 
-	if (GFX_Get_remaining_vertices(&GFX__data.buffer) < 3 || GFX_Get_remaining_indices(&GFX__data.buffer) < 3) GFX_Flush();
+	if (GFX_Get_remaining_vertices(&GFX__data.buffer) < 3 || GFX_Get_remaining_indices(&GFX__data.buffer) < 3) GFX__Flush(GFX_FLUSH_BATCH_FULL);
 
 	u32 base_index;
 	GFX_Vertex *verts = GFX_Alloc_vertices(&GFX__data.buffer, 3, &base_index);
 
 	verts[0].position  = v0;
 	verts[0].normal    = n0;
-	verts[0].tex_coord = uv0;
+	verts[0].tex_coord = GFX__Region_uv(uv0);
 	verts[0].color     = c0;
 
 	verts[1].position  = v1;
 	verts[1].normal    = n1;
-	verts[1].tex_coord = uv1;
+	verts[1].tex_coord = GFX__Region_uv(uv1);
 	verts[1].color     = c1;
 
 	verts[2].position  = v2;
 	verts[2].normal    = n2;
-	verts[2].tex_coord = uv2;
+	verts[2].tex_coord = GFX__Region_uv(uv2);
 	verts[2].color     = c2;
 
-	u16 *indices = (u16 *)GFX_Alloc_indices(&GFX__data.buffer, 3);
-	indices[0] = (u16)base_index+0;
-	indices[1] = (u16)base_index+1;
-	indices[2] = (u16)base_index+2;
+	GFX_BufferIndexType index_type = GFX__data.buffer.index_type;
+	void *indices = GFX_Alloc_indices(&GFX__data.buffer, 3);
+	GFX__Set_index(indices, index_type, 0, base_index+0);
+	GFX__Set_index(indices, index_type, 1, base_index+1);
+	GFX__Set_index(indices, index_type, 2, base_index+2);
 }
 
 
 static inline void
 GFX_Draw_quad_ex(Vec3 v0, Vec3 v1, Vec3 v2, Vec3 v3, Color n0, Color n1, Color n2, Color n3, Vec2 uv0, Vec2 uv1, Vec2 uv2, Vec2 uv3, Color c0, Color c1, Color c2, Color c3) {
 	
-	if (GFX_Get_remaining_vertices(&GFX__data.buffer) < 4 || GFX_Get_remaining_indices(&GFX__data.buffer) < 6) GFX_Flush();
+	if (GFX_Get_remaining_vertices(&GFX__data.buffer) < 4 || GFX_Get_remaining_indices(&GFX__data.buffer) < 6) GFX__Flush(GFX_FLUSH_BATCH_FULL);
 
 	u32 base_index;
 	GFX_Vertex *verts = GFX_Alloc_vertices(&GFX__data.buffer, 4, &base_index);
 
 	verts[0].position  = v0;
 	verts[0].normal    = n0;
-	verts[0].tex_coord = uv0;
+	verts[0].tex_coord = GFX__Region_uv(uv0);
 	verts[0].color     = c0;
 
 	verts[1].position  = v1;
 	verts[1].normal    = n1;
-	verts[1].tex_coord = uv1;
+	verts[1].tex_coord = GFX__Region_uv(uv1);
 	verts[1].color     = c1;
 
 	verts[2].position  = v2;
 	verts[2].normal    = n2;
-	verts[2].tex_coord = uv2;
+	verts[2].tex_coord = GFX__Region_uv(uv2);
 	verts[2].color     = c2;
 
 	verts[3].position  = v3;
 	verts[3].normal    = n3;
-	verts[3].tex_coord = uv3;
+	verts[3].tex_coord = GFX__Region_uv(uv3);
 	verts[3].color     = c3;
 
-	u16 *indices = (u16 *)GFX_Alloc_indices(&GFX__data.buffer, 6);
-	indices[0] = (u16)base_index+0;
-	indices[1] = (u16)base_index+1;
-	indices[2] = (u16)base_index+2;
-	indices[3] = (u16)base_index+0;
-	indices[4] = (u16)base_index+2;
-	indices[5] = (u16)base_index+3;
+	GFX_BufferIndexType index_type = GFX__data.buffer.index_type;
+	void *indices = GFX_Alloc_indices(&GFX__data.buffer, 6);
+	GFX__Set_index(indices, index_type, 0, base_index+0);
+	GFX__Set_index(indices, index_type, 1, base_index+1);
+	GFX__Set_index(indices, index_type, 2, base_index+2);
+	GFX__Set_index(indices, index_type, 3, base_index+0);
+	GFX__Set_index(indices, index_type, 4, base_index+2);
+	GFX__Set_index(indices, index_type, 5, base_index+3);
 
 }
 
@@ -796,21 +2289,97 @@ GFX_Draw_textured_quad(Vec2 v0, Vec2 v1, Vec2 v2, Vec2 v3, Vec2 uv0, Vec2 uv1, V
 
 
 
-void
-GFX_Draw_circle(Vec2 center, f32 radius, Color color) {
-	static const int SUBDIVISIONS = 30;
-	f32 theta = 2*PI32/(f32)SUBDIVISIONS;
-	f32 cos_theta = Cos(theta);
-	f32 sin_theta = Sin(theta);
+// Doc above
+static inline GFX_Instance
+GFX_Make_instance(Vec3 pos, Vec3 scale, Color color) {
+	GFX_Instance result;
+	result.rows[0] = V4(scale.x, 0, 0, pos.x);
+	result.rows[1] = V4(0, scale.y, 0, pos.y);
+	result.rows[2] = V4(0, 0, scale.z, pos.z);
+	result.color   = color;
+	return result;
+}
+
 
-	Vec2 p0 = V2(radius, 0);
-	for (int i = 0; i <= SUBDIVISIONS; ++i) {
-		Vec2 p1 = V2(p0.x * cos_theta - p0.y * sin_theta, p0.x * sin_theta + p0.y * cos_theta);
-		GFX_Draw_triangle(center, V2_Add(center, p0), V2_Add(center, p1), color);
-		p0 = p1;
+// Copies the indices of a unit mesh into the batch, offset by the first vertex of the copy
+static void
+GFX__Emit_mesh_indices(GFX_Buffer *src, u32 base_index) {
+	u16 *src_indices = (u16 *)src->indices;
+	void *indices = GFX_Alloc_indices(&GFX__data.buffer, src->indices_count);
+	Assert(indices != NULL, "ERROR: The mesh doesn't fit in the batch.");
+	if (indices == NULL) return;
+	if (GFX__data.buffer.index_type == GFX_BUFFER_INDEX_TYPE_16) {
+		u16 *indices16 = (u16 *)indices;
+		for (u32 i = 0; i < src->indices_count; i+=1) indices16[i] = (u16)(base_index + src_indices[i]);
+	}
+	else {
+		u32 *indices32 = (u32 *)indices;
+		for (u32 i = 0; i < src->indices_count; i+=1) indices32[i] = base_index + src_indices[i];
 	}
 }
 
+// Cross product, V3_Cross gives the y negated (see the FIXME of GFX_Draw_triangle_3D)
+static inline Vec3
+GFX__Cross(Vec3 a, Vec3 b) {
+	return V3(a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x);
+}
+
+// Copies a unit mesh transformed by the instance into the batch
+static void
+GFX__Emit_mesh(GFX_Mesh mesh, const GFX_Instance *instance) {
+	GFX_Buffer *src = &GFX__data.meshes.buffers[mesh];
+
+	if (GFX_Get_remaining_vertices(&GFX__data.buffer) < src->vertices_count ||
+		GFX_Get_remaining_indices(&GFX__data.buffer) < src->indices_count) GFX__Flush(GFX_FLUSH_BATCH_FULL);
+
+	Vec4 r0 = instance->rows[0];
+	Vec4 r1 = instance->rows[1];
+	Vec4 r2 = instance->rows[2];
+
+	// The normals are transformed by the inverse transpose of the 3x3 part. It's proportional to
+	// the cofactors, whose columns are the cross products of the columns of the matrix, and the
+	// determinant sign keeps the normals out on the mirrored instances.
+	Vec3 c0 = V3(r0.x, r1.x, r2.x);
+	Vec3 c1 = V3(r0.y, r1.y, r2.y);
+	Vec3 c2 = V3(r0.z, r1.z, r2.z);
+	Vec3 n0 = GFX__Cross(c1, c2);
+	Vec3 n1 = GFX__Cross(c2, c0);
+	Vec3 n2 = GFX__Cross(c0, c1);
+	if (V3_Dot(c0, n0) < 0.0f) {
+		n0 = V3_Mulf(n0, -1.0f);
+		n1 = V3_Mulf(n1, -1.0f);
+		n2 = V3_Mulf(n2, -1.0f);
+	}
+
+	u32 base_index;
+	GFX_Vertex *verts = GFX_Alloc_vertices(&GFX__data.buffer, src->vertices_count, &base_index);
+	Assert(verts != NULL, "ERROR: The mesh doesn't fit in the batch.");
+	if (verts == NULL) return;
+	for (u32 i = 0; i < src->vertices_count; i+=1) {
+		Vec3 p = src->vertices[i].position;
+		Color nc = src->vertices[i].normal;
+		Vec3 n = V3(nc.r/127.5f - 1.0f, nc.g/127.5f - 1.0f, nc.b/127.5f - 1.0f);
+
+		verts[i].position  = V3(
+			r0.x*p.x + r0.y*p.y + r0.z*p.z + r0.w,
+			r1.x*p.x + r1.y*p.y + r1.z*p.z + r1.w,
+			r2.x*p.x + r2.y*p.y + r2.z*p.z + r2.w);
+		Vec3 normal = V3_Add(V3_Add(V3_Mulf(n0, n.x), V3_Mulf(n1, n.y)), V3_Mulf(n2, n.z));
+		verts[i].normal    = V4_To_Color((Vec4){.xyz = normal});
+		verts[i].tex_coord = GFX__Region_uv(src->vertices[i].tex_coord);
+		verts[i].color     = instance->color;
+	}
+
+	GFX__Emit_mesh_indices(src, base_index);
+}
+
+
+void
+GFX_Draw_circle(Vec2 center, f32 radius, Color color) {
+	GFX_Instance instance = GFX_Make_instance(V3(center.x, center.y, 0), V3(radius, radius, 1), color);
+	GFX__Emit_mesh(GFX_MESH_CIRCLE, &instance);
+}
+
 
 void
 GFX_Draw_triangle_3D(Vec3 v0, Vec3 v1, Vec3 v2, Color color) {
@@ -829,287 +2398,348 @@ GFX_Draw_quad_3D(Vec3 v0, Vec3 v1, Vec3 v2, Vec3 v3, Color color) {
 
 void
 GFX_Draw_cube(Vec3 pos, float width, float height, float length, Color color) {
-
-		Vec3 corner_front_bottom_left  = V3_Add(V3(-0.5f * width, -0.5f * height,  0.5f * length), pos);
-		Vec3 corner_front_bottom_right = V3_Add(V3( 0.5f * width, -0.5f * height,  0.5f * length), pos);
-		Vec3 corner_front_up_right     = V3_Add(V3( 0.5f * width,  0.5f * height,  0.5f * length), pos);
-		Vec3 corner_front_up_left      = V3_Add(V3(-0.5f * width,  0.5f * height,  0.5f * length), pos);
-		Vec3 corner_back_bottom_left   = V3_Add(V3(-0.5f * width, -0.5f * height, -0.5f * length), pos);
-		Vec3 corner_back_bottom_right  = V3_Add(V3( 0.5f * width, -0.5f * height, -0.5f * length), pos);
-		Vec3 corner_back_up_right      = V3_Add(V3( 0.5f * width,  0.5f * height, -0.5f * length), pos);
-		Vec3 corner_back_up_left       = V3_Add(V3(-0.5f * width,  0.5f * height, -0.5f * length), pos);
-
-		Color normal_front = V4_To_Color(V4( 0,  0,  1,  0));
-		Color normal_back  = V4_To_Color(V4( 0,  0, -1,  0));
-		Color normal_up    = V4_To_Color(V4( 0,  1,  0,  0));
-		Color normal_down  = V4_To_Color(V4( 0, -1,  0,  0));
-		Color normal_left  = V4_To_Color(V4(-1,  0,  0,  0));
-		Color normal_right = V4_To_Color(V4( 1,  0,  0,  0));
-
-		GFX_Draw_quad_ex(
-				corner_front_bottom_left,
-				corner_front_bottom_right,
-				corner_front_up_right,
-				corner_front_up_left,
-				normal_front, normal_front, normal_front, normal_front,
-				V2(1, 1), V2(0, 1), V2(0, 0), V2(1, 0),
-				color, color, color, color);
-
-		GFX_Draw_quad_ex(
-				corner_front_bottom_right,
-				corner_back_bottom_right,
-				corner_back_up_right,
-				corner_front_up_right,
-				normal_right, normal_right, normal_right, normal_right,
-				V2(1, 1), V2(0, 1), V2(0, 0), V2(1, 0),
-				color, color, color, color);
-		
-		GFX_Draw_quad_ex(
-				corner_back_bottom_right,
-				corner_back_bottom_left,
-				corner_back_up_left,
-				corner_back_up_right,
-				normal_back, normal_back, normal_back, normal_back,
-				V2(1, 1), V2(0, 1), V2(0, 0), V2(1, 0),
-				color, color, color, color);
-
-		GFX_Draw_quad_ex(
-				corner_back_bottom_left,
-				corner_front_bottom_left,
-				corner_front_up_left,
-				corner_back_up_left,
-				normal_left, normal_left, normal_left, normal_left,
-				V2(1, 1), V2(0, 1), V2(0, 0), V2(1, 0),
-				color, color, color, color);
-
-		GFX_Draw_quad_ex(
-				corner_front_up_left,
-				corner_front_up_right,
-				corner_back_up_right,
-				corner_back_up_left,
-				normal_up, normal_up, normal_up, normal_up,
-				V2(1, 1), V2(0, 1), V2(0, 0), V2(1, 0),
-				color, color, color, color);
-
-		GFX_Draw_quad_ex(
-				corner_front_bottom_right,
-				corner_front_bottom_left,
-				corner_back_bottom_left,
-				corner_back_bottom_right,
-				normal_down, normal_down, normal_down, normal_down,
-				V2(1, 1), V2(0, 1), V2(0, 0), V2(1, 0),
-				color, color, color, color);
+	GFX_Instance instance = GFX_Make_instance(pos, V3(width, height, length), color);
+	GFX__Emit_mesh(GFX_MESH_CUBE, &instance);
 }
 
 
 void
 GFX_Draw_cylinder(Vec3 pos, float up_radius, float down_radius, float length, Color color) {
-	int SUBDIVISIONS = 40;
-	f32 theta = 2*PI32/(f32)SUBDIVISIONS;
-	f32 cos_theta = Cos(theta);
-	f32 sin_theta = Sin(theta);
-	
-	Vec3 up_center   = V3_Add(pos, V3(0,  0.5f * length, 0));
-	Vec3 down_center = V3_Add(pos, V3(0, -0.5f * length, 0));
-	
+	GFX_Buffer *src = &GFX__data.meshes.buffers[GFX_MESH_CYLINDER];
+
+	if (GFX_Get_remaining_vertices(&GFX__data.buffer) < src->vertices_count ||
+		GFX_Get_remaining_indices(&GFX__data.buffer) < src->indices_count) GFX__Flush(GFX_FLUSH_BATCH_FULL);
+
+	// The radius of each end can be different, so the side normals get the slope
 	f32 slope = (down_radius - up_radius) / length;
 
-	Color normal_up   = V4_To_Color(V4(0,  1, 0, 0));
-	Color normal_down = V4_To_Color(V4(0, -1, 0, 0));
-
-	Vec3 p0 = V3(1, 0, 0);
-	Color n0 = V4_To_Color(V4(p0.x, slope, p0.z, 0));
-	Vec3 up0   = V3_Add(up_center, V3_Mulf(p0, up_radius));
-	Vec3 down0 = V3_Add(down_center, V3_Mulf(p0, down_radius));
-	for (int i = 1; i <= SUBDIVISIONS; ++i) {
-		Vec3 p1 = V3(0, 0, 0);
-		p1.x = p0.x * cos_theta - p0.z * sin_theta;
-		p1.z = p0.x * sin_theta + p0.z * cos_theta;
-
-		Color n1   = V4_To_Color(V4(p1.x, slope, p1.z, 0));
-		Vec3 up1   = V3_Add(up_center, V3_Mulf(p1, up_radius));
-		Vec3 down1 = V3_Add(down_center, V3_Mulf(p1, down_radius));
-		
-		Vec2 cap_uv0 = V2(0.5f, 0.5f);
-		Vec2 cap_uv1; {
-			float m = 0.5f/Max(Abs(p0.x), Abs(p0.z));
-			cap_uv1 = V2(p0.x*m+0.5f, p0.z*m+0.5f);
+	u32 base_index;
+	GFX_Vertex *verts = GFX_Alloc_vertices(&GFX__data.buffer, src->vertices_count, &base_index);
+	Assert(verts != NULL, "ERROR: The mesh doesn't fit in the batch.");
+	if (verts == NULL) return;
+	for (u32 i = 0; i < src->vertices_count; i+=1) {
+		Vec3 p = src->vertices[i].position;
+		f32 radius = (p.y > 0.0f) ? up_radius : down_radius;
+
+		verts[i].position  = V3_Add(pos, V3(p.x*radius, p.y*length, p.z*radius));
+		verts[i].normal    = src->vertices[i].normal;
+		if (i >= GFX__CYLINDER_SIDE_FIRST) verts[i].normal = V4_To_Color(V4(p.x, slope, p.z, 0));
+		verts[i].tex_coord = GFX__Region_uv(src->vertices[i].tex_coord);
+		verts[i].color     = color;
+	}
+
+	GFX__Emit_mesh_indices(src, base_index);
+}
+
+void
+GFX_Draw_sphere(Vec3 pos, float radius, Color color) {
+	GFX_Instance instance = GFX_Make_instance(pos, V3(radius, radius, radius), color);
+	GFX__Emit_mesh(GFX_MESH_SPHERE, &instance);
+}
+
+void
+GFX_Draw_torus(Vec3 pos, float radius0, float radius1, Color color) {
+	GFX_Buffer *src = &GFX__data.meshes.buffers[GFX_MESH_TORUS];
+
+	if (GFX_Get_remaining_vertices(&GFX__data.buffer) < src->vertices_count ||
+		GFX_Get_remaining_indices(&GFX__data.buffer) < src->indices_count) GFX__Flush(GFX_FLUSH_BATCH_FULL);
+
+	// Every vertex of the unit torus is the point of the ring plus the normal scaled by the tube
+	// radius, so the ring is scaled by radius1 and the tube by radius0.
+	f32 inv_tube_radius = 1.0f / GFX_UNIT_TORUS_TUBE_RADIUS;
+
+	u32 base_index;
+	GFX_Vertex *verts = GFX_Alloc_vertices(&GFX__data.buffer, src->vertices_count, &base_index);
+	Assert(verts != NULL, "ERROR: The mesh doesn't fit in the batch.");
+	if (verts == NULL) return;
+	for (u32 i = 0; i < src->vertices_count; i+=1) {
+		Vec3 p = src->vertices[i].position;
+		Vec3 ring = V3_Normalize(V3(p.x, p.y, 0));
+		Vec3 tube = V3_Mulf(V3_Sub(p, ring), inv_tube_radius);
+
+		verts[i].position  = V3_Add(pos, V3_Add(V3_Mulf(ring, radius1), V3_Mulf(tube, radius0)));
+		verts[i].normal    = src->vertices[i].normal;
+		verts[i].tex_coord = GFX__Region_uv(src->vertices[i].tex_coord);
+		verts[i].color     = color;
+	}
+
+	GFX__Emit_mesh_indices(src, base_index);
+}
+
+
+static inline void
+GFX__Set_mesh_vertex(GFX_Vertex *vertex, Vec3 position, Vec3 normal, Vec2 uv) {
+	vertex->position  = position;
+	vertex->normal    = V4_To_Color((Vec4){.xyz = normal});
+	vertex->tex_coord = uv;
+	vertex->color     = WHITE;
+}
+
+static inline void
+GFX__Set_mesh_triangle(u16 *indices, u32 a, u32 b, u32 c) {
+	indices[0] = (u16)a;
+	indices[1] = (u16)b;
+	indices[2] = (u16)c;
+}
+
+// The meshes keep the vertex order, UVs and winding of the immediate functions that used to make
+// them on every call
+static void
+GFX__Build_unit_meshes(void) {
+	static const u32 mesh_sizes[GFX_MESH_COUNT][2] = { // Vertices and indices
+		[GFX_MESH_CUBE]     = {6*4, 6*6},
+		[GFX_MESH_SPHERE]   = {(GFX__SPHERE_STACKS+1)*(GFX__SPHERE_SLICES+1), GFX__SPHERE_STACKS*GFX__SPHERE_SLICES*6},
+		[GFX_MESH_CYLINDER] = {4*(GFX__CYLINDER_SLICES+1)+2, GFX__CYLINDER_SLICES*12},
+		[GFX_MESH_TORUS]    = {(GFX__TORUS_TUBE_SLICES+1)*(GFX__TORUS_RING_SLICES+1), GFX__TORUS_TUBE_SLICES*GFX__TORUS_RING_SLICES*6},
+		[GFX_MESH_CIRCLE]   = {GFX__CIRCLE_SLICES+2, GFX__CIRCLE_SLICES*3},
+	};
+
+	u32 vertices_offset = 0;
+	u32 indices_offset  = 0;
+	for (int i = 0; i < GFX_MESH_COUNT; i+=1) {
+		Assert(vertices_offset + mesh_sizes[i][0] <= GFX__MESHES_MAX_VERTICES, "ERROR: The unit meshes don't fit.");
+		Assert(indices_offset + mesh_sizes[i][1] <= GFX__MESHES_MAX_INDICES, "ERROR: The unit meshes don't fit.");
+		GFX_Create_buffer(
+			&GFX__data.meshes.buffers[i],
+			&GFX__data.meshes.vertices_mem[vertices_offset],
+			mesh_sizes[i][0] * GFX_VERTEX_SIZE,
+			&GFX__data.meshes.indices_mem[indices_offset],
+			mesh_sizes[i][1] * sizeof(u16),
+			GFX_BUFFER_INDEX_TYPE_16);
+		vertices_offset += mesh_sizes[i][0];
+		indices_offset  += mesh_sizes[i][1];
+	}
+
+	u32 base_index;
+	GFX_Vertex *v;
+	u16 *indices;
+
+	{ // CUBE
+		GFX_Buffer *b = &GFX__data.meshes.buffers[GFX_MESH_CUBE];
+		static const f32 corners[8][3] = {
+			{-0.5f, -0.5f,  0.5f}, { 0.5f, -0.5f,  0.5f}, { 0.5f,  0.5f,  0.5f}, {-0.5f,  0.5f,  0.5f}, // Front
+			{-0.5f, -0.5f, -0.5f}, { 0.5f, -0.5f, -0.5f}, { 0.5f,  0.5f, -0.5f}, {-0.5f,  0.5f, -0.5f}, // Back
+		};
+		static const u8 faces[6][4] = {
+			{0, 1, 2, 3}, // Front
+			{1, 5, 6, 2}, // Right
+			{5, 4, 7, 6}, // Back
+			{4, 0, 3, 7}, // Left
+			{3, 2, 6, 7}, // Up
+			{1, 0, 4, 5}, // Down
+		};
+		static const f32 normals[6][3] = {
+			{0, 0, 1}, {1, 0, 0}, {0, 0, -1}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0},
+		};
+		static const f32 uvs[4][2] = {{1, 1}, {0, 1}, {0, 0}, {1, 0}};
+
+		for (int f = 0; f < 6; f+=1) {
+			v = GFX_Alloc_vertices(b, 4, &base_index);
+			Assert(v != NULL, "ERROR: The unit meshes don't fit.");
+			if (v == NULL) return;
+			indices = (u16 *)GFX_Alloc_indices(b, 6);
+			Assert(indices != NULL, "ERROR: The unit meshes don't fit.");
+			if (indices == NULL) return;
+			Vec3 normal = V3(normals[f][0], normals[f][1], normals[f][2]);
+			for (int c = 0; c < 4; c+=1) {
+				const f32 *corner = corners[faces[f][c]];
+				GFX__Set_mesh_vertex(&v[c], V3(corner[0], corner[1], corner[2]), normal, V2(uvs[c][0], uvs[c][1]));
+			}
+			GFX__Set_mesh_triangle(&indices[0], base_index+0, base_index+1, base_index+2);
+			GFX__Set_mesh_triangle(&indices[3], base_index+0, base_index+2, base_index+3);
 		}
-		Vec2 cap_uv2; {
-			float m = 0.5f/Max(Abs(p1.x), Abs(p1.z));
-			cap_uv2 = V2(p1.x*m+0.5f, p1.z*m+0.5f);
+	}
+
+	{ // SPHERE, the rows go from the top to the bottom
+		GFX_Buffer *b = &GFX__data.meshes.buffers[GFX_MESH_SPHERE];
+		u32 row = GFX__SPHERE_SLICES+1;
+		v = GFX_Alloc_vertices(b, (GFX__SPHERE_STACKS+1)*row, &base_index);
+		for (int i0 = 0; i0 <= GFX__SPHERE_STACKS; i0+=1) {
+			f32 a0 = PI32*(f32)i0/(f32)GFX__SPHERE_STACKS;
+			for (int i1 = 0; i1 <= GFX__SPHERE_SLICES; i1+=1) {
+				f32 a1 = 2*PI32*(f32)i1/(f32)GFX__SPHERE_SLICES;
+				Vec3 p = V3(-Sin(a0)*Cos(a1), Cos(a0), -Sin(a0)*Sin(a1));
+				Vec2 uv = V2((f32)i1/(f32)GFX__SPHERE_SLICES, (f32)i0/(f32)GFX__SPHERE_STACKS);
+				GFX__Set_mesh_vertex(v++, p, p, uv);
+			}
+		}
+		indices = (u16 *)GFX_Alloc_indices(b, GFX__SPHERE_STACKS*GFX__SPHERE_SLICES*6);
+		for (u32 i0 = 1; i0 <= GFX__SPHERE_STACKS; i0+=1) {
+			for (u32 i1 = 1; i1 <= GFX__SPHERE_SLICES; i1+=1) {
+				u32 up0   = base_index + (i0-1)*row + (i1-1);
+				u32 up1   = up0 + 1;
+				u32 down0 = base_index + i0*row + (i1-1);
+				u32 down1 = down0 + 1;
+				GFX__Set_mesh_triangle(indices, up0, up1, down1); indices += 3;
+				GFX__Set_mesh_triangle(indices, up0, down1, down0); indices += 3;
+			}
 		}
-		
-		GFX_Draw_triangle_ex(
-				up_center, up1, up0,
-				normal_up, normal_up, normal_up,
-				cap_uv0, cap_uv2, cap_uv1,
-				color, color, color);
+	}
 
-		Vec2 uv0 = V2((float)(i)/(f32)SUBDIVISIONS, 1);
-		Vec2 uv1 = V2((float)(i-1)/(f32)SUBDIVISIONS, 1);
-		Vec2 uv2 = V2((float)(i-1)/(f32)SUBDIVISIONS, 0);
-		Vec2 uv3 = V2((float)(i)/(f32)SUBDIVISIONS, 0);
-		GFX_Draw_quad_ex(down1, down0, up0, up1, n1, n0, n0, n1, uv0, uv1, uv2, uv3, color, color, color, color);
-		//GFX_Draw_quad_3D(down1, down0, up0, up1, color);
+	{ // CYLINDER: top cap, bottom cap and the side (from GFX__CYLINDER_SIDE_FIRST)
+		GFX_Buffer *b = &GFX__data.meshes.buffers[GFX_MESH_CYLINDER];
+		u32 ring = GFX__CYLINDER_SLICES+1;
+		v = GFX_Alloc_vertices(b, 4*ring+2, &base_index);
+		u32 top_center    = base_index;
+		u32 top_first     = top_center + 1;
+		u32 bottom_center = top_first + ring;
+		u32 bottom_first  = bottom_center + 1;
+		u32 side_up       = bottom_first + ring;
+		u32 side_down     = side_up + ring;
+		Assert(side_up - base_index == GFX__CYLINDER_SIDE_FIRST, "ERROR: Wrong cylinder layout.");
+
+		GFX__Set_mesh_vertex(&v[top_center-base_index], V3(0, 0.5f, 0), V3(0, 1, 0), V2(0.5f, 0.5f));
+		GFX__Set_mesh_vertex(&v[bottom_center-base_index], V3(0, -0.5f, 0), V3(0, -1, 0), V2(0.5f, 0.5f));
+		for (u32 i = 0; i < ring; i+=1) {
+			f32 a = 2*PI32*(f32)i/(f32)GFX__CYLINDER_SLICES;
+			Vec3 p = V3(Cos(a), 0, Sin(a));
+			f32 m = 0.5f/Max(Abs(p.x), Abs(p.z));
+			Vec2 cap_uv = V2(p.x*m+0.5f, p.z*m+0.5f);
+			f32 u = (f32)i/(f32)GFX__CYLINDER_SLICES;
+			GFX__Set_mesh_vertex(&v[top_first+i-base_index],    V3(p.x,  0.5f, p.z), V3(0,  1, 0), cap_uv);
+			GFX__Set_mesh_vertex(&v[bottom_first+i-base_index], V3(p.x, -0.5f, p.z), V3(0, -1, 0), cap_uv);
+			GFX__Set_mesh_vertex(&v[side_up+i-base_index],      V3(p.x,  0.5f, p.z), p, V2(u, 0));
+			GFX__Set_mesh_vertex(&v[side_down+i-base_index],    V3(p.x, -0.5f, p.z), p, V2(u, 1));
+		}
 
-		GFX_Draw_triangle_ex(
-				down_center, down0, down1,
-				normal_down, normal_down, normal_down,
-				cap_uv0, cap_uv1, cap_uv2,
-				color, color, color);
+		indices = (u16 *)GFX_Alloc_indices(b, GFX__CYLINDER_SLICES*12);
+		for (u32 i = 1; i <= GFX__CYLINDER_SLICES; i+=1) {
+			GFX__Set_mesh_triangle(indices, top_center, top_first+i, top_first+i-1); indices += 3;
+			GFX__Set_mesh_triangle(indices, side_down+i, side_down+i-1, side_up+i-1); indices += 3;
+			GFX__Set_mesh_triangle(indices, side_down+i, side_up+i-1, side_up+i); indices += 3;
+			GFX__Set_mesh_triangle(indices, bottom_center, bottom_first+i-1, bottom_first+i); indices += 3;
+		}
+	}
 
-		p0 = p1;
-		n0 = n1;
-		up0 = up1;
-		down0 = down1;
+	{ // TORUS, a0 goes around the tube and a1 around the ring
+		GFX_Buffer *b = &GFX__data.meshes.buffers[GFX_MESH_TORUS];
+		u32 row = GFX__TORUS_RING_SLICES+1;
+		v = GFX_Alloc_vertices(b, (GFX__TORUS_TUBE_SLICES+1)*row, &base_index);
+		for (int i0 = 0; i0 <= GFX__TORUS_TUBE_SLICES; i0+=1) {
+			f32 a0 = 2*PI32*(f32)i0/(f32)GFX__TORUS_TUBE_SLICES;
+			for (int i1 = 0; i1 <= GFX__TORUS_RING_SLICES; i1+=1) {
+				f32 a1 = -2*PI32*(f32)i1/(f32)GFX__TORUS_RING_SLICES;
+				Vec3 n = V3(Sin(a0)*Cos(a1), Sin(a0)*Sin(a1), Cos(a0));
+				Vec3 p = V3_Add(V3(Cos(a1), Sin(a1), 0), V3_Mulf(n, GFX_UNIT_TORUS_TUBE_RADIUS));
+				Vec2 uv = V2((f32)i0/(f32)GFX__TORUS_TUBE_SLICES, (f32)i1/(f32)GFX__TORUS_RING_SLICES);
+				GFX__Set_mesh_vertex(v++, p, n, uv);
+			}
+		}
+		indices = (u16 *)GFX_Alloc_indices(b, GFX__TORUS_TUBE_SLICES*GFX__TORUS_RING_SLICES*6);
+		for (u32 i0 = 1; i0 <= GFX__TORUS_TUBE_SLICES; i0+=1) {
+			for (u32 i1 = 1; i1 <= GFX__TORUS_RING_SLICES; i1+=1) {
+				u32 down0 = base_index + (i0-1)*row + (i1-1);
+				u32 up0   = down0 + 1;
+				u32 down1 = base_index + i0*row + (i1-1);
+				u32 up1   = down1 + 1;
+				GFX__Set_mesh_triangle(indices, down0, up0, up1); indices += 3;
+				GFX__Set_mesh_triangle(indices, down0, up1, down1); indices += 3;
+			}
+		}
 	}
-}
 
-void
-GFX_Draw_sphere(Vec3 pos, float radius, Color color) {
-	int SUBDIVISIONS0 = 20;
-	int SUBDIVISIONS1 = 40;
-	f32 theta0 = PI32/(f32)SUBDIVISIONS0;
-	f32 theta1 = 2*PI32/(f32)SUBDIVISIONS1;
-	f32 cos_theta0 = Cos(theta0);
-	f32 sin_theta0 = Sin(theta0);
-	f32 cos_theta1 = Cos(theta1);
-	f32 sin_theta1 = Sin(theta1);
-	
-	Vec3 half_circle_p0 = V3(0, radius, 0);
-	for (int i0 = 1; i0 <= SUBDIVISIONS0; i0+=1) {
-		Vec3 half_circle_p1 = V3(0, 0, 0);
-		// Rotate around the z axis
-		half_circle_p1.x = half_circle_p0.x * cos_theta0 - half_circle_p0.y * sin_theta0;
-		half_circle_p1.y = half_circle_p0.x * sin_theta0 + half_circle_p0.y * cos_theta0;
-
-		Vec3 p_up_0   = half_circle_p0;
-		Vec3 p_down_0 = half_circle_p1;
-		Color n_up_0   = V4_To_Color((Vec4){.xyz=p_up_0});
-		Color n_down_0 = V4_To_Color((Vec4){.xyz=p_down_0});
-
-		for (int i1 = 1; i1 <= SUBDIVISIONS1; i1+=1) {
-			Vec3 p_down_1 = V3(0, p_down_0.y, 0);
-			p_down_1.x = p_down_0.x * cos_theta1 - p_down_0.z * sin_theta1;
-			p_down_1.z = p_down_0.x * sin_theta1 + p_down_0.z * cos_theta1;
-			Color n_down_1 = V4_To_Color((Vec4){.xyz=p_down_1});
-
-			Vec3 p_up_1   = V3(0, p_up_0.y, 0);
-			p_up_1.x = p_up_0.x * cos_theta1 - p_up_0.z * sin_theta1;
-			p_up_1.z = p_up_0.x * sin_theta1 + p_up_0.z * cos_theta1;
-			Color n_up_1 = V4_To_Color((Vec4){.xyz=p_up_1});
-
-			Vec2 uv0 = V2((float)(i1-1)/SUBDIVISIONS1, (float)(i0-1)/(float)SUBDIVISIONS0);
-			Vec2 uv1 = V2((float)(i1)/SUBDIVISIONS1, (float)(i0-1)/(float)SUBDIVISIONS0);
-			Vec2 uv2 = V2((float)(i1)/SUBDIVISIONS1, (float)(i0)/(float)SUBDIVISIONS0);
-			Vec2 uv3 = V2((float)(i1-1)/SUBDIVISIONS1, (float)(i0)/(float)SUBDIVISIONS0);
-
-			GFX_Draw_quad_ex(
-				V3_Add(pos, p_up_0),
-				V3_Add(pos, p_up_1),
-				V3_Add(pos, p_down_1),
-				V3_Add(pos, p_down_0),
-				n_up_0, n_up_1, n_down_1, n_down_0,
-				uv0, uv1, uv2, uv3, color, color, color, color);
-			//GFX_Draw_quad_3D(
-			//	V3_Add(p_down_0, pos),
-			//	V3_Add(p_down_1, pos),
-			//	V3_Add(p_up_1, pos),
-			//	V3_Add(p_up_0, pos),
-			//	color
-			//);
-			p_down_0 = p_down_1;
-			p_up_0 = p_up_1;
-			n_up_0 = n_up_1;
-			n_down_0 = n_down_1;
+	{ // CIRCLE
+		GFX_Buffer *b = &GFX__data.meshes.buffers[GFX_MESH_CIRCLE];
+		v = GFX_Alloc_vertices(b, GFX__CIRCLE_SLICES+2, &base_index);
+		GFX__Set_mesh_vertex(v++, V3(0, 0, 0), V3(0, 0, 1), V2(0.5f, 0.5f));
+		for (int i = 0; i <= GFX__CIRCLE_SLICES; i+=1) {
+			f32 a = 2*PI32*(f32)i/(f32)GFX__CIRCLE_SLICES;
+			Vec3 p = V3(Cos(a), Sin(a), 0);
+			GFX__Set_mesh_vertex(v++, p, V3(0, 0, 1), V2(p.x*0.5f+0.5f, p.y*0.5f+0.5f));
+		}
+		indices = (u16 *)GFX_Alloc_indices(b, GFX__CIRCLE_SLICES*3);
+		for (u32 i = 0; i < GFX__CIRCLE_SLICES; i+=1) {
+			GFX__Set_mesh_triangle(indices, base_index, base_index+1+i, base_index+2+i); indices += 3;
 		}
+	}
+
+	for (int i = 0; i < GFX_MESH_COUNT; i+=1) {
+		GFX_Upload_buffer_to_gpu(&GFX__data.meshes.buffers[i]);
+	}
+}
+
 
-		half_circle_p0 = half_circle_p1;
+// Attributes of the instance shader, the vertices of the mesh plus the per instance data of
+// GFX__data.meshes.instances_VBO
+static void
+GFX__Setup_instance_attributes(GFX_Buffer *mesh) {
+	unsigned int stride = 3*4 + 4 + 2*4 + 4; // Same as GFX_Vertex
+	glBindBuffer(GL_ARRAY_BUFFER, mesh->VBO);
+	glEnableVertexAttribArray(GFX__data.instance_shader.position);
+	glVertexAttribPointer(GFX__data.instance_shader.position, 3, GL_FLOAT, false, stride, (void*)(0*sizeof(float)));
+	glEnableVertexAttribArray(GFX__data.instance_shader.normal);
+	glVertexAttribPointer(GFX__data.instance_shader.normal, 3, GL_UNSIGNED_BYTE, true, stride, (void*)(3*sizeof(float)));
+	glEnableVertexAttribArray(GFX__data.instance_shader.tex_coord);
+	glVertexAttribPointer(GFX__data.instance_shader.tex_coord, 2, GL_FLOAT, false, stride, (void*)(4*sizeof(float)));
+	glEnableVertexAttribArray(GFX__data.instance_shader.color);
+	glVertexAttribPointer(GFX__data.instance_shader.color, 4, GL_UNSIGNED_BYTE, true, stride, (void*)(6*sizeof(float)));
+
+	glBindBuffer(GL_ARRAY_BUFFER, GFX__data.meshes.instances_VBO);
+	for (int i = 0; i < 3; i+=1) {
+		glEnableVertexAttribArray(GFX__data.instance_shader.rows[i]);
+		glVertexAttribPointer(GFX__data.instance_shader.rows[i], 4, GL_FLOAT, false, sizeof(GFX_Instance), (void*)(i*sizeof(Vec4)));
+		glVertexAttribDivisor(GFX__data.instance_shader.rows[i], 1);
 	}
+	glEnableVertexAttribArray(GFX__data.instance_shader.instance_color);
+	glVertexAttribPointer(GFX__data.instance_shader.instance_color, 4, GL_UNSIGNED_BYTE, true, sizeof(GFX_Instance), (void*)(3*sizeof(Vec4)));
+	glVertexAttribDivisor(GFX__data.instance_shader.instance_color, 1);
+
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->EBO);
 }
 
+
+// Doc above
 void
-GFX_Draw_torus(Vec3 pos, float radius0, float radius1, Color color) {
+GFX_Draw_instances(GFX_Mesh mesh, const GFX_Instance *instances, u32 count) {
+	if (count == 0) return;
 
-	int SUBDIVISIONS0 = 20;
-	float theta0 = -2*PI32/(float)SUBDIVISIONS0;
-	float cos_theta0 = Cos(theta0);
-	float sin_theta0 = Sin(theta0);
+	if (!GFX__data.use_instancing) {
+		for (u32 i = 0; i < count; i+=1) GFX__Emit_mesh(mesh, &instances[i]);
+		return;
+	}
 
-	int SUBDIVISIONS1 = 40;
-	float theta1 = -2*PI32/(float)SUBDIVISIONS1;
-	float cos_theta1 = Cos(theta1);
-	float sin_theta1 = Sin(theta1);
-	
-	Vec3 circle_p0 = V3(0, 0, radius0);
-	for (int i0 = 1; i0 <= SUBDIVISIONS0; i0+=1) {
-		Vec3 circle_p1 = V3(0, 0, 0);
-		// Rotate across the z axis
-		circle_p1.x = circle_p0.x * cos_theta0 - circle_p0.z * sin_theta0;
-		circle_p1.z = circle_p0.x * sin_theta0 + circle_p0.z * cos_theta0;
-
-		Vec3 p_down_0 = V3_Add(V3(radius1, 0, 0), circle_p0);
-		Vec3 p_down_1 = V3_Add(V3(radius1, 0, 0), circle_p1);
-		Vec3 n_down_0 = circle_p0;
-		Vec3 n_down_1 = circle_p1;
-		Color nc_down_0 = V4_To_Color((Vec4){.xyz=n_down_0});
-		Color nc_down_1 = V4_To_Color((Vec4){.xyz=n_down_1});
-
-		circle_p0 = circle_p1;
-		
-		for (int i1 = 1; i1 <= SUBDIVISIONS1; i1+=1) {
-			Vec3 p_up_0;
-			p_up_0.x = p_down_0.x * cos_theta1 - p_down_0.y * sin_theta1;
-			p_up_0.y = p_down_0.x * sin_theta1 + p_down_0.y * cos_theta1;
-			p_up_0.z = p_down_0.z;
-
-			Vec3 p_up_1;
-			p_up_1.x = p_down_1.x * cos_theta1 - p_down_1.y * sin_theta1;
-			p_up_1.y = p_down_1.x * sin_theta1 + p_down_1.y * cos_theta1;
-			p_up_1.z = p_down_1.z;
-
-			Vec3 n_up_0;
-			n_up_0.x = n_down_0.x * cos_theta1 - n_down_0.y * sin_theta1;
-			n_up_0.y = n_down_0.x * sin_theta1 + n_down_0.y * cos_theta1;
-			n_up_0.z = n_down_0.z;
-			Color nc_up_0 = V4_To_Color((Vec4){.xyz=n_up_0});
-
-			Vec3 n_up_1;
-			n_up_1.x = n_down_1.x * cos_theta1 - n_down_1.y * sin_theta1;
-			n_up_1.y = n_down_1.x * sin_theta1 + n_down_1.y * cos_theta1;
-			n_up_1.z = n_down_1.z;
-			Color nc_up_1 = V4_To_Color((Vec4){.xyz=n_up_1});
-
-			Vec2 uv0 = V2((float)(i0-1)/SUBDIVISIONS0, (float)(i1-1)/(float)SUBDIVISIONS1);
-			Vec2 uv1 = V2((float)(i0-1)/SUBDIVISIONS0, (float)(i1)/(float)SUBDIVISIONS1);
-			Vec2 uv2 = V2((float)(i0)/SUBDIVISIONS0, (float)(i1)/(float)SUBDIVISIONS1);
-			Vec2 uv3 = V2((float)(i0)/SUBDIVISIONS0, (float)(i1-1)/(float)SUBDIVISIONS1);
-
-			GFX_Draw_quad_ex(
-				V3_Add(p_down_0, pos),
-				V3_Add(p_up_0, pos),
-				V3_Add(p_up_1, pos),
-				V3_Add(p_down_1, pos),
-				nc_down_0, nc_up_0, nc_up_1, nc_down_1,
-				uv0, uv1, uv2, uv3,
-				color, color, color, color);
-			//GFX_Draw_quad_3D(
-			//	V3_Add(p_down_0, pos),
-			//	V3_Add(p_up_0, pos),
-			//	V3_Add(p_up_1, pos),
-			//	V3_Add(p_down_1, pos),
-			//	color
-			//);
-			p_down_0 = p_up_0;
-			p_down_1 = p_up_1;
-			n_down_0 = n_up_0;
-			n_down_1 = n_up_1;
-			nc_down_0 = nc_up_0;
-			nc_down_1 = nc_up_1;
-		}
+	// Keeps the order with the queued draws
+	GFX__Flush(GFX_FLUSH_DRAW_BUFFER);
+
+	u32 instances_size = count * sizeof(GFX_Instance);
+	glBindBuffer(GL_ARRAY_BUFFER, GFX__data.meshes.instances_VBO);
+	glBufferData(GL_ARRAY_BUFFER, instances_size, instances, GL_STREAM_DRAW);
+	GFX__data.stats.bytes_uploaded += instances_size;
+	GFX__data.stats.bytes_streamed += instances_size;
 
+	Vec3 light_dir = GFX__data.light_dir;
+	glUseProgram(GFX__data.instance_shader.id);
+	glUniformMatrix4fv(GFX__data.instance_shader.vmat, 1, GL_FALSE, (GLfloat *)&GFX__data.matrix);
+	glUniform3f(GFX__data.instance_shader.light_dir, light_dir.x, light_dir.y, light_dir.z);
+	glUniform4f(GFX__data.instance_shader.uv_region, GFX__data.uv_offset.x, GFX__data.uv_offset.y, GFX__data.uv_scale.x, GFX__data.uv_scale.y);
+	glBindTexture(GL_TEXTURE_2D, GFX__data.texture);
+	GFX__data.applied.texture = GFX__data.texture;
+	GFX__data.stats.texture_binds += 1;
+
+	GFX_Buffer *buffer = &GFX__data.meshes.buffers[mesh];
+	if (GFX__data.meshes.instanced_VAOs[mesh]) {
+		glBindVertexArray(GFX__data.meshes.instanced_VAOs[mesh]);
+	}
+	else {
+		GFX__Setup_instance_attributes(buffer);
+	}
+
+	glDrawElementsInstanced(GL_TRIANGLES, buffer->indices_count, GL_UNSIGNED_SHORT, (void *)0, count);
+	GFX__data.stats.draw_calls += 1;
+	GFX__data.stats.vertices   += (u64)buffer->vertices_count * count;
+	GFX__data.stats.indices    += (u64)buffer->indices_count * count;
+
+	if (!GFX__data.meshes.instanced_VAOs[mesh]) {
+		// The attributes are shared with the other shaders when there are no VAOs
+		for (int i = 0; i < 3; i+=1) {
+			glVertexAttribDivisor(GFX__data.instance_shader.rows[i], 0);
+			glDisableVertexAttribArray(GFX__data.instance_shader.rows[i]);
+		}
+		glVertexAttribDivisor(GFX__data.instance_shader.instance_color, 0);
+		glDisableVertexAttribArray(GFX__data.instance_shader.instance_color);
 	}
+
+	glUseProgram(GFX__data.default_shader.id);
 }
 
 
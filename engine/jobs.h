@@ -0,0 +1,442 @@
+#ifndef _JOBS_H_
+#define _JOBS_H_
+
+//
+// ---------- jobs.h ----------
+// Job system with a fixed pool of workers. Every worker, and the main thread, has its own
+// deque of jobs: the owner pushes and pops on the bottom and the threads without work steal
+// from the top of the others. Waiting on a counter runs jobs meanwhile, so a job can launch
+// jobs and wait for them without blocking a worker.
+// Without workers (always on wasm, there are no threads) the jobs run inline when launched.
+//
+
+
+#include "base.h"
+#include "app.h"
+
+
+typedef void (*JobFunc)(void *arg);
+// Called with a subrange [first, last) of the parallel for
+typedef void (*JobRangeFunc)(void *arg, i32 first, i32 last);
+
+// Jobs launched with the counter that haven't finished, it must be zero initialized
+typedef struct {
+	i32 count;
+} JobCounter;
+
+
+/*
+* Jobs_init
+* =============================================================
+*
+* DESCRIPTIION
+* --------------------------------------------------------------
+* Starts the workers, it must be called from the main thread. Only the
+* main thread and the jobs can launch jobs, on other threads they run
+* inline.
+*
+* To stop the workers Jobs_deinit must be called.
+*
+* VARIABLES
+* -------------------------------------------------------------------
+* workers: Threads besides the main one, < 0 to use one per CPU left
+*          (Thread_count_cpus()-1). Clamped to JOBS_MAX_WORKERS, always 0
+*          on wasm.
+*
+*/
+void
+Jobs_init(i32 workers);
+
+
+/*
+* Jobs_deinit
+* =============================================================
+*
+* DESCRIPTIION
+* --------------------------------------------------------------
+* Stops the workers, there can't be jobs running or waiting.
+*
+*/
+void
+Jobs_deinit(void);
+
+
+/*
+* Jobs_threads_count
+* =============================================================
+*
+* DESCRIPTIION
+* --------------------------------------------------------------
+* Threads that run jobs, the workers and the main thread.
+*
+*/
+i32
+Jobs_threads_count(void);
+
+
+/*
+* Jobs_run
+* =============================================================
+*
+* DESCRIPTIION
+* --------------------------------------------------------------
+* Launches a job that calls func(arg).
+*
+* VARIABLES
+* -------------------------------------------------------------------
+* func:    Function of the job
+* arg:     Argument of the function, must be valid until the job finishes
+* counter: Incremented now and decremented when the job finishes, can be
+*          NULL if nobody waits for the job
+*
+*/
+void
+Jobs_run(JobFunc func, void *arg, JobCounter *counter);
+
+
+/*
+* Jobs_parallel_for_async
+* =============================================================
+*
+* DESCRIPTIION
+* --------------------------------------------------------------
+* Launches a job that calls func with subranges of [0, count) that cover
+* all of it. The range is split in halves while it's bigger than batch,
+* the upper halves are pushed as jobs, so the threads that steal get the
+* biggest pieces.
+*
+* VARIABLES
+* -------------------------------------------------------------------
+* count:   Size of the range
+* batch:   Max size of the subranges, the smaller are the more they can
+*          be balanced but the more the overhead
+* func:    Function called with every subrange
+* arg:     Argument of the function, must be valid until the job finishes
+* counter: Counts the jobs of the subranges, see Jobs_run
+*
+*/
+void
+Jobs_parallel_for_async(i32 count, i32 batch, JobRangeFunc func, void *arg, JobCounter *counter);
+
+
+// Like Jobs_parallel_for_async and waits until all the range is done
+void
+Jobs_parallel_for(i32 count, i32 batch, JobRangeFunc func, void *arg);
+
+
+/*
+* Jobs_wait
+* =============================================================
+*
+* DESCRIPTIION
+* --------------------------------------------------------------
+* Runs jobs until the counter gets to 0. The jobs that are run can be of
+* any counter, so a job waiting must not hold locks that others could
+* need. When there are no jobs to run it spins with pauses for a while and
+* then yields the CPU until the counter gets to 0.
+*
+*/
+void
+Jobs_wait(JobCounter *counter);
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//
+//                         IMPLEMENTATION
+//
+//
+////////////////////////////////////////////////////////////////////////////////
+
+
+#define JOBS_MAX_WORKERS 32
+// Jobs pushed and not taken that a thread can have, when it's full they run inline. The splits
+// of a parallel for only take log2(count/batch) entries.
+#define JOBS_DEQUE_SIZE  256
+
+typedef struct {
+	JobFunc func;
+	JobRangeFunc range_func;
+	void *arg;
+	i32 first;
+	i32 last;
+	i32 batch;
+	JobCounter *counter;
+} JOBS__Job;
+
+// Chase-Lev deque (Lê et al., "Correct and Efficient Work-Stealing for Weak Memory Models").
+// The thieves read the job before knowing if they got it, the fields are atomic so the owner can
+// write a new job on the slot meanwhile.
+typedef struct {
+	i64 top;
+	u8 top_padding[64-sizeof(i64)]; // Thieves and owner on different cache lines
+	i64 bottom;
+	u8 bottom_padding[64-sizeof(i64)];
+	JOBS__Job jobs[JOBS_DEQUE_SIZE];
+} JOBS__Deque;
+
+static struct {
+	i32 workers_count;
+	Thread workers[JOBS_MAX_WORKERS];
+	JOBS__Deque deques[JOBS_MAX_WORKERS+1]; // The main thread uses the first
+
+	// The workers sleep on the semaphore when there are no jobs to steal
+	Semaphore wake;
+	i32 sleeping;
+	bool quit;
+} JOBS__data = {0};
+
+// The deque of the thread, -1 if the thread doesn't run jobs
+static _Thread_local i32 JOBS__thread_index = -1;
+
+
+static void
+JOBS__Store_job(JOBS__Job *dst, const JOBS__Job *src) {
+	__atomic_store_n(&dst->func,       src->func,       __ATOMIC_RELAXED);
+	__atomic_store_n(&dst->range_func, src->range_func, __ATOMIC_RELAXED);
+	__atomic_store_n(&dst->arg,        src->arg,        __ATOMIC_RELAXED);
+	__atomic_store_n(&dst->first,      src->first,      __ATOMIC_RELAXED);
+	__atomic_store_n(&dst->last,       src->last,       __ATOMIC_RELAXED);
+	__atomic_store_n(&dst->batch,      src->batch,      __ATOMIC_RELAXED);
+	__atomic_store_n(&dst->counter,    src->counter,    __ATOMIC_RELAXED);
+}
+
+static void
+JOBS__Load_job(JOBS__Job *dst, const JOBS__Job *src) {
+	dst->func       = __atomic_load_n(&src->func,       __ATOMIC_RELAXED);
+	dst->range_func = __atomic_load_n(&src->range_func, __ATOMIC_RELAXED);
+	dst->arg        = __atomic_load_n(&src->arg,        __ATOMIC_RELAXED);
+	dst->first      = __atomic_load_n(&src->first,      __ATOMIC_RELAXED);
+	dst->last       = __atomic_load_n(&src->last,       __ATOMIC_RELAXED);
+	dst->batch      = __atomic_load_n(&src->batch,      __ATOMIC_RELAXED);
+	dst->counter    = __atomic_load_n(&src->counter,    __ATOMIC_RELAXED);
+}
+
+// Only the owner
+static bool
+JOBS__Push(JOBS__Deque *deque, const JOBS__Job *job) {
+	i64 bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+	i64 top    = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	if (bottom - top >= JOBS_DEQUE_SIZE) return false;
+	JOBS__Store_job(&deque->jobs[bottom & (JOBS_DEQUE_SIZE-1)], job);
+	// Pairs with the acquire of the thieves, they see the job if they see the bottom
+	__atomic_store_n(&deque->bottom, bottom+1, __ATOMIC_RELEASE);
+	return true;
+}
+
+// Only the owner, takes the newest job
+static bool
+JOBS__Pop(JOBS__Deque *deque, JOBS__Job *job_result) {
+	i64 bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	i64 top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+	bool result = false;
+	if (top <= bottom) {
+		JOBS__Load_job(job_result, &deque->jobs[bottom & (JOBS_DEQUE_SIZE-1)]);
+		result = true;
+		if (top == bottom) {
+			// The last one, a thief could be taking it
+			result = __atomic_compare_exchange_n(&deque->top, &top, top+1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+			__atomic_store_n(&deque->bottom, bottom+1, __ATOMIC_RELAXED);
+		}
+	}
+	else {
+		__atomic_store_n(&deque->bottom, bottom+1, __ATOMIC_RELAXED);
+	}
+	return result;
+}
+
+// Any thread, takes the oldest job
+static bool
+JOBS__Steal(JOBS__Deque *deque, JOBS__Job *job_result) {
+	i64 top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	i64 bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+	if (top >= bottom) return false;
+	JOBS__Load_job(job_result, &deque->jobs[top & (JOBS_DEQUE_SIZE-1)]);
+	return __atomic_compare_exchange_n(&deque->top, &top, top+1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static bool
+JOBS__Find_job(JOBS__Job *job_result) {
+	i32 self = JOBS__thread_index;
+	if (JOBS__Pop(&JOBS__data.deques[self], job_result)) return true;
+	i32 deques_count = JOBS__data.workers_count+1;
+	for (i32 i = 1; i < deques_count; i += 1) {
+		if (JOBS__Steal(&JOBS__data.deques[(self+i) % deques_count], job_result)) return true;
+	}
+	return false;
+}
+
+// Pushes the job on the deque of the thread, returns false if it must run inline. The counter
+// is incremented when it's pushed.
+static bool
+JOBS__Launch(const JOBS__Job *job) {
+	if (JOBS__data.workers_count == 0 || JOBS__thread_index < 0) return false;
+
+	if (job->counter) __atomic_fetch_add(&job->counter->count, 1, __ATOMIC_RELAXED);
+	if (!JOBS__Push(&JOBS__data.deques[JOBS__thread_index], job)) {
+		if (job->counter) __atomic_fetch_sub(&job->counter->count, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	// Pairs with the fence of a worker going to sleep: it sees the job or we see it sleeping
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&JOBS__data.sleeping, __ATOMIC_RELAXED) > 0) Semaphore_post(&JOBS__data.wake);
+	return true;
+}
+
+static void
+JOBS__Execute(JOBS__Job *job) {
+	if (job->range_func) {
+		while (job->last - job->first > job->batch) {
+			JOBS__Job upper = *job;
+			upper.first = job->first + (job->last - job->first)/2;
+			if (!JOBS__Launch(&upper)) break; // Everything is done here
+			job->last = upper.first;
+		}
+		job->range_func(job->arg, job->first, job->last);
+	}
+	else {
+		job->func(job->arg);
+	}
+	if (job->counter) __atomic_fetch_sub(&job->counter->count, 1, __ATOMIC_RELEASE);
+}
+
+static void
+JOBS__Worker_main(void *arg) {
+	JOBS__thread_index = (i32)(intptr_t)arg;
+	JOBS__Job job;
+	for (;;) {
+		if (JOBS__Find_job(&job)) {
+			JOBS__Execute(&job);
+			continue;
+		}
+
+		__atomic_fetch_add(&JOBS__data.sleeping, 1, __ATOMIC_SEQ_CST);
+		if (JOBS__Find_job(&job)) {
+			__atomic_fetch_sub(&JOBS__data.sleeping, 1, __ATOMIC_SEQ_CST);
+			JOBS__Execute(&job);
+			continue;
+		}
+		if (__atomic_load_n(&JOBS__data.quit, __ATOMIC_ACQUIRE)) break;
+		Semaphore_wait(&JOBS__data.wake);
+		__atomic_fetch_sub(&JOBS__data.sleeping, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+
+// Documented above
+void
+Jobs_init(i32 workers) {
+	Assert(JOBS__data.workers_count == 0, "The jobs are already initialized");
+#if defined(APP_WASM)
+	workers = 0;
+#endif
+	if (workers < 0) workers = Thread_count_cpus()-1;
+	if (workers > JOBS_MAX_WORKERS) workers = JOBS_MAX_WORKERS;
+
+	JOBS__thread_index = 0;
+	JOBS__data.quit = false;
+	JOBS__data.sleeping = 0;
+	JOBS__data.workers_count = workers;
+	Semaphore_init(&JOBS__data.wake, 0);
+	for (i32 i = 0; i < workers; i += 1) {
+		Thread_start(&JOBS__data.workers[i], JOBS__Worker_main, (void *)(intptr_t)(i+1));
+	}
+}
+
+// Documented above
+void
+Jobs_deinit(void) {
+	__atomic_store_n(&JOBS__data.quit, true, __ATOMIC_RELEASE);
+	for (i32 i = 0; i < JOBS__data.workers_count; i += 1) Semaphore_post(&JOBS__data.wake);
+	for (i32 i = 0; i < JOBS__data.workers_count; i += 1) Thread_join(&JOBS__data.workers[i]);
+	Semaphore_deinit(&JOBS__data.wake);
+	JOBS__data.workers_count = 0;
+}
+
+// Documented above
+i32
+Jobs_threads_count(void) {
+	return JOBS__data.workers_count+1;
+}
+
+// Documented above
+void
+Jobs_run(JobFunc func, void *arg, JobCounter *counter) {
+	JOBS__Job job = {0};
+	job.func    = func;
+	job.arg     = arg;
+	job.counter = counter;
+	if (!JOBS__Launch(&job)) {
+		job.counter = NULL;
+		JOBS__Execute(&job);
+	}
+}
+
+// Documented above
+void
+Jobs_parallel_for_async(i32 count, i32 batch, JobRangeFunc func, void *arg, JobCounter *counter) {
+	if (count <= 0) return;
+	JOBS__Job job = {0};
+	job.range_func = func;
+	job.arg        = arg;
+	job.first      = 0;
+	job.last       = count;
+	job.batch      = (batch > 1) ? batch : 1;
+	job.counter    = counter;
+	if (!JOBS__Launch(&job)) {
+		job.counter = NULL;
+		JOBS__Execute(&job);
+	}
+}
+
+// Documented above
+void
+Jobs_parallel_for(i32 count, i32 batch, JobRangeFunc func, void *arg) {
+	JobCounter counter = {0};
+	Jobs_parallel_for_async(count, batch, func, arg, &counter);
+	Jobs_wait(&counter);
+}
+
+// Hint to the CPU that it's on a spin loop, it frees the core for the other hyperthread
+static inline void
+JOBS__Pause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+// Documented above
+void
+Jobs_wait(JobCounter *counter) {
+	// Without jobs to run the other threads are finishing the last ones. The pauses double on
+	// every try so the wait ends soon after the counter, and past JOBS_MAX_PAUSES the thread
+	// yields so it doesn't take the core from the workers.
+	const i32 JOBS_MAX_PAUSES = 64;
+	i32 pauses = 1;
+	JOBS__Job job;
+	while (__atomic_load_n(&counter->count, __ATOMIC_ACQUIRE) > 0) {
+		if (JOBS__thread_index >= 0 && JOBS__Find_job(&job)) {
+			JOBS__Execute(&job);
+			pauses = 1;
+		}
+		else if (pauses <= JOBS_MAX_PAUSES) {
+			for (i32 i = 0; i < pauses; i += 1) JOBS__Pause();
+			pauses *= 2;
+		}
+		else {
+			Thread_yield();
+		}
+	}
+}
+
+
+#endif // _JOBS_H_
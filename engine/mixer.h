@@ -786,6 +786,8 @@ Mixer_play_track_frames(f32* buffer, u32 buffer_size, u32 track_id) {
 // Documented above
 void
 Mixer_play_frames(f32* buffer, u32 buffer_size) {
+	// Runs on the sound thread, it gets its own track on the trace
+	PROFILE_ZONE("Mixer_play_frames");
 
 	// Fills the buffer with 0.0
 	for (u32 i = 0; i < buffer_size; ++i) {
@@ -14,7 +14,8 @@
 typedef struct {
 	u32 sprite_width;
 	u32 sprite_height;
-	GLuint texture_id;
+	GLuint texture_id;        // 0 when the sprites are in the shared atlas
+	GFX_TextureRegion region; // Where the sprites are, the UVs are relative to it
 	i32 texture_width;
 	i32 texture_height;
 } Spriteset;
@@ -362,7 +363,7 @@ Draw_sprite(const Spriteset *spriteset, Vec2 pos, f32 width, f32 height, f32 rot
 	v2 = V2_add(pos, Mul_v2_m2(v2, rot_mat));
 	v3 = V2_add(pos, Mul_v2_m2(v3, rot_mat));
 
-	GFX_Set_texture(spriteset->texture_id);
+	GFX_Set_texture_region(spriteset->region);
 	GFX_Draw_textured_quad(v0, v1, v2, v3, UVs[0], UVs[1], UVs[2], UVs[3], color);
 }
 
@@ -398,26 +399,33 @@ Make_spriteset(const char *image_filename, u32 sprite_width, u32 sprite_height,
 			return -1;
     	}
 
-		GLuint texture_id;
-    	glGenTextures(1, &texture_id);
-    	glBindTexture(GL_TEXTURE_2D, texture_id);
-		if (linear_interpolation) {
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		}
-		else {
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		// The spritesets with nearest filtering go to the shared atlas when they fit
+		if (linear_interpolation ||
+			!GFX_Atlas_add(sprite, (u32)texture_width, (u32)texture_height, &spriteset_result->region)) {
+			GLuint texture_id;
+    		glGenTextures(1, &texture_id);
+    		glBindTexture(GL_TEXTURE_2D, texture_id);
+			if (linear_interpolation) {
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			}
+			else {
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			}
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE); // On webgl we need a pow
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE); // of 2 texture or set this
+    		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, texture_width, texture_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, sprite);
+			GFX_Count_upload((u64)texture_width*texture_height*4);
+    		//glGenerateMipmap(GL_TEXTURE_2D);
+
+			spriteset_result->texture_id = texture_id;
+			spriteset_result->region     = GFX_Texture_region(texture_id);
 		}
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE); // On webgl we need a pow
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE); // of 2 texture or set this
-    	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, texture_width, texture_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, sprite);
-    	//glGenerateMipmap(GL_TEXTURE_2D);
 
     	stbi_image_free(sprite);
 
 		// Set the values on the structure!!!
-		spriteset_result->texture_id     = texture_id;
 		spriteset_result->texture_width  = texture_width;
 		spriteset_result->texture_height = texture_height;
 	}
@@ -430,7 +438,8 @@ Make_spriteset(const char *image_filename, u32 sprite_width, u32 sprite_height,
 // Documented above
 void
 Free_spriteset(Spriteset *spriteset) {
-	glDeleteTextures(1, &(spriteset->texture_id));
+	// The space of the spritesets in the shared atlas isn't reclaimed
+	if (spriteset->texture_id) glDeleteTextures(1, &(spriteset->texture_id));
 	memset(spriteset, 0, sizeof(Spriteset));
 }
 
@@ -490,7 +499,7 @@ Draw_tilemap(Tilemap *tilemap, Vec2 pos, f32 width, f32 height, Color color) {
 	f32 tile_w   = width/(f32)tiles_x;
 	f32 tile_h   = height/(f32)tiles_y;
 
-	GFX_Set_texture(tilemap->spriteset->texture_id);
+	GFX_Set_texture_region(tilemap->spriteset->region);
 	for (u32 layer_i = 0; layer_i < n_layers; layer_i += 1) {
 		for (u32 y = 0; y < tiles_y; y += 1) {
 			for (u32 x = 0; x < tiles_x; x += 1) {
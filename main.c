@@ -2,17 +2,88 @@
 #include "engine/app.h"
 #include "engine/base.h"
 #include "engine/graphics.h"
+#include "engine/capture.h"
+#include "engine/jobs.h"
 #define MICROUI_IMPLEMENTATION
 #include "engine/vendor/microui.h"
 #include "engine/third_party/stb_image.h"
 #include "texture_jpg.h"
 
 mu_Context muctx;
+// For automated runs, see main: the frame stats are written to frame_stats_path when the app
+// quits, after frames_to_run frames if it isn't 0. Headless runs need frames_to_run, there is
+// no window to close
+const char *frame_stats_path = NULL;
+int frames_to_run = 0;
+bool headless = false;
+// Every frame is saved to capture_path, a printf format for the frame number. PPM if it ends
+// with .ppm, PNG if not
+const char *capture_path = NULL;
+// The demos set it when something moves by itself, if nothing does the app waits for input
+// instead of drawing the same frame again, see APP_Idle
+bool frame_animating = false;
 GLuint terrain_texture;
 GLuint height_map_texture = 0;
-GFX_Buffer height_map_buffer = {0};
-GFX_Vertex height_map_vertex_buffer[1025*1025];
-u32 height_map_triangles_buffer[1024*1024*6];
+
+// The terrain is splitted in chunks of TERRAIN_CHUNK_QUADS*TERRAIN_CHUNK_QUADS quads so every
+// chunk can be indexed with 16 bit indices
+#define TERRAIN_CHUNK_QUADS    128
+#define TERRAIN_CHUNK_VERTICES ((TERRAIN_CHUNK_QUADS+1)*(TERRAIN_CHUNK_QUADS+1))
+#define TERRAIN_CHUNK_INDICES  (TERRAIN_CHUNK_QUADS*TERRAIN_CHUNK_QUADS*6)
+#define TERRAIN_MAX_CHUNKS     ((1024/TERRAIN_CHUNK_QUADS)*(1024/TERRAIN_CHUNK_QUADS))
+// Every LOD halves the resolution of the chunk, the last LOD is a single quad
+#define TERRAIN_MAX_LODS       8
+// All the chunks share the indices of every LOD, one set for each combination of the edges that
+// must be stitched to a coarser neighbor (4 bits). The sum of the LODs is a geometric series.
+#define TERRAIN_LOD_INDICES    (TERRAIN_CHUNK_INDICES*16*4/3)
+#define TERRAIN_EDGE_TOP       (1 << 0) // Row 0
+#define TERRAIN_EDGE_LEFT      (1 << 1) // Column 0
+#define TERRAIN_EDGE_BOTTOM    (1 << 2) // Last row
+#define TERRAIN_EDGE_RIGHT     (1 << 3) // Last column
+
+typedef struct {
+	Vec3 aabb_min;
+	Vec3 aabb_max;
+	// Max vertical error of every LOD against the full resolution heightmap
+	f32  lod_error[TERRAIN_MAX_LODS];
+	i32  lod;
+	bool visible;
+} TerrainChunk;
+
+GFX_Buffer terrain_chunks[TERRAIN_MAX_CHUNKS];
+TerrainChunk terrain_chunks_info[TERRAIN_MAX_CHUNKS];
+i32 terrain_chunks_count = 0;
+i32 terrain_chunks_side  = 0;
+i32 terrain_chunk_quads  = 0;
+i32 terrain_lods_count   = 0;
+GFX_TerrainVertex terrain_chunks_vertices[TERRAIN_MAX_CHUNKS][TERRAIN_CHUNK_VERTICES];
+// Vertices of the whole height map, built by Build_heightmap_mesh and copied to the chunks
+#define TERRAIN_MAX_PARTITIONS (1024+1)
+GFX_TerrainVertex terrain_grid_vertices[TERRAIN_MAX_PARTITIONS*TERRAIN_MAX_PARTITIONS];
+// Normals of the full resolution height map, see Bake_heightmap_normal_map
+GLuint terrain_normal_map = 0;
+u8 terrain_normal_map_texels[TERRAIN_MAX_PARTITIONS*TERRAIN_MAX_PARTITIONS*2];
+// Ambient occlusion of the full resolution height map, see Bake_heightmap_ao_map
+GLuint terrain_ao_map = 0;
+u8 terrain_ao_map_texels[TERRAIN_MAX_PARTITIONS*TERRAIN_MAX_PARTITIONS];
+
+GFX_Buffer terrain_lod_indices;
+u16 terrain_lod_indices_mem[TERRAIN_LOD_INDICES];
+struct {
+	u32 first;
+	u32 count;
+} terrain_lod_ranges[TERRAIN_MAX_LODS][16];
+// Average cache miss ratio of the full resolution chunk with rows and with cache sized bands
+f32 terrain_acmr_rows  = 0.0f;
+f32 terrain_acmr_bands = 0.0f;
+
+// Right-triangulated irregular network of the whole heightmap, the error of every vertex is
+// the max error of the triangles that split the hypotenuse on it and of all their children
+f32 rtin_errors[1025*1025];
+u32 rtin_vertex_index[1025*1025];
+GFX_Buffer rtin_buffer = {0};
+GFX_TerrainVertex rtin_vertices[1025*1025];
+u32 rtin_indices[1024*1024*6];
 
 static f32
 Get_perlin_dot(u64 seed, i32 xi, i32 yi, f32 x, f32 y) {
@@ -67,8 +138,55 @@ Get_perlin_point(u64 seed, f32 x, f32 y) {
 
 
 
+// Rows of the height map done by every job of Jobs_parallel_for, the time of a row of 1025
+// points is far bigger than the cost of a job
+#define HEIGHTMAP_BATCH_ROWS 32
+
+typedef struct {
+	f32 *height_map;
+	i32 partitions;
+	f32 step;
+	int octaves;
+	f32 lacunarity;
+	f32 max_height;
+	f32 H;
+	f32 mgain;
+	u64 seed;
+} NoiseSynthesisJob;
+
+static void
+Noise_synthesis_rows(void *arg, i32 first_row, i32 last_row) {
+	NoiseSynthesisJob *job = (NoiseSynthesisJob *)arg;
+	i32 partitions = job->partitions;
+	// Accumulated as the rows before so the heights don't depend on the batches
+	f32 y = 0.0f;
+	for (int row = 0; row < first_row; row+=1) y += job->step;
+	for (int row = first_row; row < last_row; row+=1) {
+		f32 x = 0.0f;
+		for (int col = 0; col < partitions; col+=1) {
+			f32 octave_x = x;
+			f32 octave_y = y;
+			f32 height  = 0.0f;
+			f32 gain    = job->mgain;
+			for (int octave_i = 0; octave_i < job->octaves; octave_i+=1) {
+				gain *= (1.0f-job->H);
+				height += Get_perlin_point(job->seed+(u64)octave_i, octave_x, octave_y) * gain;
+				// We wrap to ensure this doesn't overflow
+				octave_x = Mod(octave_x*job->lacunarity, 2e9f);
+				octave_y = Mod(octave_y*job->lacunarity, 2e9f);
+			}
+
+			job->height_map[row * partitions + col] = height*job->max_height;
+			x += job->step;
+		}
+		y += job->step;
+	}
+}
+
+// Every point is independent, the rows are done in parallel
 static void
 Fractal_terrain_3d_noise_synthesis(f32 *height_map, i32 partitions, f32 frecuency, int octaves, f32 lacunarity, f32 max_height, f32 H, u64 seed) {
+	PROFILE_ZONE("Noise synthesis");
 
 	// Compute the initial gain to be bounded between -height_map and height_map
 	f32 mgain = 1.0f;
@@ -84,36 +202,158 @@ Fractal_terrain_3d_noise_synthesis(f32 *height_map, i32 partitions, f32 frecuenc
 		mgain = mheight;
 	}
 
-	f32 x = 0.0f, y = 0.0f;
-	f32 step = frecuency/(f32)partitions;
-	for (int row = 0; row < partitions; row+=1) {
-		x = 0.0f;
-		for (int col = 0; col < partitions; col+=1) {
-			f32 octave_x = x;
-			f32 octave_y = y;
-			f32 height  = 0.0f;
-			f32 gain    = mgain;
-			for (int octave_i = 0; octave_i < octaves; octave_i+=1) {
-				gain *= (1.0f-H);
-				height += Get_perlin_point(seed+(u64)octave_i, octave_x, octave_y) * gain;
-				// We wrap to ensure this doesn't overflow
-				octave_x = Mod(octave_x*lacunarity, 2e9f);
-				octave_y = Mod(octave_y*lacunarity, 2e9f);
-			}
+	NoiseSynthesisJob job = {height_map, partitions, frecuency/(f32)partitions, octaves, lacunarity, max_height, H, mgain, seed};
+	Jobs_parallel_for(partitions, HEIGHTMAP_BATCH_ROWS, Noise_synthesis_rows, &job);
+}
+
+
+// wyrand only adds a constant to the state, so the number n of the sequence of a seed is
+// computed without the previous ones and the points can be done in any order
+static f32
+Square_diamond_random(u64 seed, u64 n) {
+	u64 state = seed + n*0xa0761d6478bd642full;
+	return (f32)(wy2gau(wyrand(&state)) / 3.0f);
+}
 
-			height_map[row * partitions + col] = height*max_height;
-			x += step;
+// Points of a pass of Fractal_terrain_3d_square_diamond done by every job
+#define SQUARE_DIAMOND_BATCH_POINTS (16*1024)
+
+typedef struct {
+	f32 *height_map;
+	i32 partitions;
+	i32 step;
+	f32 proportional_height;
+	u64 seed;
+	u64 first_random; // Number of the first random of the pass
+	Mutex mutex;
+	f32 max;
+	f32 min;
+} SquareDiamondJob;
+
+static void
+Square_diamond_merge(SquareDiamondJob *job, f32 max, f32 min) {
+	Mutex_lock(&job->mutex);
+	job->max = Max(job->max, max);
+	job->min = Min(job->min, min);
+	Mutex_unlock(&job->mutex);
+}
+
+// Square steps
+//
+// |-------------|
+// [x]         [x]
+// |             |
+// |      o      |
+// |             |
+// [x]         [x]
+// |-------------|
+//
+static void
+Square_diamond_square_rows(void *arg, i32 first_row, i32 last_row) {
+	SquareDiamondJob *job = (SquareDiamondJob *)arg;
+	f32 *height_map = job->height_map;
+	i32 partitions  = job->partitions;
+	i32 step        = job->step;
+	i32 cells       = (partitions-1)/step;
+	f32 current_max = -1e9f;
+	f32 current_min =  1e9f;
+	for (i32 row = first_row; row < last_row; row += 1) {
+		i32 sq_y = step/2 + row*step;
+		u64 n = job->first_random + (u64)row*cells;
+		for (i32 sq_x = step/2; sq_x < partitions; sq_x += step) {
+			// Mean the values of the surrounding square
+			i32 y_0 = sq_y - (step/2);
+			i32 y_1 = sq_y + (step/2);
+			i32 x_0 = sq_x - (step/2);
+			i32 x_1 = sq_x + (step/2);
+			f32 mean = 0.0f;
+			mean += height_map[y_0 * partitions + x_0];
+			mean += height_map[y_0 * partitions + x_1];
+			mean += height_map[y_1 * partitions + x_0];
+			mean += height_map[y_1 * partitions + x_1];
+			mean *= 0.25f;
+			f32 height = mean + Square_diamond_random(job->seed, n) * job->proportional_height;
+			n += 1;
+			current_max = Max(height, current_max);
+			current_min = Min(height, current_min);
+			height_map[sq_y * partitions + sq_x] = height;
 		}
-		y += step;
 	}
+	Square_diamond_merge(job, current_max, current_min);
 }
 
+// Diamond steps
+//
+// |-------------|   |-------------|  |-------------|  |-------------|
+// [x]    o    [x]   [x]    x     x|  |x          [x]  |x     x     x|
+// |             |   |             |  |             |  |             |
+// |     [x]     |   |o    [x]     |  |x    [x]    o|  |x    [x]    x|
+// |             |   |             |  |             |  |             |
+// |x           x|   [x]          x|  |x          [x]  [x]    o    [x]
+// |-------------|   |-------------|  |-------------|  |-------------|
+//
+// The points of the pass only read the corners and the centers of the squares, not each other.
+static void
+Square_diamond_diamond_rows(void *arg, i32 first_row, i32 last_row) {
+	SquareDiamondJob *job = (SquareDiamondJob *)arg;
+	f32 *height_map = job->height_map;
+	i32 partitions  = job->partitions;
+	i32 step        = job->step;
+	i32 cells       = (partitions-1)/step;
+	f32 current_max = -1e9f;
+	f32 current_min =  1e9f;
+	for (i32 row = first_row; row < last_row; row += 1) {
+		// The even rows start at the middle of the cells and have a point less
+		i32 dmond_y = row*(step/2);
+		i32 dmond_x = (row % 2 == 0) ? step/2 : 0;
+		u64 n = job->first_random + (u64)((row+1)/2)*cells + (u64)(row/2)*(cells+1);
+		for (; dmond_x < partitions; dmond_x += step) {
+			// interpolate the value of the nearst previous calculates points
+			i32 y_0 = dmond_y - (step/2);
+			i32 y_1 = dmond_y + (step/2);
+			i32 x_0 = dmond_x - (step/2);
+			i32 x_1 = dmond_x + (step/2);
+			f32 mean = 0.0f;
+			f32 total = 0.0f;
+			if (y_0 >= 0) {
+				mean += height_map[y_0 * partitions + dmond_x];
+				total += 1.0f;
+			}
+			if (x_0 >= 0) {
+				mean += height_map[dmond_y * partitions + x_0];
+				total += 1.0f;
+			}
+			if (x_1 < partitions) {
+				mean += height_map[dmond_y * partitions + x_1];
+				total += 1.0f;
+			}
+			if (y_1 < partitions) {
+				mean += height_map[y_1 * partitions + dmond_x];
+				total += 1.0f;
+			}
+			mean /= total;
+			f32 height =  mean + Square_diamond_random(job->seed, n) * job->proportional_height;
+			n += 1;
+			current_max = Max(current_max, height);
+			current_min = Min(current_min, height);
+			height_map[dmond_y * partitions + dmond_x] = height;
+		}
+	}
+	Square_diamond_merge(job, current_max, current_min);
+}
 
+// The passes of every step are done in parallel, the random numbers are taken from the sequence
+// as if the points were done in order so the result is the same.
 static void
 Fractal_terrain_3d_square_diamond(f32 *height_map, i32 partitions, f32 max_height, f32 H, u64 seed, f32 *max, f32 *min) {
+	PROFILE_ZONE("Square diamond");
 
-	f32 current_max = -1e9f;
-	f32 current_min =  1e9f;
+	SquareDiamondJob job = {0};
+	job.height_map = height_map;
+	job.partitions = partitions;
+	job.max = -1e9f;
+	job.min =  1e9f;
+	Mutex_init(&job.mutex);
 
 	f32 proportional_height = max_height*(1.0f-H);
 
@@ -127,124 +367,757 @@ Fractal_terrain_3d_square_diamond(f32 *height_map, i32 partitions, f32 max_heigh
 	// |o           o|
 	// |-------------|
 	//
-	f32 height = (f32)(wy2gau(wyrand(&seed)) / 3.0f) * proportional_height;
-	current_max = Max(height, current_max);
-	current_min = Min(height, current_min);
+	for (u64 n = 0; n < 4; n += 1) {
+		f32 height = Square_diamond_random(seed, n) * proportional_height;
+		job.max = Max(height, job.max);
+		job.min = Min(height, job.min);
+	}
 	height_map[0 * partitions + 0] = 0;
-
-	height = (f32)(wy2gau(wyrand(&seed)) / 3.0f) * proportional_height; 
-	current_max = Max(height, current_max);
-	current_min = Min(height, current_min);
 	height_map[0 * partitions + partitions - 1] = 0;
-
-	height = (f32)(wy2gau(wyrand(&seed)) / 3.0f) * proportional_height; 
-	current_max = Max(height, current_max);
-	current_min = Min(height, current_min);
 	height_map[(partitions-1) * partitions + 0] = 0;
-
-	height = (f32)(wy2gau(wyrand(&seed)) / 3.0f) * proportional_height; 
-	current_max = Max(height, current_max);
-	current_min = Min(height, current_min);
 	height_map[partitions * partitions - 1] = 0;
+	job.first_random = 4;
 
 	i32 step  = partitions-1;
 
 
 	while (step > 1) {
+		i32 cells = (partitions-1)/step;
+		i32 batch = Max(SQUARE_DIAMOND_BATCH_POINTS/cells, 1);
+		job.step = step;
+		job.proportional_height = proportional_height;
+		job.seed = seed;
+
+		Jobs_parallel_for(cells, batch, Square_diamond_square_rows, &job);
+		job.first_random += (u64)cells*cells;
+
+		//proportional_height *= (1.0f-H);
+		Jobs_parallel_for(2*cells+1, batch, Square_diamond_diamond_rows, &job);
+		job.first_random += 2*(u64)cells*(cells+1);
 
-		// Square steps
-		//
-		// |-------------|
-		// [x]         [x]
-		// |             |
-		// |      o      |
-		// |             |
-		// [x]         [x]
-		// |-------------|
-		//
-
-		for (i32 sq_y = step/2; sq_y < partitions; sq_y += step) {
-			for (i32 sq_x = step/2; sq_x < partitions; sq_x += step) {
-				// Mean the values of the surrounding square
-				i32 y_0 = sq_y - (step/2);
-				i32 y_1 = sq_y + (step/2);
-				i32 x_0 = sq_x - (step/2);
-				i32 x_1 = sq_x + (step/2);
-				f32 mean = 0.0f;
-				mean += height_map[y_0 * partitions + x_0];
-				mean += height_map[y_0 * partitions + x_1];
-				mean += height_map[y_1 * partitions + x_0];
-				mean += height_map[y_1 * partitions + x_1];
-				mean *= 0.25f;
-				f32 height = mean + (f32)(wy2gau(wyrand(&seed)) / 3.0f) * proportional_height;
-				current_max = Max(height, current_max);
-				current_min = Min(height, current_min);
-				height_map[sq_y * partitions + sq_x] = height;
+		step /= 2;
+		
+		proportional_height *= (1.0f-H);
+	}
+
+	Mutex_deinit(&job.mutex);
+	if (max) *max = job.max;
+	if (min) *min = job.min;
+}
+
+
+
+static Vec3
+Heightmap_normal(f32 *height_map, i32 partitions, i32 i, i32 j, f32 wstep) {
+	f32 y = height_map[i * partitions + j];
+	bool has_neigh0 = (i > 0);
+	bool has_neigh1 = (j > 0);
+	bool has_neigh2 = (i < (partitions-1));
+	bool has_neigh3 = (j < (partitions-1));
+	Vec3 neigh0, neigh1, neigh2, neigh3;
+	if (has_neigh0) {
+		f32 neigh0_y = height_map[(i-1) * partitions + j] - y;
+		neigh0 = V3(0.0f, neigh0_y, -wstep);
+	}
+	if (has_neigh1) {
+		f32 neigh1_y = height_map[i * partitions + j - 1] - y;
+		neigh1 = V3(-wstep, neigh1_y, 0.0f);
+	}
+	if (has_neigh2) {
+		f32 neigh2_y = height_map[(i+1) * partitions + j] - y;
+		neigh2 = V3(0.0f, neigh2_y, wstep);
+	}
+	if (has_neigh3) {
+		f32 neigh3_y = height_map[i * partitions + j + 1] - y;
+		neigh3 = V3(wstep, neigh3_y, 0.0f);
+	}
+
+	Vec3 normal_acum = V3(0, 0, 0);
+	f32 normal_total = 0.0f;
+	if (has_neigh0 && has_neigh1) {
+		normal_acum = V3_Add(normal_acum, V3_Cross(neigh0, neigh1));
+		normal_total += 1.0f;
+	}
+	if (has_neigh1 && has_neigh2) {
+		normal_acum = V3_Add(normal_acum, V3_Cross(neigh1, neigh2));
+		normal_total += 1.0f;
+	}
+	if (has_neigh2 && has_neigh3) {
+		normal_acum = V3_Add(normal_acum, V3_Cross(neigh2, neigh3));
+		normal_total += 1.0f;
+	}
+	if (has_neigh3 && has_neigh0) {
+		normal_acum = V3_Add(normal_acum, V3_Cross(neigh3, neigh0));
+		normal_total += 1.0f;
+	}
+
+	normal_acum = V3_Normalize(V3_Mulf(normal_acum, 1.0f/normal_total));
+	normal_acum.y = -normal_acum.y;
+	return normal_acum;
+}
+
+static GFX_TerrainVertex
+Terrain_vertex(f32 *height_map, i32 partitions, i32 i, i32 j, f32 wstep, f32 min_height, f32 height_scale) {
+	GFX_TerrainVertex result;
+	f32 height = (height_map[i * partitions + j]-min_height)*height_scale;
+	result.grid_x = (u16)j;
+	result.height = (u16)Clamp(height + 0.5f, 0.0f, 65535.0f);
+	result.grid_z = (u16)i;
+	GFX_Oct_encode_normal(Heightmap_normal(height_map, partitions, i, j, wstep), result.normal);
+	return result;
+}
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HEIGHTMAP_SIMD 1
+typedef __m128  F32x4;
+typedef __m128i I32x4;
+#define F32x4_load(p)         _mm_loadu_ps(p)
+#define F32x4_set1(x)         _mm_set1_ps(x)
+#define F32x4_add(a, b)       _mm_add_ps(a, b)
+#define F32x4_sub(a, b)       _mm_sub_ps(a, b)
+#define F32x4_mul(a, b)       _mm_mul_ps(a, b)
+#define F32x4_div(a, b)       _mm_div_ps(a, b)
+#define F32x4_min(a, b)       _mm_min_ps(a, b)
+#define F32x4_max(a, b)       _mm_max_ps(a, b)
+#define F32x4_abs(a)          _mm_andnot_ps(_mm_set1_ps(-0.0f), a)
+#define F32x4_ge(a, b)        _mm_cmpge_ps(a, b)
+#define F32x4_lt(a, b)        _mm_cmplt_ps(a, b)
+#define F32x4_select(m, a, b) _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b))
+#define F32x4_to_i32(a)       _mm_cvttps_epi32(a)
+#define I32x4_store(p, a)     _mm_storeu_si128((__m128i *)(p), a)
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#define HEIGHTMAP_SIMD 1
+typedef v128_t F32x4;
+typedef v128_t I32x4;
+#define F32x4_load(p)         wasm_v128_load(p)
+#define F32x4_set1(x)         wasm_f32x4_splat(x)
+#define F32x4_add(a, b)       wasm_f32x4_add(a, b)
+#define F32x4_sub(a, b)       wasm_f32x4_sub(a, b)
+#define F32x4_mul(a, b)       wasm_f32x4_mul(a, b)
+#define F32x4_div(a, b)       wasm_f32x4_div(a, b)
+#define F32x4_min(a, b)       wasm_f32x4_min(a, b)
+#define F32x4_max(a, b)       wasm_f32x4_max(a, b)
+#define F32x4_abs(a)          wasm_f32x4_abs(a)
+#define F32x4_ge(a, b)        wasm_f32x4_ge(a, b)
+#define F32x4_lt(a, b)        wasm_f32x4_lt(a, b)
+#define F32x4_select(m, a, b) wasm_v128_bitselect(a, b, m)
+#define F32x4_to_i32(a)       wasm_i32x4_trunc_sat_f32x4(a)
+#define I32x4_store(p, a)     wasm_v128_store(p, a)
+#else
+#define HEIGHTMAP_SIMD 0
+#endif
+
+// Quantizes a vertex of Build_heightmap_mesh. dx and dz are the central differences of the
+// height, the normal is (dx, 2*wstep, dz) which has the direction of the average of the
+// cross products of Heightmap_normal. The octahedral encoding divides by the L1 norm so the
+// normal doesn't have to be normalized. It does the same operations than the SIMD path.
+static inline void
+Heightmap_mesh_vertex(GFX_TerrainVertex *v, i32 i, i32 j, f32 y, f32 dx, f32 dz, f32 ny, f32 min_height, f32 height_scale) {
+	f32 l1_norm = Abs(dx) + Abs(ny) + Abs(dz);
+	f32 x  = dx / l1_norm;
+	f32 oy = ny / l1_norm;
+	if (dz < 0.0f) {
+		f32 folded_x = (1.0f - Abs(oy)) * (x >= 0.0f ? 1.0f : -1.0f);
+		f32 folded_y = (1.0f - Abs(x)) * (oy >= 0.0f ? 1.0f : -1.0f);
+		x  = folded_x;
+		oy = folded_y;
+	}
+	v->grid_x    = (u16)j;
+	v->height    = (u16)Clamp((y-min_height)*height_scale + 0.5f, 0.0f, 65535.0f);
+	v->grid_z    = (u16)i;
+	v->normal[0] = (u8)Clamp((x * 0.5f + 0.5f) * 255.0f + 0.5f, 0.0f, 255.0f);
+	v->normal[1] = (u8)Clamp((oy * 0.5f + 0.5f) * 255.0f + 0.5f, 0.0f, 255.0f);
+}
+
+// Builds the vertices of the rows [first_row, last_row) of the height map
+static void
+Build_heightmap_rows(const f32 *height_map, i32 partitions, i32 first_row, i32 last_row, f32 wstep, f32 min_height, f32 height_scale, GFX_TerrainVertex *vertices) {
+	i32 last = partitions-1;
+	f32 ny   = 2.0f*wstep;
+	for (i32 i = first_row; i < last_row; i += 1) {
+		// dz = (above - below) * dz_scale, the missing neighbor of the borders is extrapolated
+		// (2*y - other) which doubles the one sided difference
+		const f32 *row   = &height_map[i * partitions];
+		const f32 *above = (i > 0)    ? row - partitions : row;
+		const f32 *below = (i < last) ? row + partitions : row;
+		f32 dz_scale = (i > 0 && i < last) ? 1.0f : 2.0f;
+		GFX_TerrainVertex *out = &vertices[i * partitions];
+
+		Heightmap_mesh_vertex(&out[0], i, 0, row[0], 2.0f*(row[0] - row[1]), (above[0] - below[0])*dz_scale, ny, min_height, height_scale);
+
+		i32 j = 1;
+#if HEIGHTMAP_SIMD
+		F32x4 v_ny       = F32x4_set1(ny);
+		F32x4 v_dz_scale = F32x4_set1(dz_scale);
+		F32x4 v_min      = F32x4_set1(min_height);
+		F32x4 v_scale    = F32x4_set1(height_scale);
+		F32x4 v_zero     = F32x4_set1(0.0f);
+		F32x4 v_half     = F32x4_set1(0.5f);
+		F32x4 v_one      = F32x4_set1(1.0f);
+		F32x4 v_minus    = F32x4_set1(-1.0f);
+		F32x4 v_255      = F32x4_set1(255.0f);
+		F32x4 v_65535    = F32x4_set1(65535.0f);
+		for (; j+4 <= last; j += 4) {
+			F32x4 y  = F32x4_load(&row[j]);
+			F32x4 dx = F32x4_sub(F32x4_load(&row[j-1]), F32x4_load(&row[j+1]));
+			F32x4 dz = F32x4_mul(F32x4_sub(F32x4_load(&above[j]), F32x4_load(&below[j])), v_dz_scale);
+
+			F32x4 l1_norm = F32x4_add(F32x4_add(F32x4_abs(dx), F32x4_abs(v_ny)), F32x4_abs(dz));
+			F32x4 x  = F32x4_div(dx, l1_norm);
+			F32x4 oy = F32x4_div(v_ny, l1_norm);
+			F32x4 folded_x = F32x4_mul(F32x4_sub(v_one, F32x4_abs(oy)), F32x4_select(F32x4_ge(x, v_zero), v_one, v_minus));
+			F32x4 folded_y = F32x4_mul(F32x4_sub(v_one, F32x4_abs(x)), F32x4_select(F32x4_ge(oy, v_zero), v_one, v_minus));
+			F32x4 lower = F32x4_lt(dz, v_zero);
+			x  = F32x4_select(lower, folded_x, x);
+			oy = F32x4_select(lower, folded_y, oy);
+
+			F32x4 height = F32x4_add(F32x4_mul(F32x4_sub(y, v_min), v_scale), v_half);
+			F32x4 enc_x  = F32x4_add(F32x4_mul(F32x4_add(F32x4_mul(x, v_half), v_half), v_255), v_half);
+			F32x4 enc_y  = F32x4_add(F32x4_mul(F32x4_add(F32x4_mul(oy, v_half), v_half), v_255), v_half);
+			i32 heights[4], normals_x[4], normals_y[4];
+			I32x4_store(heights,   F32x4_to_i32(F32x4_min(F32x4_max(height, v_zero), v_65535)));
+			I32x4_store(normals_x, F32x4_to_i32(F32x4_min(F32x4_max(enc_x, v_zero), v_255)));
+			I32x4_store(normals_y, F32x4_to_i32(F32x4_min(F32x4_max(enc_y, v_zero), v_255)));
+			for (i32 k = 0; k < 4; k += 1) {
+				GFX_TerrainVertex *v = &out[j+k];
+				v->grid_x    = (u16)(j+k);
+				v->height    = (u16)heights[k];
+				v->grid_z    = (u16)i;
+				v->normal[0] = (u8)normals_x[k];
+				v->normal[1] = (u8)normals_y[k];
 			}
 		}
+#endif
+		for (; j < last; j += 1) {
+			Heightmap_mesh_vertex(&out[j], i, j, row[j], row[j-1] - row[j+1], (above[j] - below[j])*dz_scale, ny, min_height, height_scale);
+		}
 
+		Heightmap_mesh_vertex(&out[last], i, last, row[last], 2.0f*(row[last-1] - row[last]), (above[last] - below[last])*dz_scale, ny, min_height, height_scale);
+	}
+}
 
-		// Diamond steps
-		//
-		// |-------------|   |-------------|  |-------------|  |-------------|
-		// [x]    o    [x]   [x]    x     x|  |x          [x]  |x     x     x|
-		// |             |   |             |  |             |  |             |
-		// |     [x]     |   |o    [x]     |  |x    [x]    o|  |x    [x]    x|
-		// |             |   |             |  |             |  |             |
-		// |x           x|   [x]          x|  |x          [x]  [x]    o    [x]
-		// |-------------|   |-------------|  |-------------|  |-------------|
-		//
+typedef struct {
+	const f32 *height_map;
+	i32 partitions;
+	f32 wstep;
+	f32 min_height;
+	f32 height_scale;
+	GFX_TerrainVertex *vertices;
+} HeightmapMeshJob;
 
-		//proportional_height *= (1.0f-H);
-		bool odd_row = true;
-		for (i32 dmond_y = 0; dmond_y < partitions; dmond_y += step/2) {
-			i32 dmond_x = 0;
-			if (odd_row) {
-				dmond_x = step/2;
-			}
-			odd_row = !odd_row;
-			for (; dmond_x < partitions; dmond_x += step) {
-				// interpolate the value of the nearst previous calculates points
-				i32 y_0 = dmond_y - (step/2);
-				i32 y_1 = dmond_y + (step/2);
-				i32 x_0 = dmond_x - (step/2);
-				i32 x_1 = dmond_x + (step/2);
-				f32 mean = 0.0f;
-				f32 total = 0.0f;
-				if (y_0 >= 0) {
-					mean += height_map[y_0 * partitions + dmond_x];
-					total += 1.0f;
+static void
+Build_heightmap_mesh_rows(void *arg, i32 first_row, i32 last_row) {
+	HeightmapMeshJob *job = (HeightmapMeshJob *)arg;
+	Build_heightmap_rows(job->height_map, job->partitions, first_row, last_row,
+		job->wstep, job->min_height, job->height_scale, job->vertices);
+}
+
+// Fills vertices (partitions*partitions, row major) with the quantized vertices of the height
+// map, the same ones than Terrain_vertex up to the rounding of the normals (1 unit of the
+// octahedral encoding). The rows are splitted in bands built in parallel.
+static void
+Build_heightmap_mesh(const f32 *height_map, i32 partitions, f32 wstep, f32 min_height, f32 height_scale, GFX_TerrainVertex *vertices) {
+	PROFILE_ZONE("Build heightmap mesh");
+	Assert(partitions >= 2, "The height map needs at least 2x2 vertices");
+	HeightmapMeshJob job = {height_map, partitions, wstep, min_height, height_scale, vertices};
+	Jobs_parallel_for(partitions, HEIGHTMAP_BATCH_ROWS, Build_heightmap_mesh_rows, &job);
+}
+
+typedef struct {
+	const f32 *height_map;
+	i32 partitions;
+	f32 wstep;
+	u8 *texels;
+} HeightmapNormalMapJob;
+
+static void
+Bake_heightmap_normal_map_rows(void *arg, i32 first_row, i32 last_row) {
+	HeightmapNormalMapJob *job = (HeightmapNormalMapJob *)arg;
+	const f32 *height_map = job->height_map;
+	i32 partitions = job->partitions;
+	i32 last       = partitions-1;
+	f32 ny         = 2.0f*job->wstep;
+	for (i32 i = first_row; i < last_row; i += 1) {
+		// Same central differences than Build_heightmap_rows
+		const f32 *row   = &height_map[i * partitions];
+		const f32 *above = (i > 0)    ? row - partitions : row;
+		const f32 *below = (i < last) ? row + partitions : row;
+		f32 dz_scale = (i > 0 && i < last) ? 1.0f : 2.0f;
+		u8 *out = &job->texels[i * partitions * 2];
+		for (i32 j = 0; j < partitions; j += 1) {
+			f32 dx;
+			if      (j == 0)    dx = 2.0f*(row[0] - row[1]);
+			else if (j == last) dx = 2.0f*(row[last-1] - row[last]);
+			else                dx = row[j-1] - row[j+1];
+			f32 dz = (above[j] - below[j])*dz_scale;
+			f32 inv_length = 1.0f/Sqrt(dx*dx + ny*ny + dz*dz);
+			out[j*2+0] = (u8)Clamp((dx*inv_length * 0.5f + 0.5f) * 255.0f + 0.5f, 0.0f, 255.0f);
+			out[j*2+1] = (u8)Clamp((dz*inv_length * 0.5f + 0.5f) * 255.0f + 0.5f, 0.0f, 255.0f);
+		}
+	}
+}
+
+// Fills texels (partitions*partitions*2 bytes) with the normal map of the height map for
+// GFX_Set_terrain_normal_map, the rows are splitted in bands baked in parallel
+static void
+Bake_heightmap_normal_map(const f32 *height_map, i32 partitions, f32 wstep, u8 *texels) {
+	PROFILE_ZONE("Bake normal map");
+	Assert(partitions >= 2, "The height map needs at least 2x2 vertices");
+	HeightmapNormalMapJob job = {height_map, partitions, wstep, texels};
+	Jobs_parallel_for(partitions, HEIGHTMAP_BATCH_ROWS, Bake_heightmap_normal_map_rows, &job);
+}
+
+// Number of directions of the horizon sweeps of Bake_heightmap_ao_map, every line is swept
+// both ways: the rows, the columns and the two diagonals
+#define HEIGHTMAP_AO_DIRECTIONS 8
+
+typedef struct {
+	const f32 *height_map;
+	i32 partitions;
+	f32 wstep;
+	i32 di, dj;      // Step of the lines on the grid
+	f32 *occlusion;  // Sum of the sines of the horizons
+	u8  *texels;
+} HeightmapAoJob;
+
+// Adds to occlusion the sine of the elevation of the horizon of every point of the line looking
+// back. The points that can be the horizon of the next ones are the upper convex hull of the
+// points already swept, so every point is pushed and popped once.
+static void
+Horizon_sweep(const f32 *heights, const i32 *indices, i32 count, bool backwards, f32 step, f32 *occlusion, i32 *hull) {
+	i32 hull_count = 0;
+	for (i32 k = 0; k < count; k += 1) {
+		i32 t = backwards ? count-1-k : k;
+		f32 h = heights[t];
+		// Pop the top while it's under the line from the point to the next one of the hull
+		while (hull_count >= 2) {
+			i32 a = hull[hull_count-1];
+			i32 b = hull[hull_count-2];
+			f32 slope_a = (heights[backwards ? count-1-a : a] - h) / (f32)(k-a);
+			f32 slope_b = (heights[backwards ? count-1-b : b] - h) / (f32)(k-b);
+			if (slope_b < slope_a) break;
+			hull_count -= 1;
+		}
+		if (hull_count > 0) {
+			i32 a = hull[hull_count-1];
+			f32 slope = (heights[backwards ? count-1-a : a] - h) / ((f32)(k-a)*step);
+			if (slope > 0.0f) occlusion[indices[t]] += slope / Sqrt(1.0f + slope*slope);
+		}
+		hull[hull_count] = k;
+		hull_count += 1;
+	}
+}
+
+static void
+Bake_heightmap_ao_lines(void *arg, i32 first_line, i32 last_line) {
+	HeightmapAoJob *job = (HeightmapAoJob *)arg;
+	i32 partitions = job->partitions;
+	i32 last = partitions-1;
+	f32 heights[TERRAIN_MAX_PARTITIONS];
+	i32 indices[TERRAIN_MAX_PARTITIONS];
+	i32 hull[TERRAIN_MAX_PARTITIONS];
+	f32 step = (job->di != 0 && job->dj != 0) ? job->wstep*1.41421356f : job->wstep;
+	for (i32 line = first_line; line < last_line; line += 1) {
+		// The diagonals are numbered from a corner to the other, 2*partitions-1 lines
+		i32 i, j, count;
+		if (job->di == 0)       { i = line; j = 0;    count = partitions; }
+		else if (job->dj == 0)  { i = 0;    j = line; count = partitions; }
+		else {
+			i     = Max(0, line-last);
+			j     = (job->dj > 0) ? Max(0, last-line) : Min(last, line);
+			count = partitions - Abs(line-last);
+		}
+		for (i32 k = 0; k < count; k += 1) {
+			indices[k] = (i + k*job->di) * partitions + j + k*job->dj;
+			heights[k] = job->height_map[indices[k]];
+		}
+		Horizon_sweep(heights, indices, count, false, step, job->occlusion, hull);
+		Horizon_sweep(heights, indices, count, true, step, job->occlusion, hull);
+	}
+}
+
+static void
+Bake_heightmap_ao_rows(void *arg, i32 first_row, i32 last_row) {
+	HeightmapAoJob *job = (HeightmapAoJob *)arg;
+	i32 partitions = job->partitions;
+	for (i32 index = first_row*partitions; index < last_row*partitions; index += 1) {
+		f32 ao = 1.0f - job->occlusion[index]/(f32)HEIGHTMAP_AO_DIRECTIONS;
+		job->texels[index] = (u8)Clamp(ao*255.0f + 0.5f, 0.0f, 255.0f);
+	}
+}
+
+// Fills texels (partitions*partitions bytes) with the ambient occlusion of the height map for
+// GFX_Set_terrain_ao_map: one minus the average of the sines of the horizons in 8 directions.
+// The horizons are found with a sweep per line that is linear on the length, the lines of every
+// direction are splitted in bands swept in parallel.
+static void
+Bake_heightmap_ao_map(const f32 *height_map, i32 partitions, f32 wstep, u8 *texels) {
+	PROFILE_ZONE("Bake AO map");
+	Assert(partitions >= 2 && partitions <= TERRAIN_MAX_PARTITIONS, "Wrong height map size");
+	static f32 occlusion[TERRAIN_MAX_PARTITIONS*TERRAIN_MAX_PARTITIONS];
+	memset(occlusion, 0, partitions*partitions*sizeof(f32));
+
+	HeightmapAoJob job = {height_map, partitions, wstep, 0, 0, occlusion, texels};
+	// Rows, columns, diagonals and antidiagonals. The lines of a direction don't share points
+	i32 directions[4][2] = {{0, 1}, {1, 0}, {1, 1}, {1, -1}};
+	for (i32 d = 0; d < 4; d += 1) {
+		job.di = directions[d][0];
+		job.dj = directions[d][1];
+		i32 lines = (job.di != 0 && job.dj != 0) ? 2*partitions-1 : partitions;
+		Jobs_parallel_for(lines, HEIGHTMAP_BATCH_ROWS, Bake_heightmap_ao_lines, &job);
+	}
+	Jobs_parallel_for(partitions, HEIGHTMAP_BATCH_ROWS, Bake_heightmap_ao_rows, &job);
+}
+
+// Returns the index of the vertex (row, col) of a chunk, the vertices of the edges marked
+// on stitch_mask that don't exist in the next coarser LOD are collapsed with the previous
+// vertex of the edge so the edge matches the neighbor chunk and there are no cracks.
+static u16
+Terrain_lod_index(i32 row, i32 col, i32 chunk_quads, i32 step, u32 stitch_mask) {
+	if ((stitch_mask & TERRAIN_EDGE_TOP)    && row == 0           && ((col/step) & 1)) col -= step;
+	if ((stitch_mask & TERRAIN_EDGE_BOTTOM) && row == chunk_quads && ((col/step) & 1)) col -= step;
+	if ((stitch_mask & TERRAIN_EDGE_LEFT)   && col == 0           && ((row/step) & 1)) row -= step;
+	if ((stitch_mask & TERRAIN_EDGE_RIGHT)  && col == chunk_quads && ((row/step) & 1)) row -= step;
+	return (u16)(row*(chunk_quads+1) + col);
+}
+
+// Builds the indices of every LOD and stitching combination for chunks of chunk_quads quads
+static void
+Terrain_build_lod_indices(i32 chunk_quads) {
+	terrain_chunk_quads = chunk_quads;
+	terrain_lods_count  = 1;
+	while ((1 << terrain_lods_count) <= chunk_quads) terrain_lods_count += 1;
+	Assert(terrain_lods_count <= TERRAIN_MAX_LODS, "Too much LODs");
+
+	GFX_Clear_buffer_data(&terrain_lod_indices);
+	u32 row_pitch = chunk_quads+1;
+	for (i32 lod = 0; lod < terrain_lods_count; lod += 1) {
+		i32 step  = 1 << lod;
+		i32 cells = chunk_quads/step;
+		for (u32 mask = 0; mask < 16; mask += 1) {
+			// The last LOD has no coarser neighbors
+			u32 stitch_mask = (lod == terrain_lods_count-1) ? 0 : mask;
+
+			u32 first = terrain_lod_indices.indices_count;
+			u16 *indices = GFX_Alloc_indices(&terrain_lod_indices, cells*cells*6);
+			Assert(indices, "Too much LOD indices");
+			u32 count = GFX_Make_grid_indices(indices, GFX_BUFFER_INDEX_TYPE_16, cells, cells, step, row_pitch, GFX_VERTEX_CACHE_SIZE);
+
+			// Stitch in place keeping the order and skipping the triangles collapsed by the stitching
+			u32 written = 0;
+			for (u32 i = 0; i < count; i += 3) {
+				u16 tri[3];
+				for (int k = 0; k < 3; k += 1) {
+					tri[k] = Terrain_lod_index(indices[i+k] / row_pitch, indices[i+k] % row_pitch, chunk_quads, step, stitch_mask);
 				}
-				if (x_0 >= 0) {
-					mean += height_map[dmond_y * partitions + x_0];
-					total += 1.0f;
+				if (tri[0] == tri[1] || tri[1] == tri[2] || tri[2] == tri[0]) continue;
+				indices[written+0] = tri[0];
+				indices[written+1] = tri[1];
+				indices[written+2] = tri[2];
+				written += 3;
+			}
+			terrain_lod_indices.indices_count = first + written;
+
+			terrain_lod_ranges[lod][mask].first = first;
+			terrain_lod_ranges[lod][mask].count = written;
+		}
+	}
+
+	// Compare the order of the full resolution LOD with the plain row by row order
+	static u16 row_order[TERRAIN_CHUNK_INDICES];
+	u32 row_order_count = GFX_Make_grid_indices(row_order, GFX_BUFFER_INDEX_TYPE_16, chunk_quads, chunk_quads, 1, row_pitch, 0);
+	terrain_acmr_rows  = GFX_Compute_acmr(row_order, GFX_BUFFER_INDEX_TYPE_16, row_order_count, GFX_VERTEX_CACHE_SIZE);
+	terrain_acmr_bands = GFX_Compute_acmr(&terrain_lod_indices_mem[terrain_lod_ranges[0][0].first], GFX_BUFFER_INDEX_TYPE_16,
+	                                      terrain_lod_ranges[0][0].count, GFX_VERTEX_CACHE_SIZE);
+
+	GFX_Upload_buffer_to_gpu(&terrain_lod_indices);
+}
+
+// Max vertical distance between the heightmap and the triangles of the LOD with the given step
+static f32
+Terrain_lod_error(f32 *height_map, i32 partitions, i32 first_row, i32 first_col, i32 chunk_quads, i32 step) {
+	f32 error = 0.0f;
+	f32 inv_step = 1.0f/(f32)step;
+	for (i32 row = first_row; row < first_row+chunk_quads; row += step) {
+		for (i32 col = first_col; col < first_col+chunk_quads; col += step) {
+			f32 ha = height_map[row * partitions + col];
+			f32 hb = height_map[(row+step) * partitions + col];
+			f32 hc = height_map[(row+step) * partitions + col+step];
+			f32 hd = height_map[row * partitions + col+step];
+			for (i32 v = 0; v <= step; v += 1) {
+				for (i32 u = 0; u <= step; u += 1) {
+					f32 fu = (f32)u*inv_step;
+					f32 fv = (f32)v*inv_step;
+					f32 interpolated;
+					if (v >= u) interpolated = ha + fv*(hb-ha) + fu*(hc-hb); // Triangle a, b, c
+					else        interpolated = ha + fu*(hd-ha) + fv*(hc-hd); // Triangle a, c, d
+					f32 diff = Abs(height_map[(row+v) * partitions + col+u] - interpolated);
+					error = Max(error, diff);
 				}
-				if (x_1 < partitions) {
-					mean += height_map[dmond_y * partitions + x_1];
-					total += 1.0f;
+			}
+		}
+	}
+	return error;
+}
+
+// Fills and uploads terrain_chunks with the height map. The vertices are quantized to the
+// grid and the heights to u16 between min_height and max_height, see GFX_TerrainVertex.
+static void
+Fractal_terrain_3d_build_chunks(f32 *height_map, i32 partitions, f32 width, f32 length, f32 min_height, f32 max_height) {
+	PROFILE_ZONE("Build chunks");
+	i32 quads       = partitions-1;
+	i32 chunk_quads = Min(TERRAIN_CHUNK_QUADS, quads);
+	i32 chunks_side = quads / chunk_quads;
+	f32 wstep       = width/(f32)quads;
+	f32 lstep       = length/(f32)quads;
+
+	if (chunk_quads != terrain_chunk_quads) Terrain_build_lod_indices(chunk_quads);
+
+	f32 total_height = max_height-min_height;
+	if (total_height <= 0.0f) total_height = 1.0f;
+	f32 height_scale = 65535.0f/total_height;
+
+	GFX_Set_terrain_quantization(
+		V3(wstep, total_height/65535.0f, lstep),
+		V3(-0.5f*width, min_height, -0.5f*length),
+		V2(1.0f/(f32)quads, 1.0f/(f32)quads));
+
+	terrain_chunks_side  = chunks_side;
+	terrain_chunks_count = chunks_side*chunks_side;
+	Assert(terrain_chunks_count <= TERRAIN_MAX_CHUNKS, "Too much terrain chunks");
+	Assert(partitions <= TERRAIN_MAX_PARTITIONS, "Too much partitions");
+
+	Build_heightmap_mesh(height_map, partitions, wstep, min_height, height_scale, terrain_grid_vertices);
+
+	for (i32 chunk_z = 0; chunk_z < chunks_side; chunk_z += 1) {
+		for (i32 chunk_x = 0; chunk_x < chunks_side; chunk_x += 1) {
+			GFX_Buffer   *chunk = &terrain_chunks[chunk_z*chunks_side+chunk_x];
+			TerrainChunk *info  = &terrain_chunks_info[chunk_z*chunks_side+chunk_x];
+			GFX_Clear_buffer_data(chunk);
+
+			i32 chunk_verts = chunk_quads+1;
+			GFX_TerrainVertex *vertices = GFX_Alloc_terrain_vertices(chunk, chunk_verts*chunk_verts, NULL);
+			Assert(vertices, "Too much vertices");
+
+			i32 first_row = chunk_z*chunk_quads;
+			i32 first_col = chunk_x*chunk_quads;
+			f32 chunk_min = height_map[first_row * partitions + first_col];
+			f32 chunk_max = chunk_min;
+			for (i32 vi = 0; vi < chunk_verts; vi += 1) {
+				i32 i = first_row+vi;
+				for (i32 vj = 0; vj < chunk_verts; vj += 1) {
+					f32 y = height_map[i * partitions + first_col+vj];
+					chunk_min = Min(chunk_min, y);
+					chunk_max = Max(chunk_max, y);
 				}
-				if (y_1 < partitions) {
-					mean += height_map[y_1 * partitions + dmond_x];
-					total += 1.0f;
+				memcpy(&vertices[vi*chunk_verts], &terrain_grid_vertices[i * partitions + first_col], chunk_verts*sizeof(GFX_TerrainVertex));
+			}
+
+			info->aabb_min = V3(first_col*wstep - 0.5f*width, chunk_min, first_row*lstep - 0.5f*length);
+			info->aabb_max = V3((first_col+chunk_quads)*wstep - 0.5f*width, chunk_max, (first_row+chunk_quads)*lstep - 0.5f*length);
+			info->lod_error[0] = 0.0f;
+			for (i32 lod = 1; lod < terrain_lods_count; lod += 1) {
+				f32 error = Terrain_lod_error(height_map, partitions, first_row, first_col, chunk_quads, 1 << lod);
+				// Keep the errors monotonic so the selection can stop at the first LOD that fails
+				info->lod_error[lod] = Max(error, info->lod_error[lod-1]);
+			}
+
+			GFX_Upload_buffer_to_gpu(chunk);
+		}
+	}
+}
+
+// Returns true if the box is completely outside of one of the planes (a*x + b*y + c*z + d >= 0
+// is inside)
+static bool
+Aabb_outside_frustum(Vec4 planes[6], Vec3 aabb_min, Vec3 aabb_max) {
+	for (int i = 0; i < 6; i += 1) {
+		Vec4 p = planes[i];
+		// Corner of the box more in the direction of the plane normal
+		Vec3 corner;
+		corner.x = (p.x >= 0.0f) ? aabb_max.x : aabb_min.x;
+		corner.y = (p.y >= 0.0f) ? aabb_max.y : aabb_min.y;
+		corner.z = (p.z >= 0.0f) ? aabb_max.z : aabb_min.z;
+		if (p.x*corner.x + p.y*corner.y + p.z*corner.z + p.w < 0.0f) return true;
+	}
+	return false;
+}
+
+// Draws the visible chunks with the coarsest LOD that projects an error smaller than
+// max_pixel_error, returns the number of triangles drawn
+static u32
+Terrain_draw(Mat4 view, Mat4 perspective, f32 max_pixel_error) {
+	PROFILE_ZONE("Terrain draw");
+	Mat4 mvp = M4_Mul(perspective, view);
+
+	// The planes of the frustum in world space (Gribb/Hartmann)
+	Vec4 row0 = V4(mvp.m00, mvp.m01, mvp.m02, mvp.m03);
+	Vec4 row1 = V4(mvp.m10, mvp.m11, mvp.m12, mvp.m13);
+	Vec4 row2 = V4(mvp.m20, mvp.m21, mvp.m22, mvp.m23);
+	Vec4 row3 = V4(mvp.m30, mvp.m31, mvp.m32, mvp.m33);
+	Vec4 planes[6] = {
+		V4_Add(row3, row0), V4_Sub(row3, row0),
+		V4_Add(row3, row1), V4_Sub(row3, row1),
+		V4_Add(row3, row2), V4_Sub(row3, row2),
+	};
+
+	// An error of 1 unit at distance 1 covers this pixels (m11 is the cotangent of fov/2)
+	f32 pixels_per_unit = 0.5f*(f32)APP_Get_window_height()*perspective.m11;
+
+	for (i32 i = 0; i < terrain_chunks_count; i += 1) {
+		TerrainChunk *info = &terrain_chunks_info[i];
+		info->visible = !Aabb_outside_frustum(planes, info->aabb_min, info->aabb_max);
+
+		Vec3 center = V3_Mulf(V3_Add(info->aabb_min, info->aabb_max), 0.5f);
+		f32  radius = 0.5f*V3_Len(V3_Sub(info->aabb_max, info->aabb_min));
+		Vec3 view_center = Mul_v4_m4(V4(center.x, center.y, center.z, 1.0f), view).xyz;
+		f32  dist = Max(V3_Len(view_center) - radius, 0.1f);
+
+		info->lod = 0;
+		for (i32 lod = 1; lod < terrain_lods_count; lod += 1) {
+			if (info->lod_error[lod]*pixels_per_unit/dist > max_pixel_error) break;
+			info->lod = lod;
+		}
+	}
+
+	// The stitching only supports neighbors one LOD coarser, refine the chunks until that is true
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (i32 cz = 0; cz < terrain_chunks_side; cz += 1) {
+			for (i32 cx = 0; cx < terrain_chunks_side; cx += 1) {
+				TerrainChunk *info = &terrain_chunks_info[cz*terrain_chunks_side+cx];
+				i32 min_neighbor_lod = info->lod;
+				if (cz > 0)                     min_neighbor_lod = Min(min_neighbor_lod, terrain_chunks_info[(cz-1)*terrain_chunks_side+cx].lod);
+				if (cx > 0)                     min_neighbor_lod = Min(min_neighbor_lod, terrain_chunks_info[cz*terrain_chunks_side+cx-1].lod);
+				if (cz < terrain_chunks_side-1) min_neighbor_lod = Min(min_neighbor_lod, terrain_chunks_info[(cz+1)*terrain_chunks_side+cx].lod);
+				if (cx < terrain_chunks_side-1) min_neighbor_lod = Min(min_neighbor_lod, terrain_chunks_info[cz*terrain_chunks_side+cx+1].lod);
+				if (info->lod > min_neighbor_lod+1) {
+					info->lod = min_neighbor_lod+1;
+					changed = true;
 				}
-				mean /= total;
-				f32 height =  mean + (f32)(wy2gau(wyrand(&seed)) / 3.0f) * proportional_height;
-				current_max = Max(current_max, height);
-				current_min = Min(current_min, height);
-				height_map[dmond_y * partitions + dmond_x] = height;
 			}
 		}
+	}
 
-		step /= 2;
-		
-		proportional_height *= (1.0f-H);
+	u32 triangles = 0;
+	for (i32 cz = 0; cz < terrain_chunks_side; cz += 1) {
+		for (i32 cx = 0; cx < terrain_chunks_side; cx += 1) {
+			i32 index = cz*terrain_chunks_side+cx;
+			TerrainChunk *info = &terrain_chunks_info[index];
+			if (!info->visible) continue;
+
+			u32 mask = 0;
+			if (cz > 0                     && terrain_chunks_info[index-terrain_chunks_side].lod > info->lod) mask |= TERRAIN_EDGE_TOP;
+			if (cx > 0                     && terrain_chunks_info[index-1].lod > info->lod)                   mask |= TERRAIN_EDGE_LEFT;
+			if (cz < terrain_chunks_side-1 && terrain_chunks_info[index+terrain_chunks_side].lod > info->lod) mask |= TERRAIN_EDGE_BOTTOM;
+			if (cx < terrain_chunks_side-1 && terrain_chunks_info[index+1].lod > info->lod)                   mask |= TERRAIN_EDGE_RIGHT;
+
+			u32 first = terrain_lod_ranges[info->lod][mask].first;
+			u32 count = terrain_lod_ranges[info->lod][mask].count;
+			GFX_Draw_buffer_ex(&terrain_chunks[index], &terrain_lod_indices, first, count);
+			triangles += count/3;
+		}
+	}
+	return triangles;
+}
+
+// Computes the error of the midpoint of the hypotenuse (a, b) of the triangle (a, b, c) after
+// computing the errors of its children. Coordinates are (x = column, y = row).
+static void
+Rtin_compute_errors(f32 *height_map, i32 partitions, i32 ax, i32 ay, i32 bx, i32 by, i32 cx, i32 cy) {
+	i32 mx = (ax + bx) >> 1;
+	i32 my = (ay + by) >> 1;
+	f32 interpolated = (height_map[ay * partitions + ax] + height_map[by * partitions + bx]) * 0.5f;
+	f32 error = Abs(interpolated - height_map[my * partitions + mx]);
+
+	// The legs are the hypotenuses of the children, if they are the diagonal of a cell they have
+	// no midpoint and the children are the last level
+	if (((ax - cx) & 1) == 0 && ((ay - cy) & 1) == 0) {
+		// Split by the midpoint in the triangles (c, a, m) and (b, c, m)
+		Rtin_compute_errors(height_map, partitions, cx, cy, ax, ay, mx, my);
+		Rtin_compute_errors(height_map, partitions, bx, by, cx, cy, mx, my);
+		error = Max(error, rtin_errors[((ay + cy) >> 1) * partitions + ((ax + cx) >> 1)]);
+		error = Max(error, rtin_errors[((by + cy) >> 1) * partitions + ((bx + cx) >> 1)]);
 	}
 
-	if (max) *max = current_max;
-	if (min) *min = current_min;
+	// The hypotenuse is shared with the neighbor triangle
+	rtin_errors[my * partitions + mx] = Max(rtin_errors[my * partitions + mx], error);
 }
 
+// Builds the error hierarchy, partitions must be 2^n+1
+static void
+Rtin_build_errors(f32 *height_map, i32 partitions) {
+	PROFILE_ZONE("RTIN errors");
+	i32 last = partitions-1;
+	memset(rtin_errors, 0, sizeof(f32)*partitions*partitions);
+	if (last < 2) return;
+	Rtin_compute_errors(height_map, partitions, 0, 0, last, last, last, 0);
+	Rtin_compute_errors(height_map, partitions, last, last, 0, 0, 0, last);
+}
+
+typedef struct {
+	f32 *height_map;
+	i32  partitions;
+	f32  max_error;
+	f32  wstep;
+	f32  min_height;
+	f32  height_scale;
+} RtinExtraction;
+
+static u32
+Rtin_emit_vertex(RtinExtraction *ex, i32 x, i32 y) {
+	u32 *index = &rtin_vertex_index[y * ex->partitions + x];
+	if (*index == 0xFFFFFFFF) {
+		GFX_TerrainVertex *v = GFX_Alloc_terrain_vertices(&rtin_buffer, 1, index);
+		Assert(v, "Too much RTIN vertices");
+		*v = Terrain_vertex(ex->height_map, ex->partitions, y, x, ex->wstep, ex->min_height, ex->height_scale);
+	}
+	return *index;
+}
+
+static void
+Rtin_emit_triangles(RtinExtraction *ex, i32 ax, i32 ay, i32 bx, i32 by, i32 cx, i32 cy) {
+	i32 mx = (ax + bx) >> 1;
+	i32 my = (ay + by) >> 1;
+	if (Abs(ax - cx) + Abs(ay - cy) > 1 && rtin_errors[my * ex->partitions + mx] > ex->max_error) {
+		Rtin_emit_triangles(ex, cx, cy, ax, ay, mx, my);
+		Rtin_emit_triangles(ex, bx, by, cx, cy, mx, my);
+	}
+	else {
+		u32 *indices = GFX_Alloc_indices(&rtin_buffer, 3);
+		Assert(indices, "Too much RTIN indices");
+		indices[0] = Rtin_emit_vertex(ex, ax, ay);
+		indices[1] = Rtin_emit_vertex(ex, bx, by);
+		indices[2] = Rtin_emit_vertex(ex, cx, cy);
+	}
+}
 
+// Fills and uploads rtin_buffer with the minimal RTIN mesh whose vertical error is at most
+// max_error, Rtin_build_errors must have been called with the same heightmap
+static void
+Rtin_build_mesh(f32 *height_map, i32 partitions, f32 width, f32 min_height, f32 max_height, f32 max_error) {
+	PROFILE_ZONE("RTIN mesh");
+	i32 last = partitions-1;
+	f32 total_height = max_height-min_height;
+	if (total_height <= 0.0f) total_height = 1.0f;
+
+	RtinExtraction ex;
+	ex.height_map   = height_map;
+	ex.partitions   = partitions;
+	ex.max_error    = max_error;
+	ex.wstep        = width/(f32)last;
+	ex.min_height   = min_height;
+	ex.height_scale = 65535.0f/total_height;
+
+	memset(rtin_vertex_index, 0xFF, sizeof(u32)*partitions*partitions);
+	GFX_Clear_buffer_data(&rtin_buffer);
+	Rtin_emit_triangles(&ex, 0, 0, last, last, last, 0);
+	Rtin_emit_triangles(&ex, last, last, 0, 0, 0, last);
+	GFX_Upload_buffer_to_gpu(&rtin_buffer);
+}
 
 static void
 Fractal_terrain_3d_demo(f32 delta_time) {
@@ -283,6 +1156,17 @@ Fractal_terrain_3d_demo(f32 delta_time) {
 	#define MODE_MIDPOINT_DISPLACEMENT 0
 	#define MODE_NOISE_SYNTHESIS       1
 	static int mode = MODE_MIDPOINT_DISPLACEMENT;
+	static f32 LOD_PIXEL_ERROR = 2.0f;
+	static u32 triangles_drawn = 0;
+	static int use_rtin = 0;
+	static int use_normal_map = 1;
+	static int use_ao_map = 1;
+	static f32 RTIN_MAX_ERROR = 0.01f;
+	static bool should_rebuild_rtin = true;
+	#define MAX_MARKERS 20000
+	static GFX_Instance markers[MAX_MARKERS];
+	static f32 MARKERS = 0;
+	static bool should_rebuild_markers = true;
 
 	{
 		mu_layout_row(&muctx, 2, (int[]) {100, 150}, 0);
@@ -355,6 +1239,32 @@ Fractal_terrain_3d_demo(f32 delta_time) {
 			mu_label(&muctx, partitions_str);
 			
 		}
+
+		mu_layout_row(&muctx, 2, (int[]) {100, 150}, 0);
+		{
+			if (mu_checkbox(&muctx, "RTIN", &use_rtin)) should_rebuild_rtin = true;
+			mu_checkbox(&muctx, "Normal map", &use_normal_map);
+			mu_checkbox(&muctx, "AO map", &use_ao_map);
+			mu_label(&muctx, "");
+			if (use_rtin) {
+				mu_label(&muctx, "RTIN ERROR");
+				if (mu_slider(&muctx, &RTIN_MAX_ERROR, 0.0f, 0.5f)) should_rebuild_rtin = true;
+			}
+			else {
+				mu_label(&muctx, "LOD ERROR (px)");
+				mu_slider(&muctx, &LOD_PIXEL_ERROR, 0.0f, 16.0f);
+			}
+			mu_label(&muctx, "MARKERS");
+			if (mu_slider(&muctx, &MARKERS, 0, MAX_MARKERS)) should_rebuild_markers = true;
+			static char triangles_str[32] = "";
+			snprintf(triangles_str, sizeof(triangles_str), "%u", triangles_drawn);
+			mu_label(&muctx, "TRIANGLES");
+			mu_label(&muctx, triangles_str);
+			static char acmr_str[32] = "";
+			snprintf(acmr_str, sizeof(acmr_str), "%.2f -> %.2f", terrain_acmr_rows, terrain_acmr_bands);
+			mu_label(&muctx, "ACMR");
+			mu_label(&muctx, acmr_str);
+		}
 	}
 	
 	static bool mouse_dragging = false;
@@ -444,6 +1354,7 @@ Fractal_terrain_3d_demo(f32 delta_time) {
 
 	static f32 max_height, min_height;
 	if (should_recompute) {
+		PROFILE_ZONE("Recompute terrain");
 
 		should_recompute = false;
 		if (mode == MODE_MIDPOINT_DISPLACEMENT) {
@@ -474,101 +1385,57 @@ Fractal_terrain_3d_demo(f32 delta_time) {
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE); // On webgl we need a pow
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE); // of 2 texture or set this
     	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, PARTITIONS, PARTITIONS, 0, GL_RGBA, GL_UNSIGNED_BYTE, height_map_texture_data);
+		GFX_Count_upload(PARTITIONS*PARTITIONS*4);
 
-		GFX_Clear_buffer_data(&height_map_buffer);
-		GFX_Vertex *vertices = GFX_Alloc_vertices(&height_map_buffer, PARTITIONS*PARTITIONS, NULL);
-		Assert(vertices,"Too much vertices");
-		u32 *indices = GFX_Alloc_indices(&height_map_buffer, (PARTITIONS-1)*(PARTITIONS-1)*6);
-		Assert(indices,"Too much indices");
-
-		f32 step = 1.0f/(f32)(PARTITIONS-1.0f);
-		f32 wstep = WIDTH/(f32)(PARTITIONS-1.0f);
-		f32 z = 0.0f;
-		for (int i = 0; i < PARTITIONS; i+=1) {
-			f32 x = 0.0f;
-			for (int j = 0; j < PARTITIONS; j+=1) {
-				f32 y = height_map[i * PARTITIONS + j];
-				Vec3 pos = V3((x - 0.5f)*WIDTH, y, (z - 0.5f)*LENGTH);
-				bool has_neigh0 = (i > 0);
-				bool has_neigh1 = (j > 0);
-				bool has_neigh2 = (i < (PARTITIONS-1));
-				bool has_neigh3 = (j < (PARTITIONS-1));
-				Vec3 neigh0, neigh1, neigh2, neigh3;
-				if (has_neigh0) {
-					f32 neigh0_y = height_map[(i-1) * PARTITIONS + j] - y;
-					neigh0 = V3(0.0f, neigh0_y, -wstep);
-				}
-				if (has_neigh1) {
-					f32 neigh1_y = height_map[i * PARTITIONS + j - 1] - y;
-					neigh1 = V3(-wstep, neigh1_y, 0.0f);
-				}
-				if (has_neigh2) {
-					f32 neigh2_y = height_map[(i+1) * PARTITIONS + j] - y;
-					neigh2 = V3(0.0f, neigh2_y, wstep);
-				}
-				if (has_neigh3) {
-					f32 neigh3_y = height_map[i * PARTITIONS + j + 1] - y;
-					neigh3 = V3(wstep, neigh3_y, 0.0f);
-				}
+		Fractal_terrain_3d_build_chunks(height_map, PARTITIONS, WIDTH, LENGTH, min_height, max_height);
 
-				Vec3 normal_acum = V3(0, 0, 0);
-				f32 normal_total = 0.0f;
-				if (has_neigh0 && has_neigh1) {
-					normal_acum = V3_Add(normal_acum, V3_Cross(neigh0, neigh1));
-					normal_total += 1.0f;
-				}
-				if (has_neigh1 && has_neigh2) {
-					normal_acum = V3_Add(normal_acum, V3_Cross(neigh1, neigh2));
-					normal_total += 1.0f;
-				}
-				if (has_neigh2 && has_neigh3) {
-					normal_acum = V3_Add(normal_acum, V3_Cross(neigh2, neigh3));
-					normal_total += 1.0f;
-				}
-				if (has_neigh3 && has_neigh0) {
-					normal_acum = V3_Add(normal_acum, V3_Cross(neigh3, neigh0));
-					normal_total += 1.0f;
-				}
-
-				normal_acum = V3_Normalize(V3_Mulf(normal_acum, 1.0f/normal_total));
-				normal_acum.y = -normal_acum.y;
-
-				Vec2 uv = V2(x, z);
-				Color normal = V4_To_Color((Vec4){.xyz=normal_acum});
-
-				vertices[i*PARTITIONS+j].position  = pos;
-				vertices[i*PARTITIONS+j].normal    = normal;
-				vertices[i*PARTITIONS+j].tex_coord = uv;
-				vertices[i*PARTITIONS+j].color     = WHITE;
-
-				x += step;
-			}
+		Bake_heightmap_normal_map(height_map, PARTITIONS, WIDTH/(f32)(PARTITIONS-1), terrain_normal_map_texels);
+		glBindTexture(GL_TEXTURE_2D, terrain_normal_map);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 2); // The rows are 2*PARTITIONS bytes
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE_ALPHA, PARTITIONS, PARTITIONS, 0, GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE, terrain_normal_map_texels);
+		GFX_Count_upload(PARTITIONS*PARTITIONS*2);
+
+		Bake_heightmap_ao_map(height_map, PARTITIONS, WIDTH/(f32)(PARTITIONS-1), terrain_ao_map_texels);
+		glBindTexture(GL_TEXTURE_2D, terrain_ao_map);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // The rows are PARTITIONS bytes
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, PARTITIONS, PARTITIONS, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, terrain_ao_map_texels);
+		GFX_Count_upload(PARTITIONS*PARTITIONS);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		Rtin_build_errors(height_map, PARTITIONS);
+		should_rebuild_rtin = true;
+		should_rebuild_markers = true;
+	}
 
-			z += step;
-		}
-		
-		u32 indices_pushed = 0;
-		for (int i = 1; i < PARTITIONS; i+=1) {
-			for (int j = 1; j < PARTITIONS; j+=1) {
-				u32 index0 = (i-1) * PARTITIONS + j-1;
-				u32 index1 = (i) * PARTITIONS + j-1;
-				u32 index2 = (i) * PARTITIONS + j;
-				u32 index3 = (i-1) * PARTITIONS + j;
-				indices[indices_pushed+0] = index0;
-				indices[indices_pushed+1] = index1;
-				indices[indices_pushed+2] = index2;
-				indices[indices_pushed+3] = index0;
-				indices[indices_pushed+4] = index2;
-				indices[indices_pushed+5] = index3;
-				indices_pushed += 6;
-			}
+	// Scatters small cubes over the terrain, all of them drawn with one instanced draw call
+	u32 markers_count = (u32)MARKERS;
+	if (should_rebuild_markers) {
+		PROFILE_ZONE("Scatter markers");
+		should_rebuild_markers = false;
+		u64 marker_seed = (u64)SEED;
+		f32 wstep = WIDTH/(f32)(PARTITIONS-1);
+		f32 lstep = LENGTH/(f32)(PARTITIONS-1);
+		f32 size  = 0.01f*WIDTH;
+		for (u32 i = 0; i < markers_count; i += 1) {
+			i32 row = (i32)(wy2u01(wyrand(&marker_seed)) * (PARTITIONS-1));
+			i32 col = (i32)(wy2u01(wyrand(&marker_seed)) * (PARTITIONS-1));
+			f32 height = height_map[row*PARTITIONS+col];
+			Vec3 pos = V3(col*wstep - 0.5f*WIDTH, height + 0.5f*size, row*lstep - 0.5f*LENGTH);
+			u8 red = (u8)(wyrand(&marker_seed) & 0xFF);
+			markers[i] = GFX_Make_instance(pos, V3(size, size, size), COLOR(255, red, 0, 255));
 		}
-
-		GFX_Upload_buffer_to_gpu(&height_map_buffer);
-
 	}
 	
 
+	// The 2D draws queued before must be drawn without the depth test and before the clear
+	GFX_Flush();
 	glEnable(GL_DEPTH_TEST);
 	glDepthFunc(GL_LESS);
 	glDepthMask(GL_TRUE);
@@ -578,6 +1445,7 @@ Fractal_terrain_3d_demo(f32 delta_time) {
 
 	if (rotation_playing && !mouse_dragging) {
 		rotate_y = Mod(rotate_y+60.0f*delta_time, 360.0f);
+		frame_animating = true;
 	}
 	rotate = M4_Diagonal(1.0f);
 
@@ -592,10 +1460,29 @@ Fractal_terrain_3d_demo(f32 delta_time) {
 	Vec3 light_dir   = Mul_v4_m4(V4(0, 0, -1, 0), M4_Transpose(tmat)).xyz;
 	tmat             = M4_Mul(translate, tmat);
 
+	GFX_Begin_pass("Terrain");
 	GFX_Set_matrix(M4_Mul(perspective, tmat));
 	GFX_Set_light_dir(light_dir);
 	GFX_Set_texture(terrain_texture);
-	GFX_Draw_buffer(&height_map_buffer);
+	GFX_Set_terrain_normal_map(use_normal_map ? terrain_normal_map : 0, PARTITIONS, PARTITIONS);
+	GFX_Set_terrain_ao_map(use_ao_map ? terrain_ao_map : 0, PARTITIONS, PARTITIONS);
+	if (use_rtin) {
+		if (should_rebuild_rtin) {
+			should_rebuild_rtin = false;
+			Rtin_build_mesh(height_map, PARTITIONS, WIDTH, min_height, max_height, RTIN_MAX_ERROR);
+		}
+		GFX_Draw_buffer(&rtin_buffer);
+		triangles_drawn = rtin_buffer.indices_count/3;
+	}
+	else {
+		triangles_drawn = Terrain_draw(tmat, perspective, LOD_PIXEL_ERROR);
+	}
+	if (markers_count > 0) {
+		GFX_Set_texture(GFX_Default_texture());
+		GFX_Draw_instances(GFX_MESH_CUBE, markers, markers_count);
+	}
+	GFX_End_pass();
+	// GFX_End_pass doesn't flush when the pass wasn't timed, the 3D draws need the depth test
 	GFX_Flush();
 	glDisable(GL_DEPTH_TEST);
 	glDisable(GL_CULL_FACE);
@@ -731,6 +1618,7 @@ Fractal_terrain_2d_demo(f32 delta_time) {
 	#define ZOOM_RECT_VANISH_TIME 0.5f
 	static f32 zoom_rect_vanish_current_time = 0.0f;
 	static bool should_draw_zoom_rect = false;
+	static f32 segments_per_second = 0.0f;
 
 
 	{ // GUI options
@@ -782,6 +1670,33 @@ Fractal_terrain_2d_demo(f32 delta_time) {
 			mu_label(&muctx, partitions_str);
 			
 		}
+
+		// Batch benchmark, with many partitions the segments per second grow with the batch size
+		// because there are less flushes
+		{
+			static i32 BATCH_POW = 18; // GFX_DEFAULT_BATCH_VERTICES
+			static f32 batch_pow_f32;
+			batch_pow_f32 = BATCH_POW;
+			mu_label(&muctx, "BATCH");
+			if (mu_slider_ex(&muctx, &batch_pow_f32, 12, 22, 1, "", MU_OPT_ALIGNCENTER)) {
+				BATCH_POW = (i32)batch_pow_f32;
+				GFX_Set_batch_size(1u << BATCH_POW);
+			}
+			static char batch_str[12] = "";
+			snprintf(batch_str, sizeof(batch_str), "%uK", GFX_Get_batch_size()/1024);
+			mu_label(&muctx, batch_str);
+		}
+		mu_layout_row(&muctx, 2, (int[]) {100, 150}, 0);
+		{
+			static char flushes_str[32] = "";
+			snprintf(flushes_str, sizeof(flushes_str), "%u x %.1f KB", GFX_Get_flush_count(), (f32)GFX_Get_bytes_per_flush()/1024.0f);
+			mu_label(&muctx, "FLUSHES");
+			mu_label(&muctx, flushes_str);
+			static char throughput_str[32] = "";
+			snprintf(throughput_str, sizeof(throughput_str), "%.2f M/s", segments_per_second*1e-6f);
+			mu_label(&muctx, "SEGMENTS");
+			mu_label(&muctx, throughput_str);
+		}
 	}
 
 	static CanvasCam canvas_cam = {
@@ -869,10 +1784,14 @@ Fractal_terrain_2d_demo(f32 delta_time) {
 			zoom_rect_color = Color_lerp(zoom_rect_color_default, end_color, t);
 		}
 	}
+	if (canvas_cam.aim_time > 0.0f || (should_draw_zoom_rect && zoom_rect_vanish_current_time > 0.0f)) {
+		frame_animating = true;
+	}
 
 
 
 	{ // Calculate the height map
+		PROFILE_ZONE("Midpoint displacement");
 
 		u64 rand_seed = (u64)SEED;
 
@@ -923,6 +1842,9 @@ Fractal_terrain_2d_demo(f32 delta_time) {
 
 	GFX_Set_texture(GFX_Default_texture());
 	{	
+		// The flush is timed too, it includes the upload and submission of the last batch
+		GFX_Begin_pass("Profile");
+		int64_t draw_start = APP_Time();
 		f32 x_center = -LINE_LENGTH*0.5f;
 		Vec2 p0 = V2(x_center, height_map[0]);
 		for (int i = 1; i < PARTITIONS; i+=1) {
@@ -931,6 +1853,10 @@ Fractal_terrain_2d_demo(f32 delta_time) {
 			GFX_Draw_line(p0, p1, THICKNESS/canvas_cam.zoom, BLACK);
 			p0 = p1;
 		}
+		GFX_Flush();
+		f32 draw_seconds = (f32)(APP_Time() - draw_start)*1e-9f;
+		if (draw_seconds > 0.0f) segments_per_second = (f32)(PARTITIONS-1)/draw_seconds;
+		GFX_End_pass();
 	}
 
 	if (should_draw_zoom_rect) {
@@ -955,11 +1881,25 @@ App_frame(void) {
 	
 	static int mode = MODE_2D;
 
-	if (APP_Quit_requested()) {
+	// Writes the last zones recorded by PROFILE_ZONE, needs -DPROFILE_ENABLED
+	if (APP_Is_key_pressed(APP_KEY_F12)) {
+		if (0 == Profile_dump_trace("trace.json")) printf("Trace written to trace.json\n");
+		else fprintf(stderr, "Couldn't write trace.json, is PROFILE_ENABLED defined?\n");
+	}
+
+	static int frames_run = 0;
+	frames_run += 1;
+	if (APP_Quit_requested() || frames_run == frames_to_run) {
+		if (frame_stats_path && 0 != APP_Dump_frame_stats(frame_stats_path)) {
+			fprintf(stderr, "Couldn't write %s\n", frame_stats_path);
+		}
+		if (capture_path) printf("%u frames captured\n", Capture_stop());
+		Jobs_deinit();
 		GFX_Deinit();
 		APP_Destroy_window();
 		return 1;
 	}
+	frame_animating = false;
 
 	glViewport(0, 0, APP_Get_window_width(), APP_Get_window_height());
 	Vec4 c = Color_to_Vec4(RAYWHITE);
@@ -988,6 +1928,60 @@ App_frame(void) {
 				fps_acum = 0.0f;
 			}
 			mu_label(&muctx, fps_str);
+
+			mu_layout_row(&muctx, 1, (int[]) {250}, 0);
+			APP_FrameStats stats = APP_Get_frame_stats();
+			static char percentiles_str[64];
+			snprintf(percentiles_str, sizeof(percentiles_str), "p50 %.1f p95 %.1f p99 %.1f max %.1f ms",
+					stats.p50*1e-6, stats.p95*1e-6, stats.p99*1e-6, stats.max*1e-6);
+			mu_label(&muctx, percentiles_str);
+			static char budget_str[48];
+			snprintf(budget_str, sizeof(budget_str), "Over budget: %llu of %llu",
+					(unsigned long long)stats.frames_over_budget, (unsigned long long)stats.frames);
+			mu_label(&muctx, budget_str);
+
+			// Sparkline of the last frames, the newest on the right. The bars go up to twice the
+			// budget, the line is the budget and the frames over it are red.
+			mu_layout_row(&muctx, 1, (int[]) {250}, 30);
+			mu_Rect spark = mu_layout_next(&muctx);
+			mu_draw_rect(&muctx, spark, mu_color(0, 0, 0, 80));
+			int64_t durations[APP_MAX_FRAME_DURATIONS];
+			int durations_count = APP_Get_frame_durations(durations, Min(spark.w, APP_MAX_FRAME_DURATIONS));
+			int64_t budget = APP_Get_frame_budget();
+			f64 spark_max = 2.0*(f64)budget;
+			for (int i = 0; i < durations_count; i += 1) {
+				f64 t = Min((f64)durations[i]/spark_max, 1.0);
+				int h = Max((int)(t*spark.h), 1);
+				mu_Color color = (durations[i] > budget) ? mu_color(230, 40, 40, 255) : mu_color(60, 200, 90, 255);
+				mu_draw_rect(&muctx, mu_rect(spark.x + spark.w - 1 - i, spark.y + spark.h - h, 1, h), color);
+			}
+			mu_draw_rect(&muctx, mu_rect(spark.x, spark.y + spark.h/2, spark.w, 1), mu_color(255, 255, 255, 120));
+			mu_layout_row(&muctx, 1, (int[]) {250}, 0);
+			static char streamed_str[32];
+			snprintf(streamed_str, sizeof(streamed_str), "Streamed: %.1f KB", (f32)GFX_Get_bytes_streamed()/1024.0f);
+			mu_label(&muctx, streamed_str);
+			GFX_FrameStats gfx_stats = GFX_Get_frame_stats();
+			static char draws_str[64];
+			snprintf(draws_str, sizeof(draws_str), "Draws: %u Flushes: %u (%u full)", gfx_stats.draw_calls,
+					GFX_Get_flush_count(), gfx_stats.flushes[GFX_FLUSH_BATCH_FULL] + gfx_stats.flushes[GFX_FLUSH_QUEUE_FULL]);
+			mu_label(&muctx, draws_str);
+			static char binds_str[64];
+			snprintf(binds_str, sizeof(binds_str), "Binds: %u Uploaded: %.1f KB", gfx_stats.texture_binds,
+					(f32)gfx_stats.bytes_uploaded/1024.0f);
+			mu_label(&muctx, binds_str);
+
+			const GFX_PassTiming *timings;
+			u32 passes = GFX_Get_pass_timings(&timings);
+			for (u32 i = 0; i < passes; i += 1) {
+				static char pass_str[GFX_MAX_PASSES][48];
+				if (timings[i].gpu_ms >= 0.0f) {
+					snprintf(pass_str[i], sizeof(pass_str[i]), "%s: %.2f GPU %.2f CPU ms", timings[i].name, timings[i].gpu_ms, timings[i].cpu_ms);
+				}
+				else {
+					snprintf(pass_str[i], sizeof(pass_str[i]), "%s: %.2f CPU ms", timings[i].name, timings[i].cpu_ms);
+				}
+				mu_label(&muctx, pass_str[i]);
+			}
 		}
 
 		mu_layout_row(&muctx, 2, (int[]) {50, 50}, 0);
@@ -1013,60 +2007,293 @@ App_frame(void) {
 
 	GFX_Set_matrix(M4_Orthographic(0, APP_Get_window_width(), APP_Get_window_height(), 0, 0, 1));
 	GFX_Set_light_dir(V3(0, 0, -1));
+	GFX_Begin_pass("UI");
 	mu_Render(&muctx);
+	GFX_End_pass();
 	GFX_End();
 
+	Capture_frame();
+
+	// The automated runs measure every frame
+	if (!frame_animating && frames_to_run == 0) APP_Idle(-1);
+
+	return 0;
+}
+
+// The terrain texture decoded with its mip chain is cached in this file the first run, the cache
+// is made again when the embedded JPEG changes
+#define TEXTURE_CACHE_PATH  "texture.cache"
+#define TEXTURE_CACHE_MAGIC 0x31584554 // "TEX1"
+
+typedef struct {
+	u32 magic;
+	u32 width;
+	u32 height;
+	u32 source_size; // Of the JPEG
+	u64 source_hash;
+	// The RGBA mip chain goes after, see GFX_Build_mip_chain
+} TextureCacheHeader;
+
+// Makes terrain_texture from the cache, or from texture_jpg making the cache
+static int
+Load_terrain_texture(void) {
+	PROFILE_ZONE("Load terrain texture");
+	u64 source_hash = wyhash(texture_jpg, texture_jpg_len, 0, _wyp);
+
+	u32 cache_size;
+	u8 *cache = APP_Get_file_contentsz(TEXTURE_CACHE_PATH, &cache_size);
+	if (cache) {
+		TextureCacheHeader header;
+		bool valid = cache_size >= sizeof(header);
+		if (valid) {
+			memcpy(&header, cache, sizeof(header));
+			valid = header.magic == TEXTURE_CACHE_MAGIC &&
+			        header.source_size == texture_jpg_len && header.source_hash == source_hash &&
+			        cache_size == sizeof(header) + GFX_Mip_chain_size(header.width, header.height);
+		}
+		if (valid) terrain_texture = GFX_Make_mipmapped_texture(cache + sizeof(header), header.width, header.height);
+		APP_Free_file_contents(cache);
+		if (valid) return 0;
+	}
+
+	int width, height, channels;
+	u8 *image = stbi_load_from_memory(texture_jpg, texture_jpg_len, &width, &height, &channels, STBI_rgb_alpha);
+	if (image == NULL) return -1;
+
+	TextureCacheHeader header = {TEXTURE_CACHE_MAGIC, (u32)width, (u32)height, texture_jpg_len, source_hash};
+	u32 levels_size = GFX_Mip_chain_size(header.width, header.height);
+	u8 *levels = malloc(levels_size);
+	if (levels == NULL) {
+		stbi_image_free(image);
+		return -1;
+	}
+	memcpy(levels, image, width*height*4);
+	stbi_image_free(image);
+	GFX_Build_mip_chain(levels, header.width, header.height);
+	terrain_texture = GFX_Make_mipmapped_texture(levels, header.width, header.height);
+
+	// Without a writable file system (webgl) the cache is just not made
+	FILE *file = fopen(TEXTURE_CACHE_PATH, "wb");
+	if (file) {
+		bool written = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(levels, levels_size, 1, file) == 1;
+		fclose(file);
+		if (!written) remove(TEXTURE_CACHE_PATH);
+	}
+	free(levels);
 	return 0;
 }
 
+// Checks the vertex cache simulation and the banded grid order of GFX_Make_grid_indices on a
+// chunk: the bands must transform less vertices than the rows and be near the 0.5 vertices per
+// triangle of a grid where every vertex is transformed once. Returns 0 if it passes.
+static int
+Check_grid_acmr(void) {
+	static u16 indices[TERRAIN_CHUNK_INDICES];
+	const u32 quads = TERRAIN_CHUNK_QUADS;
+	const f32 MAX_BANDS_ACMR = 0.6f;
+
+	u32 count = GFX_Make_grid_indices(indices, GFX_BUFFER_INDEX_TYPE_16, quads, quads, 1, quads+1, 0);
+	f32 rows  = GFX_Compute_acmr(indices, GFX_BUFFER_INDEX_TYPE_16, count, GFX_VERTEX_CACHE_SIZE);
+	count     = GFX_Make_grid_indices(indices, GFX_BUFFER_INDEX_TYPE_16, quads, quads, 1, quads+1, GFX_VERTEX_CACHE_SIZE);
+	f32 bands = GFX_Compute_acmr(indices, GFX_BUFFER_INDEX_TYPE_16, count, GFX_VERTEX_CACHE_SIZE);
+
+	bool passed = bands < rows && bands <= MAX_BANDS_ACMR;
+	printf("ACMR of %ux%u quads with a cache of %d: rows %.3f, bands %.3f (max %.2f) %s\n",
+	       quads, quads, GFX_VERTEX_CACHE_SIZE, rows, bands, MAX_BANDS_ACMR, passed ? "OK" : "FAILED");
+	return passed ? 0 : 1;
+}
+
+// Packs the triangle i of the indices rotated to start by its smallest index, so the same
+// triangle with the same winding gives the same key in any order
+static u64
+Triangle_key(const u16 *indices, u32 i) {
+	u64 a = indices[i], b = indices[i+1], c = indices[i+2];
+	if (b < a && b < c) return (b << 32) | (c << 16) | a;
+	if (c < a && c < b) return (c << 32) | (a << 16) | b;
+	return (a << 32) | (b << 16) | c;
+}
+
+static int
+Compare_u64(const void *a, const void *b) {
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+	return (x > y) - (x < y);
+}
+
+// Checks that the banded grid order of every LOD of a chunk has the same triangles with the same
+// winding than the rows, and that Build_heightmap_mesh gives the vertices of Terrain_vertex up to
+// 1 unit of the normals. Returns 0 if it passes.
+static int
+Check_terrain_mesh(void) {
+	static u16 rows[TERRAIN_CHUNK_INDICES];
+	static u16 bands[TERRAIN_CHUNK_INDICES];
+	static u64 rows_keys[TERRAIN_CHUNK_INDICES/3];
+	static u64 bands_keys[TERRAIN_CHUNK_INDICES/3];
+	const u32 quads = TERRAIN_CHUNK_QUADS;
+	bool passed = true;
+
+	for (u32 step = 1; step <= quads; step *= 2) {
+		u32 cells = quads/step;
+		u32 rows_count  = GFX_Make_grid_indices(rows, GFX_BUFFER_INDEX_TYPE_16, cells, cells, step, quads+1, 0);
+		u32 bands_count = GFX_Make_grid_indices(bands, GFX_BUFFER_INDEX_TYPE_16, cells, cells, step, quads+1, GFX_VERTEX_CACHE_SIZE);
+		bool same = rows_count == bands_count;
+		if (same) {
+			for (u32 i = 0; i < rows_count; i += 3) {
+				rows_keys[i/3]  = Triangle_key(rows, i);
+				bands_keys[i/3] = Triangle_key(bands, i);
+			}
+			qsort(rows_keys, rows_count/3, sizeof(u64), Compare_u64);
+			qsort(bands_keys, bands_count/3, sizeof(u64), Compare_u64);
+			same = memcmp(rows_keys, bands_keys, rows_count/3*sizeof(u64)) == 0;
+		}
+		printf("Triangles of the bands with step %3u: %s\n", step, same ? "OK" : "FAILED");
+		passed = passed && same;
+	}
+
+	static f32 height_map[TERRAIN_MAX_PARTITIONS*TERRAIN_MAX_PARTITIONS];
+	Jobs_init(-1);
+	for (i32 partitions = 3; partitions <= TERRAIN_MAX_PARTITIONS; partitions = (partitions-1)*2+1) {
+		f32 max_height, min_height;
+		f32 wstep = 1.0f/(f32)(partitions-1);
+		Fractal_terrain_3d_square_diamond(height_map, partitions, 1.0f, 0.5f, 1234, &max_height, &min_height);
+		f32 height_scale = 65535.0f/(max_height-min_height);
+		Build_heightmap_mesh(height_map, partitions, wstep, min_height, height_scale, terrain_grid_vertices);
+
+		u32 wrong_vertices = 0;
+		u32 rounded_normals = 0;
+		for (i32 i = 0; i < partitions; i += 1) {
+			for (i32 j = 0; j < partitions; j += 1) {
+				GFX_TerrainVertex expected = Terrain_vertex(height_map, partitions, i, j, wstep, min_height, height_scale);
+				GFX_TerrainVertex built = terrain_grid_vertices[i*partitions+j];
+				if (built.grid_x != expected.grid_x || built.grid_z != expected.grid_z || built.height != expected.height ||
+				    Abs((i32)built.normal[0] - (i32)expected.normal[0]) > 1 ||
+				    Abs((i32)built.normal[1] - (i32)expected.normal[1]) > 1) {
+					wrong_vertices += 1;
+				}
+				else if (memcmp(built.normal, expected.normal, 2) != 0) {
+					rounded_normals += 1;
+				}
+			}
+		}
+		printf("Vertices of %4d partitions: %u wrong, %u normals rounded other way %s\n",
+		       partitions, wrong_vertices, rounded_normals, wrong_vertices == 0 ? "OK" : "FAILED");
+		passed = passed && wrong_vertices == 0;
+	}
+	Jobs_deinit();
+	return passed ? 0 : 1;
+}
+
+// Times the generators of the 3D terrain at the maximum size with 1 to one thread per CPU,
+// the runs of every count are averaged
+static void
+Bench_generators(void) {
+	static f32 height_map[TERRAIN_MAX_PARTITIONS*TERRAIN_MAX_PARTITIONS];
+	const i32 partitions = TERRAIN_MAX_PARTITIONS;
+	const i32 runs = 4;
+	const f32 wstep = 1.0f/(f32)(partitions-1);
+
+	printf("threads  noise(ms)  square-diamond(ms)  mesh(ms)  normals(ms)  ao(ms)\n");
+	for (i32 workers = 0; workers < Max(Thread_count_cpus(), 1); workers += 1) {
+		Jobs_init(workers);
+		f64 times[5] = {0};
+		for (i32 run = 0; run < runs; run += 1) {
+			f32 max_height, min_height;
+			int64_t start = APP_Time();
+			Fractal_terrain_3d_noise_synthesis(height_map, partitions, 8.0f, 8, 2.0f, 1.0f, 0.5f, 1234);
+			int64_t noise_end = APP_Time();
+			Fractal_terrain_3d_square_diamond(height_map, partitions, 1.0f, 0.5f, 1234, &max_height, &min_height);
+			int64_t square_diamond_end = APP_Time();
+			Build_heightmap_mesh(height_map, partitions, wstep, min_height, 65535.0f/(max_height-min_height), terrain_grid_vertices);
+			int64_t mesh_end = APP_Time();
+			Bake_heightmap_normal_map(height_map, partitions, wstep, terrain_normal_map_texels);
+			int64_t normals_end = APP_Time();
+			Bake_heightmap_ao_map(height_map, partitions, wstep, terrain_ao_map_texels);
+			int64_t ao_end = APP_Time();
+			times[0] += (f64)(noise_end-start);
+			times[1] += (f64)(square_diamond_end-noise_end);
+			times[2] += (f64)(mesh_end-square_diamond_end);
+			times[3] += (f64)(normals_end-mesh_end);
+			times[4] += (f64)(ao_end-normals_end);
+		}
+		for (i32 i = 0; i < 5; i += 1) times[i] *= 1e-6/(f64)runs;
+		printf("%7d  %9.2f  %18.2f  %8.2f  %11.2f  %6.2f\n", Jobs_threads_count(), times[0], times[1], times[2], times[3], times[4]);
+		Jobs_deinit();
+	}
+}
+
 int
-main() {
-	if (0 != APP_Init("Fractal terrain", 640, 480)) Panic("Oops");
+main(int argc, char **argv) {
+	for (int i = 1; i < argc; i += 1) {
+		if (strcmp(argv[i], "--headless") == 0) headless = true;
+		else if (strcmp(argv[i], "--check-acmr") == 0) return Check_grid_acmr();
+		else if (strcmp(argv[i], "--check-terrain-mesh") == 0) return Check_terrain_mesh();
+		else if (strcmp(argv[i], "--bench-generators") == 0) {
+			Bench_generators();
+			return 0;
+		}
+		else if (i+1 == argc) break;
+		else if (strcmp(argv[i], "--frame-stats") == 0) frame_stats_path = argv[++i];
+		else if (strcmp(argv[i], "--frames") == 0) frames_to_run = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--capture") == 0) capture_path = argv[++i];
+	}
+	if (headless && frames_to_run <= 0) Panic("--headless needs --frames");
+
+	if (headless) {
+		if (0 != APP_Init_headless(640, 480)) Panic("Oops");
+	}
+	else if (0 != APP_Init("Fractal terrain", 640, 480)) Panic("Oops");
+	Jobs_init(-1);
 	if (0 != GFX_Init()) Panic("Oops");
 	if (0 != mu_Setup(&muctx)) Panic("Oops");
+	if (capture_path) {
+		size_t length = strlen(capture_path);
+		bool ppm = length >= 4 && strcmp(capture_path + length - 4, ".ppm") == 0;
+		CaptureFormat format = ppm ? CAPTURE_FORMAT_PPM : CAPTURE_FORMAT_PNG;
+		if (0 != Capture_start(capture_path, format, APP_Get_window_width(), APP_Get_window_height())) {
+			Panic("Couldn't start the capture");
+		}
+	}
 	muctx.style->colors[MU_COLOR_WINDOWBG].a = 230;
 	
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	glEnable(GL_BLEND);
 
-	{ // Gen texture
-		u32 image_data_size;
-
-		int texture_width, texture_height, channels;
-    	unsigned char *image = stbi_load_from_memory(
-			texture_jpg,
-			texture_jpg_len,
-			&texture_width,
-			&texture_height,
-			&channels,
-			STBI_rgb_alpha
-		);
-
-    	if (image == NULL) {
-    	    fprintf(stderr, "Couldnt load texture\n");
-			return -1;
-    	}
-
-    	glGenTextures(1, &terrain_texture);
-    	glBindTexture(GL_TEXTURE_2D, terrain_texture);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE); // On webgl we need a pow
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE); // of 2 texture or set this
-    	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, texture_width, texture_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
-    	//glGenerateMipmap(GL_TEXTURE_2D);
-
-    	stbi_image_free(image);
+	if (0 != Load_terrain_texture()) {
+		fprintf(stderr, "Couldnt load texture\n");
+		return -1;
 	}
 
     glGenTextures(1, &height_map_texture);
-	GFX_Create_buffer(
-			&height_map_buffer,
-			height_map_vertex_buffer,
-			sizeof(height_map_vertex_buffer),
-			height_map_triangles_buffer,
-			sizeof(height_map_triangles_buffer),
-			GFX_BUFFER_INDEX_TYPE_32
+    glGenTextures(1, &terrain_normal_map);
+    glGenTextures(1, &terrain_ao_map);
+	for (i32 i = 0; i < TERRAIN_MAX_CHUNKS; i += 1) {
+		// The indices are shared by all the chunks, see terrain_lod_indices
+		GFX_Create_buffer_ex(
+				&terrain_chunks[i],
+				terrain_chunks_vertices[i],
+				sizeof(terrain_chunks_vertices[i]),
+				NULL,
+				0,
+				GFX_BUFFER_INDEX_TYPE_16,
+				GFX_VERTEX_LAYOUT_TERRAIN
+			);
+	}
+	GFX_Create_buffer_ex(
+			&rtin_buffer,
+			rtin_vertices,
+			sizeof(rtin_vertices),
+			rtin_indices,
+			sizeof(rtin_indices),
+			GFX_BUFFER_INDEX_TYPE_32,
+			GFX_VERTEX_LAYOUT_TERRAIN
+		);
+	GFX_Create_buffer_ex(
+			&terrain_lod_indices,
+			NULL,
+			0,
+			terrain_lod_indices_mem,
+			sizeof(terrain_lod_indices_mem),
+			GFX_BUFFER_INDEX_TYPE_16,
+			GFX_VERTEX_LAYOUT_TERRAIN
 		);
 
 	return APP_Run_application_loop(App_frame);